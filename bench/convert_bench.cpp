@@ -0,0 +1,216 @@
+/*
+ * convert_bench.cpp
+ *
+ *  Times the host conversions at every SIMD level the cpu supports and checks
+ *  that each level writes the same bytes as the scalar kernels; an odd sized
+ *  I420 to NV12 is also checked sample by sample against its input.
+ *
+ *  usage: convert_bench [width height [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "VideoConvert.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Buffer {
+	std::vector<uint8_t> data;
+
+	explicit Buffer(size_t size) : data(size) {}
+	uint8_t * u8() { return data.data(); }
+	uint16_t * u16() { return (uint16_t *)data.data(); }
+};
+
+// one conversion: the bytes it reads and writes, and the buffers to compare
+struct BenchCase {
+	const char * name;
+	size_t bytes;
+	std::vector<Buffer *> outputs;
+	std::function<void()> run;
+	std::function<bool()> check;	// when set, validates the outputs of every level
+};
+
+static void FillRandom(Buffer & buffer, uint32_t seed, uint16_t mask16 = 0) {
+	uint32_t state = seed;
+	for (size_t i = 0; i < buffer.data.size(); i++) {
+		state = state * 1664525u + 1013904223u;
+		buffer.data[i] = (uint8_t)(state >> 24);
+	}
+	// P016 is msb aligned, the low bits are zero
+	if (mask16) {
+		for (size_t i = 0; i < buffer.data.size() / 2; i++)
+			buffer.u16()[i] &= mask16;
+	}
+}
+
+int main(int argc, char ** argv) {
+	int width = argc > 2 ? atoi(argv[1]) : 1920;
+	int height = argc > 2 ? atoi(argv[2]) : 1080;
+	int iterations = argc > 3 ? atoi(argv[3]) : 50;
+	if (width < 2 || height < 2 || iterations < 1) {
+		fprintf(stderr, "usage: %s [width height [iterations]]\n", argv[0]);
+		return 1;
+	}
+	width &= ~1;
+	height &= ~1;
+	int w2 = width / 2;
+	int h2 = height / 2;
+	size_t pixels = (size_t)width * height;
+
+	// device surface like pitches
+	int pitch8 = (width + 63) & ~63;
+	int pitch16 = (width * 2 + 63) & ~63;
+	Buffer nv12(pitch8 * (height + h2));
+	Buffer p016(pitch16 * (height + h2));
+	Buffer bgr(pixels * 3);
+	Buffer bgra(pixels * 4);
+	FillRandom(nv12, 1);
+	FillRandom(p016, 2, 0xffc0);
+	FillRandom(bgr, 3);
+	FillRandom(bgra, 4);
+	const uint8_t * nv12_uv = nv12.u8() + (size_t)pitch8 * height;
+	const uint16_t * p016_uv = (const uint16_t *)(p016.u8() + (size_t)pitch16 * height);
+
+	int packed_y = Packed10LineSize(width);
+	int packed_uv = Packed10LineSize(w2);
+	Buffer i420_y(pixels), i420_u(pixels / 4), i420_v(pixels / 4);
+	Buffer i420_16y(pixels * 2), i420_16u(pixels / 2), i420_16v(pixels / 2);
+	Buffer p10_y((size_t)packed_y * height), p10_u((size_t)packed_uv * h2), p10_v((size_t)packed_uv * h2);
+	Buffer d8_y(pixels), d8_u(pixels / 4), d8_v(pixels / 4);
+	Buffer nv12_out((size_t)pitch8 * (height + h2));
+	Buffer rgb(pixels * 3), rgba(pixels * 4);
+	Buffer tensor(pixels * 3 * sizeof(float));
+	Buffer dither_nv12((size_t)pitch8 * (height + h2));
+	// I420 input for the encoder side conversion
+	Buffer src_y(pixels), src_u(pixels / 4), src_v(pixels / 4);
+	FillRandom(src_y, 5);
+	FillRandom(src_u, 6);
+	FillRandom(src_v, 7);
+
+	size_t nv12_bytes = pixels * 3 / 2;
+	std::vector<BenchCase> cases;
+	cases.push_back({"nv12_to_i420", nv12_bytes * 2, {&i420_y, &i420_u, &i420_v}, [&] {
+		ConvertNV12ToI420(nv12.u8(), nv12_uv, pitch8, i420_y.u8(), i420_u.u8(), i420_v.u8(), width, w2, width, height);
+	}});
+	cases.push_back({"p016_to_i420", nv12_bytes * 4, {&i420_16y, &i420_16u, &i420_16v}, [&] {
+		ConvertP016ToI420(p016.u16(), p016_uv, pitch16, i420_16y.u16(), i420_16u.u16(), i420_16v.u16(),
+				width * 2, w2 * 2, width, height, 6);
+	}});
+	cases.push_back({"p016_to_packed10", nv12_bytes * 2 + nv12_bytes * 5 / 4, {&p10_y, &p10_u, &p10_v}, [&] {
+		ConvertP016ToI420Packed10(p016.u16(), p016_uv, pitch16, p10_y.u8(), p10_u.u8(), p10_v.u8(),
+				packed_y, packed_uv, width, height);
+	}});
+	cases.push_back({"p016_to_dither8", nv12_bytes * 3, {&d8_y, &d8_u, &d8_v}, [&] {
+		ConvertP016ToI420Dither8(p016.u16(), p016_uv, pitch16, d8_y.u8(), d8_u.u8(), d8_v.u8(),
+				width, w2, width, height);
+	}});
+	cases.push_back({"p016_to_nv12_dither8", nv12_bytes * 3, {&dither_nv12}, [&] {
+		ConvertP016ToNV12Dither8(p016.u16(), p016_uv, pitch16, dither_nv12.u8(),
+				dither_nv12.u8() + (size_t)pitch8 * height, pitch8, width, height);
+	}});
+	cases.push_back({"i420_to_nv12", nv12_bytes * 2, {&nv12_out}, [&] {
+		ConvertI420ToNV12(src_y.u8(), src_u.u8(), src_v.u8(), width, w2, w2,
+				nv12_out.u8(), nv12_out.u8() + (size_t)pitch8 * height, pitch8, width, height);
+	}});
+	// one row and column short, the last chroma row covers a single luma row
+	int odd_w = width - 1;
+	int odd_h = height - 1;
+	BenchCase odd = {"i420_to_nv12_odd", (size_t)odd_w * odd_h * 3, {&nv12_out}, [&] {
+		ConvertI420ToNV12(src_y.u8(), src_u.u8(), src_v.u8(), width, w2, w2,
+				nv12_out.u8(), nv12_out.u8() + (size_t)pitch8 * height, pitch8, odd_w, odd_h);
+	}};
+	odd.check = [&] {
+		const uint8_t * out_uv = nv12_out.u8() + (size_t)pitch8 * height;
+		for (int y = 0; y < odd_h; y++) {
+			if (memcmp(nv12_out.u8() + (size_t)y * pitch8, src_y.u8() + (size_t)y * width, odd_w))
+				return false;
+		}
+		for (int y = 0; y < (odd_h + 1) / 2; y++) {
+			for (int x = 0; x < (odd_w + 1) / 2; x++) {
+				if (out_uv[(size_t)y * pitch8 + x * 2] != src_u.u8()[(size_t)y * w2 + x] ||
+						out_uv[(size_t)y * pitch8 + x * 2 + 1] != src_v.u8()[(size_t)y * w2 + x])
+					return false;
+			}
+		}
+		return true;
+	};
+	cases.push_back(odd);
+	cases.push_back({"bgr_to_nv12", pixels * 3 + nv12_bytes, {&nv12_out}, [&] {
+		ConvertBGRToNV12(bgr.u8(), width * 3, 3, nv12_out.u8(), nv12_out.u8() + (size_t)pitch8 * height, pitch8,
+				width, height, VideoColorMatrix::BT709, VideoColorRange::LIMITED);
+	}});
+	cases.push_back({"bgra_to_nv12", pixels * 4 + nv12_bytes, {&nv12_out}, [&] {
+		ConvertBGRToNV12(bgra.u8(), width * 4, 4, nv12_out.u8(), nv12_out.u8() + (size_t)pitch8 * height, pitch8,
+				width, height, VideoColorMatrix::BT601, VideoColorRange::FULL);
+	}});
+	cases.push_back({"nv12_to_bgr", nv12_bytes + pixels * 3, {&rgb}, [&] {
+		ConvertNV12ToRGB(nv12.u8(), nv12_uv, pitch8, rgb.u8(), width * 3, VideoBaseBandFmt::BGR, width, height,
+				VideoColorMatrix::BT709, VideoColorRange::LIMITED);
+	}});
+	cases.push_back({"nv12_to_rgba", nv12_bytes + pixels * 4, {&rgba}, [&] {
+		ConvertNV12ToRGB(nv12.u8(), nv12_uv, pitch8, rgba.u8(), width * 4, VideoBaseBandFmt::RGBA, width, height,
+				VideoColorMatrix::BT601, VideoColorRange::FULL);
+	}});
+	cases.push_back({"nv12_to_rgb_tensor", nv12_bytes + pixels * 15, {&rgb, &tensor}, [&] {
+		ConvertNV12ToRGB(nv12.u8(), nv12_uv, pitch8, rgb.u8(), width * 3, VideoBaseBandFmt::RGB, width, height,
+				VideoColorMatrix::BT709, VideoColorRange::LIMITED, (float *)tensor.u8());
+	}});
+
+	std::vector<CpuSimdLevel> levels;
+	const CpuSimdLevel candidates[] = { CpuSimdLevel::SCALAR, CpuSimdLevel::SSE2, CpuSimdLevel::AVX2,
+			CpuSimdLevel::AVX512, CpuSimdLevel::NEON };
+	for (CpuSimdLevel level : candidates) {
+		if (SetVideoConvertSimdLevel(level))
+			levels.push_back(level);
+	}
+
+	printf("%dx%d, %d iterations, GB/s counts bytes read and written\n", width, height, iterations);
+	printf("%-22s", "");
+	for (CpuSimdLevel level : levels)
+		printf("%12s", CpuSimdLevelName(level));
+	printf("\n");
+
+	int mismatches = 0;
+	for (BenchCase & c : cases) {
+		printf("%-22s", c.name);
+		// outputs of the scalar level, levels[0]
+		std::vector<std::vector<uint8_t>> reference;
+		for (CpuSimdLevel level : levels) {
+			SetVideoConvertSimdLevel(level);
+			for (Buffer * output : c.outputs)
+				memset(output->u8(), 0, output->data.size());
+			c.run();
+			bool identical = true;
+			for (size_t i = 0; i < c.outputs.size(); i++) {
+				if (level == levels[0])
+					reference.push_back(c.outputs[i]->data);
+				else if (reference[i] != c.outputs[i]->data)
+					identical = false;
+			}
+			if (c.check && !c.check())
+				identical = false;
+
+			Clock::time_point start = Clock::now();
+			for (int i = 0; i < iterations; i++)
+				c.run();
+			double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			printf("%11.2f%c", (double)c.bytes * iterations / seconds / 1e9, identical ? ' ' : '!');
+			if (!identical)
+				mismatches++;
+		}
+		printf("\n");
+	}
+	SetVideoConvertSimdLevel(DetectCpuSimdLevel());
+
+	if (mismatches) {
+		printf("%d results differ from scalar or fail their check (marked !)\n", mismatches);
+		return 1;
+	}
+	printf("all levels bit identical to scalar\n");
+	return 0;
+}
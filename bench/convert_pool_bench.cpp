@@ -0,0 +1,91 @@
+/*
+ * convert_pool_bench.cpp
+ *
+ *  Converts one frame in row bands on VideoConvertPool with 1 .. N workers
+ *  and prints the frame rate per worker count, the way NvVideoDecoder splits
+ *  its host conversion.
+ *
+ *  usage: convert_pool_bench [max_workers [width height [frames]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "VideoConvert.h"
+#include "VideoConvertPool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc, char ** argv) {
+	int max_workers = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	int width = argc > 3 ? atoi(argv[2]) : 3840;
+	int height = argc > 3 ? atoi(argv[3]) : 2160;
+	int frames = argc > 4 ? atoi(argv[4]) : 50;
+	if (max_workers < 1)
+		max_workers = 1;
+	if (width < 2 || height < 2 || frames < 1) {
+		fprintf(stderr, "usage: %s [max_workers [width height [frames]]]\n", argv[0]);
+		return 1;
+	}
+	width &= ~1;
+	height &= ~1;
+
+	int pitch = (width + 63) & ~63;
+	std::vector<uint8_t> nv12((size_t)pitch * (height + height / 2));
+	for (size_t i = 0; i < nv12.size(); i++)
+		nv12[i] = (uint8_t)(i * 7 + (i >> 11));
+	const uint8_t * src_uv = nv12.data() + (size_t)pitch * height;
+	std::vector<uint8_t> i420_y((size_t)width * height), i420_u((size_t)width * height / 4), i420_v(i420_u.size());
+	std::vector<uint8_t> bgr((size_t)width * height * 3);
+
+	printf("%dx%d, %d frames, %s kernels\n", width, height, frames, CpuSimdLevelName(GetVideoConvertSimdLevel()));
+	printf("%8s %8s %16s %8s %16s %8s\n", "workers", "bands", "i420 fps", "speedup", "bgr fps", "speedup");
+
+	double base_i420 = 0;
+	double base_bgr = 0;
+	for (int workers = 1; workers <= max_workers; workers++) {
+		VideoConvertPool pool;
+		// a single worker converts on the calling thread, as convert_threads 0 does
+		if (workers > 1 && !pool.Start(workers)) {
+			fprintf(stderr, "cannot start %d workers\n", workers);
+			return 1;
+		}
+		int band = VideoConvertPool::GetBandRows(pitch * 3 / 2, height, workers);
+		int count = (height + band - 1) / band;
+
+		Clock::time_point start = Clock::now();
+		for (int f = 0; f < frames; f++) {
+			pool.Run(count, [&](int i) {
+				int y0 = i * band;
+				int rows = std::min(height, y0 + band) - y0;
+				ConvertNV12ToI420(nv12.data() + (size_t)y0 * pitch, src_uv + (size_t)(y0 / 2) * pitch, pitch,
+						i420_y.data() + (size_t)y0 * width, i420_u.data() + (size_t)(y0 / 2) * (width / 2),
+						i420_v.data() + (size_t)(y0 / 2) * (width / 2), width, width / 2, width, rows);
+			});
+		}
+		double i420_fps = frames / std::chrono::duration<double>(Clock::now() - start).count();
+
+		start = Clock::now();
+		for (int f = 0; f < frames; f++) {
+			pool.Run(count, [&](int i) {
+				int y0 = i * band;
+				int rows = std::min(height, y0 + band) - y0;
+				ConvertNV12ToRGB(nv12.data() + (size_t)y0 * pitch, src_uv + (size_t)(y0 / 2) * pitch, pitch,
+						bgr.data() + (size_t)y0 * width * 3, width * 3, VideoBaseBandFmt::BGR, width, rows,
+						VideoColorMatrix::BT709, VideoColorRange::LIMITED);
+			});
+		}
+		double bgr_fps = frames / std::chrono::duration<double>(Clock::now() - start).count();
+
+		if (workers == 1) {
+			base_i420 = i420_fps;
+			base_bgr = bgr_fps;
+		}
+		printf("%8d %8d %16.1f %7.2fx %16.1f %7.2fx\n", workers, count,
+				i420_fps, i420_fps / base_i420, bgr_fps, bgr_fps / base_bgr);
+	}
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * frame_queue_bench.cpp
+ *
+ *  Release to wake latency of FrameQueue::waitUntilFrameAvailable against
+ *  the Sleep(1) polling it replaced, then a decode on the mock driver with
+ *  so few surfaces that the parser waits on the output thread for each one.
+ *
+ *  usage: frame_queue_bench [samples]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "FrameQueue.h"
+#include "MockDriver.h"
+#include "NvVideoDecoder.h"
+#include "NvVideoEncoder.h"
+
+typedef std::chrono::steady_clock Clock;
+
+enum class WaitMode {
+	CONDITION,		// FrameQueue::waitUntilFrameAvailable
+	POLLING			// the loop it replaced
+};
+
+static void PrintLatencies(const char * name, std::vector<double> & us) {
+	std::sort(us.begin(), us.end());
+	size_t n = us.size();
+	printf("%-22s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+			us[n / 2], us[std::min(n - 1, n * 99 / 100)], us[n - 1]);
+}
+
+// A waiter blocks on a picture in use, the main thread releases it and the
+// time until the waiter returns is one sample.
+static std::vector<double> MeasureWake(WaitMode mode, int samples) {
+	CUVIDFrameQueue queue(nullptr);
+	std::atomic<int> armed(0);
+	std::atomic<int> woken(0);
+	std::atomic<int64_t> wake_time(0);
+	std::atomic<bool> done(false);
+
+	std::thread waiter([&] {
+		for (int n = 1; ; n++) {
+			while (armed.load() < n && !done.load())
+				std::this_thread::yield();
+			if (done.load())
+				return;
+			if (mode == WaitMode::CONDITION) {
+				queue.waitUntilFrameAvailable(0);
+			} else {
+				while (queue.isInUse(0))
+					usleep(1000);
+			}
+			wake_time = Clock::now().time_since_epoch().count();
+			woken = n;
+		}
+	});
+
+	std::vector<double> us;
+	CUVIDPARSERDISPINFO info;
+	memset(&info, 0, sizeof(info));
+	for (int n = 1; n <= samples; n++) {
+		queue.enqueue(&info);
+		queue.dequeue(&info);
+		armed = n;
+		// long enough for the waiter to block, varied so the release does not
+		// lock onto the polling period
+		std::this_thread::sleep_for(std::chrono::microseconds(2000 + n * 137 % 1000));
+		int64_t release_time = Clock::now().time_since_epoch().count();
+		queue.releaseFrame(&info);
+		while (woken.load() < n)
+			std::this_thread::yield();
+		us.push_back(std::chrono::duration<double, std::micro>(Clock::duration(wake_time.load() - release_time)).count());
+	}
+	done = true;
+	waiter.join();
+	return us;
+}
+
+struct Packets {
+	std::vector<std::vector<unsigned char>> data;
+};
+
+static void OnBitstream(MediaDataBitStream & bs, void * user_data) {
+	Packets * packets = (Packets *)user_data;
+	packets->data.push_back(std::vector<unsigned char>(bs.buffer, bs.buffer + bs.buffer_len));
+}
+
+static const int kCallbackUs = 500;
+
+static void OnFrame(VideoRawData & data, void * user_data) {
+	(*(int *)user_data)++;
+	std::this_thread::sleep_for(std::chrono::microseconds(kCallbackUs));
+}
+
+// Decodes the packets with an output thread, returns the time in ms.
+static double DecodeMs(const Packets & packets, int surfaces, int & decoded) {
+	decoded = 0;
+	NvVideoDecoder * decoder = new NvVideoDecoder();
+	VideoDecodeParam param;
+	param.codec = VideoCodec::H264;
+	param.decode_surfaces = surfaces;
+	param.display_delay = 0;
+	param.output_queue_depth = 1;
+	param.luma_only = true;
+	if (!decoder->Start(param, OnFrame, &decoded)) {
+		delete decoder;
+		return -1;
+	}
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < packets.data.size(); i++) {
+		MediaDataBitStream bs;
+		bs.buffer = (unsigned char *)packets.data[i].data();
+		bs.buffer_len = (int)packets.data[i].size();
+		bs.pts = i;
+		decoder->InputData(bs);
+	}
+	decoder->Stop();
+	double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	delete decoder;
+	return ms;
+}
+
+// With 2 surfaces every picture waits for the surface the output thread is
+// still holding, with 8 none does; the difference per frame is what those
+// waits cost on top of the callback.
+static bool MeasureMockDecode(int frames) {
+	MockDriverConfig config;
+	config.width = 640;
+	config.height = 360;
+	MockDriver::Enable(config);
+
+	Packets packets;
+	{
+		NvVideoEncoder encoder;
+		VideoParam param;
+		param.codec = VideoCodec::H264;
+		param.width = config.width;
+		param.height = config.height;
+		param.frame_rate_num = 30;
+		param.frame_rate_den = 1;
+		param.gop_size = 30;
+		param.bit_rate = 1000000;
+		if (!encoder.Start(param, OnBitstream, &packets))
+			return false;
+		std::vector<unsigned char> frame(config.width * config.height * 3 / 2, 128);
+		for (int i = 0; i < frames; i++) {
+			VideoRawData data;
+			data.width = config.width;
+			data.height = config.height;
+			data.fmt = VideoBaseBandFmt::YUV420P;
+			data.pts = i;
+			data.buffer[0] = frame.data();
+			data.buffer[1] = frame.data() + config.width * config.height;
+			data.buffer[2] = data.buffer[1] + config.width * config.height / 4;
+			data.line_size[0] = config.width;
+			data.line_size[1] = data.line_size[2] = config.width / 2;
+			encoder.InputData(data);
+		}
+		encoder.Stop();
+	}
+
+	int waiting_frames = 0;
+	int free_frames = 0;
+	double waiting_ms = DecodeMs(packets, 2, waiting_frames);
+	double free_ms = DecodeMs(packets, 8, free_frames);
+	if (waiting_ms < 0 || free_ms < 0 || waiting_frames != free_frames || waiting_frames == 0)
+		return false;
+	printf("mock decode, %d us callback: 2 surfaces %.1f ms, 8 surfaces %.1f ms for %d frames, "
+			"%.1f us per frame waiting for surfaces\n", kCallbackUs, waiting_ms, free_ms, waiting_frames,
+			(waiting_ms - free_ms) * 1000 / waiting_frames);
+	return true;
+}
+
+int main(int argc, char ** argv) {
+	int samples = argc > 1 ? atoi(argv[1]) : 500;
+	if (samples < 1) {
+		fprintf(stderr, "usage: %s [samples]\n", argv[0]);
+		return 1;
+	}
+	std::vector<double> condition = MeasureWake(WaitMode::CONDITION, samples);
+	std::vector<double> polling = MeasureWake(WaitMode::POLLING, samples);
+	printf("release to wake, %d samples\n", samples);
+	PrintLatencies("condition variable", condition);
+	PrintLatencies("Sleep(1) polling", polling);
+
+	if (!MeasureMockDecode(samples)) {
+		fprintf(stderr, "mock decode failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * mock_pipeline_bench.cpp
+ *
+ *  Runs the pipelines end to end on the mock driver: AsyncVideoEncoder makes
+ *  the stream, AsyncVideoDecoder decodes it back and checks the pictures,
+ *  DecodeScheduler decodes it on many streams and VideoTranscoder encodes
+ *  it again from the decoder surfaces. Fails when a stage loses a frame.
+ *
+ *  usage: mock_pipeline_bench [frames [streams [workers]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "AsyncVideoCodec.h"
+#include "DecodeScheduler.h"
+#include "MockDriver.h"
+#include "NvVideoDecoder.h"
+#include "VideoTranscoder.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const int kWidth = 640;
+static const int kHeight = 360;
+static const int kDecodeLatencyUs = 200;
+static const int kEncodeLatencyUs = 300;
+
+static double ElapsedMs(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static void ToBitstream(EncodedPacket & packet, MediaDataBitStream & bs) {
+	bs.buffer = packet.data.data();
+	bs.buffer_len = (int)packet.data.size();
+	bs.pts = packet.pts;
+}
+
+static bool EncodeStream(int frames, std::vector<EncodedPacket> & packets) {
+	AsyncVideoEncoder encoder;
+	VideoParam param;
+	param.codec = VideoCodec::H264;
+	param.width = kWidth;
+	param.height = kHeight;
+	param.frame_rate_num = 30;
+	param.frame_rate_den = 1;
+	param.gop_size = 30;
+	param.bit_rate = 1000000;
+	if (!encoder.Start(param))
+		return false;
+
+	Clock::time_point start = Clock::now();
+	std::vector<unsigned char> frame(kWidth * kHeight * 3 / 2);
+	for (int i = 0; i < frames; i++) {
+		// a different picture each time, the decoded check needs distinct seeds
+		for (size_t j = 0; j < frame.size(); j++)
+			frame[j] = (unsigned char)(j * 3 + i * 17);
+		VideoRawData data;
+		data.width = kWidth;
+		data.height = kHeight;
+		data.fmt = VideoBaseBandFmt::YUV420P;
+		data.pts = i;
+		data.buffer[0] = frame.data();
+		data.buffer[1] = frame.data() + kWidth * kHeight;
+		data.buffer[2] = data.buffer[1] + kWidth * kHeight / 4;
+		data.line_size[0] = kWidth;
+		data.line_size[1] = data.line_size[2] = kWidth / 2;
+		// the frame buffer is reused, so each submit is waited for
+		if (!encoder.Submit(data).Get())
+			return false;
+	}
+	if (!encoder.Stop().Get())
+		return false;
+	for (;;) {
+		EncodedPacket packet = encoder.Packets().Pop().Get();
+		if (packet.data.empty())
+			break;
+		packets.push_back(std::move(packet));
+	}
+	printf("AsyncVideoEncoder   %4d frames   %8.1f ms\n", frames, ElapsedMs(start));
+	return (int)packets.size() == frames;
+}
+
+// The mock decodes a picture into the FrameSample pattern seeded by its bytes.
+static bool DecodeAsync(std::vector<EncodedPacket> & packets) {
+	AsyncVideoDecoder decoder;
+	VideoDecodeParam param;
+	param.codec = VideoCodec::H264;
+	if (!decoder.Start(param))
+		return false;
+
+	Clock::time_point start = Clock::now();
+	std::vector<AsyncOp<bool>> ops;
+	for (size_t i = 0; i < packets.size(); i++) {
+		MediaDataBitStream bs;
+		ToBitstream(packets[i], bs);
+		ops.push_back(decoder.Submit(bs));
+	}
+	bool ok = true;
+	for (size_t i = 0; i < ops.size(); i++)
+		ok = ops[i].Get() && ok;
+	ok = decoder.Stop().Get() && ok;
+
+	size_t decoded = 0;
+	int bad = 0;
+	for (;;) {
+		DecodedFrame frame = decoder.Frames().Pop().Get();
+		if (frame.width == 0)
+			break;
+		if (decoded < packets.size() && frame.pts == packets[decoded].pts) {
+			uint32_t seed = MockDriver::FrameSeed(packets[decoded].data.data(), packets[decoded].data.size());
+			for (int y = 0; y < frame.height; y += 37) {
+				for (int x = 0; x < frame.width; x += 29) {
+					if (frame.planes[0][(size_t)y * frame.line_size[0] + x] != MockDriver::FrameSample(seed, 0, x, y))
+						bad++;
+				}
+			}
+		} else
+			bad++;
+		decoded++;
+	}
+	printf("AsyncVideoDecoder   %4zu frames   %8.1f ms   %d wrong samples or pts\n", decoded, ElapsedMs(start), bad);
+	return ok && decoded == packets.size() && bad == 0;
+}
+
+static void CountFrame(VideoRawData & data, void * user_data) {
+	(*(std::atomic<int> *)user_data)++;
+}
+
+static bool DecodeScheduled(std::vector<EncodedPacket> & packets, int streams, int workers) {
+	DecodeScheduler scheduler;
+	if (!scheduler.Start(workers))
+		return false;
+	std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[streams]);
+	std::vector<std::unique_ptr<NvVideoDecoder>> decoders;
+	std::vector<int> ids;
+	for (int i = 0; i < streams; i++) {
+		counts[i] = 0;
+		decoders.push_back(std::unique_ptr<NvVideoDecoder>(new NvVideoDecoder()));
+		VideoDecodeParam param;
+		param.codec = VideoCodec::H264;
+		if (!decoders[i]->Start(param, CountFrame, &counts[i]))
+			return false;
+		ids.push_back(scheduler.AddStream(decoders[i].get()));
+	}
+
+	Clock::time_point start = Clock::now();
+	for (size_t k = 0; k < packets.size(); k++) {
+		for (int i = 0; i < streams; i++) {
+			MediaDataBitStream bs;
+			ToBitstream(packets[k], bs);
+			while (!scheduler.InputData(ids[i], bs))
+				std::this_thread::yield();
+		}
+	}
+	// Stop drains the queues and flushes every decoder
+	scheduler.Stop();
+	double ms = ElapsedMs(start);
+
+	int total = 0;
+	bool ok = true;
+	for (int i = 0; i < streams; i++) {
+		total += counts[i];
+		ok = counts[i] == (int)packets.size() && ok;
+	}
+	printf("DecodeScheduler     %4d frames   %8.1f ms   %d streams on %d workers\n", total, ms, streams, workers);
+	return ok;
+}
+
+static void CountBitstream(MediaDataBitStream & bs, void * user_data) {
+	(*(int *)user_data)++;
+}
+
+static bool Transcode(std::vector<EncodedPacket> & packets) {
+	VideoTranscoder transcoder;
+	VideoDecodeParam decode;
+	decode.codec = VideoCodec::H264;
+	VideoParam encode;
+	encode.codec = VideoCodec::H264;
+	encode.frame_rate_num = 30;
+	encode.frame_rate_den = 1;
+	encode.gop_size = 30;
+	encode.bit_rate = 1000000;
+	int encoded = 0;
+	if (!transcoder.Start(decode, encode, CountBitstream, &encoded))
+		return false;
+
+	MockDriverStats before = MockDriver::GetStats();
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < packets.size(); i++) {
+		MediaDataBitStream bs;
+		ToBitstream(packets[i], bs);
+		transcoder.InputData(bs);
+	}
+	bool ok = transcoder.Stop();
+	double ms = ElapsedMs(start);
+	MockDriverStats after = MockDriver::GetStats();
+	printf("VideoTranscoder     %4d frames   %8.1f ms   %llu mapped, %llu bytes copied\n", encoded, ms,
+			(unsigned long long)(after.frames_mapped - before.frames_mapped),
+			(unsigned long long)(after.bytes_copied - before.bytes_copied));
+	return ok && encoded == (int)packets.size();
+}
+
+int main(int argc, char ** argv) {
+	int frames = argc > 1 ? atoi(argv[1]) : 120;
+	int streams = argc > 2 ? atoi(argv[2]) : 8;
+	int workers = argc > 3 ? atoi(argv[3]) : 4;
+	if (frames < 1 || streams < 1 || workers < 1) {
+		fprintf(stderr, "usage: %s [frames [streams [workers]]]\n", argv[0]);
+		return 1;
+	}
+	MockDriverConfig config;
+	config.width = kWidth;
+	config.height = kHeight;
+	config.decode_latency_us = kDecodeLatencyUs;
+	config.encode_latency_us = kEncodeLatencyUs;
+	MockDriver::Enable(config);
+	printf("mock %dx%d, %d us per decoded and %d us per encoded picture\n",
+			kWidth, kHeight, kDecodeLatencyUs, kEncodeLatencyUs);
+
+	std::vector<EncodedPacket> packets;
+	if (!EncodeStream(frames, packets)) {
+		fprintf(stderr, "async encode failed\n");
+		return 1;
+	}
+	if (!DecodeAsync(packets)) {
+		fprintf(stderr, "async decode failed\n");
+		return 1;
+	}
+	if (!DecodeScheduled(packets, streams, workers)) {
+		fprintf(stderr, "scheduled decode failed\n");
+		return 1;
+	}
+	if (!Transcode(packets)) {
+		fprintf(stderr, "transcode failed\n");
+		return 1;
+	}
+	return 0;
+}
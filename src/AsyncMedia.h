@@ -0,0 +1,169 @@
+/*
+ * AsyncMedia.h
+ *
+ *  Awaitable results and completion queues for the asynchronous codec API.
+ */
+
+#ifndef SRC_ASYNCMEDIA_H_
+#define SRC_ASYNCMEDIA_H_
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+// Result of an asynchronous operation. Works like a std::future (Wait, Get)
+// and, when compiled as C++20, can be co_awaited: the awaiting coroutine is
+// resumed on the thread that completes the operation. Copies share the
+// result, Get moves it out and may be called once.
+template <typename T>
+class AsyncOp {
+public:
+	AsyncOp() : m_state(std::make_shared<State>()) {}
+
+	bool IsReady() const {
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		return m_state->done;
+	}
+	void Wait() const {
+		std::unique_lock<std::mutex> lock(m_state->mutex);
+		while (!m_state->done)
+			m_state->cond.wait(lock);
+	}
+	// false on timeout
+	bool WaitFor(int milliseconds) const {
+		std::unique_lock<std::mutex> lock(m_state->mutex);
+		return m_state->cond.wait_for(lock, std::chrono::milliseconds(milliseconds),
+				[this] { return m_state->done; });
+	}
+	T Get() {
+		Wait();
+		return std::move(m_state->value);
+	}
+
+	// Completes the operation, once.
+	void SetValue(T value) {
+#if defined(__cpp_impl_coroutine)
+		std::coroutine_handle<> waiter;
+#endif
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			m_state->value = std::move(value);
+			m_state->done = true;
+#if defined(__cpp_impl_coroutine)
+			std::swap(waiter, m_state->waiter);
+#endif
+		}
+		m_state->cond.notify_all();
+#if defined(__cpp_impl_coroutine)
+		if (waiter)
+			waiter.resume();
+#endif
+	}
+
+#if defined(__cpp_impl_coroutine)
+	bool await_ready() const { return IsReady(); }
+	bool await_suspend(std::coroutine_handle<> handle) {
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		if (m_state->done)
+			return false;
+		m_state->waiter = handle;
+		return true;
+	}
+	T await_resume() { return std::move(m_state->value); }
+#endif
+
+private:
+	struct State {
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool done = false;
+		T value = T();
+#if defined(__cpp_impl_coroutine)
+		std::coroutine_handle<> waiter;
+#endif
+	};
+	std::shared_ptr<State> m_state;
+};
+
+// Results in completion order. Poll with TryPop, or Pop for an AsyncOp that
+// completes with the next result (waiting Pops are served first come first
+// served). Once closed and drained, Pop completes with a default T.
+template <typename T>
+class CompletionQueue {
+public:
+	void Push(T value) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_waiters.empty()) {
+			m_items.push_back(std::move(value));
+			return;
+		}
+		AsyncOp<T> op = m_waiters.front();
+		m_waiters.pop_front();
+		lock.unlock();
+		op.SetValue(std::move(value));
+	}
+
+	bool TryPop(T & value) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_items.empty())
+			return false;
+		value = std::move(m_items.front());
+		m_items.pop_front();
+		return true;
+	}
+
+	AsyncOp<T> Pop() {
+		AsyncOp<T> op;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_items.empty()) {
+			if (!m_closed) {
+				m_waiters.push_back(op);
+				return op;
+			}
+			lock.unlock();
+			op.SetValue(T());
+			return op;
+		}
+		T value = std::move(m_items.front());
+		m_items.pop_front();
+		lock.unlock();
+		op.SetValue(std::move(value));
+		return op;
+	}
+
+	size_t Size() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_items.size();
+	}
+
+	// Completes the waiting Pops with a default T. Open clears a closed queue.
+	void Close() {
+		std::deque<AsyncOp<T>> waiters;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			waiters.swap(m_waiters);
+		}
+		for (size_t i = 0; i < waiters.size(); i++)
+			waiters[i].SetValue(T());
+	}
+	void Open() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = false;
+		m_items.clear();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::deque<T> m_items;
+	std::deque<AsyncOp<T>> m_waiters;
+	bool m_closed = false;
+};
+
+#endif /* SRC_ASYNCMEDIA_H_ */
@@ -0,0 +1,159 @@
+/*
+ * AsyncVideoCodec.cpp
+ *
+ *  Asynchronous front-ends of NvVideoDecoder and NvVideoEncoder: submit
+ *  returns an AsyncOp, decoded frames and bitstreams go to completion queues.
+ */
+
+#include "AsyncVideoCodec.h"
+
+#include <memory>
+#include <system_error>
+
+AsyncTaskThread::~AsyncTaskThread() {
+	Stop();
+}
+
+bool AsyncTaskThread::Start() {
+	if (m_thread.joinable())
+		return true;
+	m_exit = false;
+	try {
+		m_thread = std::thread(&AsyncTaskThread::Loop, this);
+	} catch (const std::system_error &) {
+		return false;
+	}
+	return true;
+}
+
+void AsyncTaskThread::Stop() {
+	if (!m_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+void AsyncTaskThread::Post(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_cond.notify_one();
+}
+
+void AsyncTaskThread::Loop() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		while (m_tasks.empty() && !m_exit)
+			m_cond.wait(lock);
+		if (m_tasks.empty())
+			return;
+		std::function<void()> task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+}
+
+AsyncVideoDecoder::~AsyncVideoDecoder() {
+	m_task_thread.Stop();
+	m_frames.Close();
+}
+
+bool AsyncVideoDecoder::Start(VideoDecodeParam & param) {
+	if (!param.download_gpu_buffer)
+		return false;
+	m_frames.Open();
+	if (!m_decoder.Start(param, OnFrame, this))
+		return false;
+	return m_task_thread.Start();
+}
+
+AsyncOp<bool> AsyncVideoDecoder::Submit(MediaDataBitStream & bs) {
+	AsyncOp<bool> op;
+	std::shared_ptr<std::vector<unsigned char>> packet =
+			std::make_shared<std::vector<unsigned char>>(bs.buffer, bs.buffer + bs.buffer_len);
+	int64_t pts = bs.pts;
+	m_task_thread.Post([this, op, packet, pts]() mutable {
+		MediaDataBitStream data;
+		data.buffer = packet->data();
+		data.buffer_len = (int)packet->size();
+		data.pts = pts;
+		op.SetValue(m_decoder.InputData(data) != 0);
+	});
+	return op;
+}
+
+AsyncOp<bool> AsyncVideoDecoder::Stop() {
+	AsyncOp<bool> op;
+	m_task_thread.Post([this, op]() mutable {
+		bool ok = m_decoder.Stop();
+		m_frames.Close();
+		op.SetValue(ok);
+	});
+	return op;
+}
+
+void AsyncVideoDecoder::OnFrame(VideoRawData & data, void * user_data) {
+	AsyncVideoDecoder * obj = (AsyncVideoDecoder *)user_data;
+	DecodedFrame frame;
+	frame.width = data.width;
+	frame.height = data.height;
+	frame.fmt = data.fmt;
+	frame.bit_depth = data.bit_depth;
+	frame.pts = data.pts;
+	for (int i = 0; i < 3; i++) {
+		if (!data.buffer[i] || data.line_size[i] <= 0)
+			continue;
+		int rows = i == 0 ? data.height : (data.height + 1) / 2;
+		frame.line_size[i] = data.line_size[i];
+		frame.planes[i].assign(data.buffer[i], data.buffer[i] + (size_t)data.line_size[i] * rows);
+	}
+	obj->m_frames.Push(std::move(frame));
+}
+
+AsyncVideoEncoder::~AsyncVideoEncoder() {
+	m_task_thread.Stop();
+	m_packets.Close();
+}
+
+bool AsyncVideoEncoder::Start(VideoParam & param) {
+	m_packets.Open();
+	if (!m_encoder.Start(param, OnBitstream, this))
+		return false;
+	return m_task_thread.Start();
+}
+
+AsyncOp<bool> AsyncVideoEncoder::Submit(VideoRawData & data) {
+	AsyncOp<bool> op;
+	VideoRawData frame = data;
+	m_task_thread.Post([this, op, frame]() mutable {
+		op.SetValue(m_encoder.InputData(frame));
+	});
+	return op;
+}
+
+AsyncOp<bool> AsyncVideoEncoder::Stop() {
+	AsyncOp<bool> op;
+	m_task_thread.Post([this, op]() mutable {
+		bool ok = m_encoder.Stop();
+		m_packets.Close();
+		op.SetValue(ok);
+	});
+	return op;
+}
+
+void AsyncVideoEncoder::OnBitstream(MediaDataBitStream & bs, void * user_data) {
+	AsyncVideoEncoder * obj = (AsyncVideoEncoder *)user_data;
+	EncodedPacket packet;
+	packet.data.assign(bs.buffer, bs.buffer + bs.buffer_len);
+	packet.pts = bs.pts;
+	packet.dts = bs.dts;
+	packet.is_key = bs.is_key;
+	obj->m_packets.Push(std::move(packet));
+}
@@ -0,0 +1,113 @@
+/*
+ * AsyncVideoCodec.h
+ *
+ *  Asynchronous front-ends of NvVideoDecoder and NvVideoEncoder: submit
+ *  returns an AsyncOp, decoded frames and bitstreams go to completion queues.
+ */
+
+#ifndef SRC_ASYNCVIDEOCODEC_H_
+#define SRC_ASYNCVIDEOCODEC_H_
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "AsyncMedia.h"
+#include "MediaDef.h"
+#include "NvVideoDecoder.h"
+#include "NvVideoEncoder.h"
+
+// A downloaded frame that owns its planes, plane i has line_size[i] bytes
+// per row. width is 0 for the item a closed queue hands out.
+struct DecodedFrame {
+	int width = 0;
+	int height = 0;
+	int line_size[3] = {0};
+	VideoBaseBandFmt fmt = VideoBaseBandFmt::NONE;
+	int bit_depth = 8;
+	int64_t pts = 0;
+	std::vector<unsigned char> planes[3];
+};
+
+// An encoded picture that owns its bytes, empty for the item a closed queue
+// hands out.
+struct EncodedPacket {
+	std::vector<unsigned char> data;
+	int64_t pts = 0;
+	int64_t dts = 0;
+	bool is_key = false;
+};
+
+// One thread running posted tasks in order.
+class AsyncTaskThread {
+public:
+	AsyncTaskThread() = default;
+	~AsyncTaskThread();
+	AsyncTaskThread(const AsyncTaskThread &) = delete;
+	AsyncTaskThread & operator=(const AsyncTaskThread &) = delete;
+
+	bool Start();
+	// runs the tasks already posted, then joins
+	void Stop();
+	void Post(std::function<void()> task);
+
+private:
+	void Loop();
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_exit = false;
+};
+
+class AsyncVideoDecoder {
+public:
+	AsyncVideoDecoder() = default;
+	~AsyncVideoDecoder();
+
+	// param.download_gpu_buffer must be set, frames are copied out of the
+	// decoder's buffers. The tensor output is not part of DecodedFrame.
+	bool Start(VideoDecodeParam & param);
+	// Copies the packet, it is parsed on the decoder's task thread. Completes
+	// with the InputData result once parsed, the frames it produced are in
+	// Frames() by then.
+	AsyncOp<bool> Submit(MediaDataBitStream & bs);
+	// Flushes the decoder, closes Frames() after the last frame.
+	AsyncOp<bool> Stop();
+	CompletionQueue<DecodedFrame> & Frames() { return m_frames; }
+
+private:
+	static void OnFrame(VideoRawData & data, void * user_data);
+
+	// the decoder goes first on destruction, its flush still delivers frames
+	CompletionQueue<DecodedFrame> m_frames;
+	AsyncTaskThread m_task_thread;
+	NvVideoDecoder m_decoder;
+};
+
+class AsyncVideoEncoder {
+public:
+	AsyncVideoEncoder() = default;
+	~AsyncVideoEncoder();
+
+	bool Start(VideoParam & param);
+	// Encodes on the encoder's task thread; the frame's buffers must stay
+	// valid until the result completes (the frame is then in an encode
+	// buffer). Bitstreams go to Packets().
+	AsyncOp<bool> Submit(VideoRawData & data);
+	// Flushes the encoder, closes Packets() after the last bitstream.
+	AsyncOp<bool> Stop();
+	CompletionQueue<EncodedPacket> & Packets() { return m_packets; }
+
+private:
+	static void OnBitstream(MediaDataBitStream & bs, void * user_data);
+
+	CompletionQueue<EncodedPacket> m_packets;
+	AsyncTaskThread m_task_thread;
+	NvVideoEncoder m_encoder;
+};
+
+#endif /* SRC_ASYNCVIDEOCODEC_H_ */
@@ -0,0 +1,97 @@
+/*
+ * CudaContextPool.cpp
+ *
+ *  One CUDA context and ctx lock per device, shared by every decoder and
+ *  encoder of the process.
+ */
+
+#include "CudaContextPool.h"
+
+#include <map>
+#include <mutex>
+
+namespace {
+
+struct PooledContext {
+	CUcontext ctx;
+	CUvideoctxlock lock;
+	int refs;
+};
+
+// never destroyed, sessions may outlive static destruction
+std::mutex & PoolMutex() {
+	static std::mutex * mutex = new std::mutex();
+	return *mutex;
+}
+
+std::map<int, PooledContext> & PoolContexts() {
+	static std::map<int, PooledContext> * contexts = new std::map<int, PooledContext>();
+	return *contexts;
+}
+
+}
+
+bool CudaContextPool::Acquire(int device, CUcontext & ctx, CUvideoctxlock & lock) {
+	std::lock_guard<std::mutex> guard(PoolMutex());
+	std::map<int, PooledContext> & contexts = PoolContexts();
+	std::map<int, PooledContext>::iterator it = contexts.find(device);
+	if (it != contexts.end()) {
+		it->second.refs++;
+		ctx = it->second.ctx;
+		lock = it->second.lock;
+		return true;
+	}
+
+	CUdevice cu_device;
+	if (cuvidInit() != CUDA_SUCCESS || cuDeviceGet(&cu_device, device) != CUDA_SUCCESS)
+		return false;
+	PooledContext entry = {nullptr, nullptr, 1};
+	if (cuCtxCreate(&entry.ctx, CU_CTX_SCHED_AUTO, cu_device) != CUDA_SUCCESS)
+		return false;
+	CUcontext current;
+	cuCtxPopCurrent(&current);
+	if (cuvidCtxLockCreate(&entry.lock, entry.ctx) != CUDA_SUCCESS) {
+		cuCtxDestroy(entry.ctx);
+		return false;
+	}
+	contexts[device] = entry;
+	ctx = entry.ctx;
+	lock = entry.lock;
+	return true;
+}
+
+void CudaContextPool::Release(CUcontext ctx) {
+	if (!ctx)
+		return;
+	std::lock_guard<std::mutex> guard(PoolMutex());
+	std::map<int, PooledContext> & contexts = PoolContexts();
+	for (std::map<int, PooledContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+		if (it->second.ctx != ctx)
+			continue;
+		if (--it->second.refs > 0)
+			return;
+		cuvidCtxLockDestroy(it->second.lock);
+		cuCtxDestroy(it->second.ctx);
+		contexts.erase(it);
+		return;
+	}
+}
+
+int CudaContextPool::GetRefCount(int device) {
+	std::lock_guard<std::mutex> guard(PoolMutex());
+	std::map<int, PooledContext> & contexts = PoolContexts();
+	std::map<int, PooledContext>::iterator it = contexts.find(device);
+	return it != contexts.end() ? it->second.refs : 0;
+}
+
+bool CudaContextPool::GetMemInfo(int device, size_t & free_memory, size_t & total_memory) {
+	std::lock_guard<std::mutex> guard(PoolMutex());
+	std::map<int, PooledContext> & contexts = PoolContexts();
+	std::map<int, PooledContext>::iterator it = contexts.find(device);
+	if (it == contexts.end() || cuCtxPushCurrent(it->second.ctx) != CUDA_SUCCESS)
+		return false;
+	CUresult cu_result = cuMemGetInfo(&free_memory, &total_memory);
+	CUcontext current;
+	cuCtxPopCurrent(&current);
+	return cu_result == CUDA_SUCCESS;
+}
@@ -0,0 +1,34 @@
+/*
+ * CudaContextPool.h
+ *
+ *  One CUDA context and ctx lock per device, shared by every decoder and
+ *  encoder of the process.
+ */
+
+#ifndef SRC_CUDACONTEXTPOOL_H_
+#define SRC_CUDACONTEXTPOOL_H_
+
+#include <stddef.h>
+#include "dynlink_cuda.h"
+#include "dynlink_nvcuvid.h"
+
+// Sessions borrow the context of their device instead of creating their own,
+// so a hundred sessions on one GPU cost one context and may pass device
+// pointers to each other. The ctx lock is shared too: it serializes the
+// sessions' use of the context just as it did within one session.
+class CudaContextPool {
+public:
+	// Borrows the context of device ordinal device, creating it on first
+	// use; cuInit must have succeeded. The context is not left current.
+	// Every successful Acquire is paired with a Release.
+	static bool Acquire(int device, CUcontext & ctx, CUvideoctxlock & lock);
+	// The last Release of a context destroys it and its lock, so the
+	// session's resources in it must be freed before.
+	static void Release(CUcontext ctx);
+	// sessions holding the device's context
+	static int GetRefCount(int device);
+	// cuMemGetInfo of the device, false while it has no context
+	static bool GetMemInfo(int device, size_t & free_memory, size_t & total_memory);
+};
+
+#endif /* SRC_CUDACONTEXTPOOL_H_ */
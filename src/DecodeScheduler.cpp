@@ -0,0 +1,222 @@
+/*
+ * DecodeScheduler.cpp
+ *
+ *  Runs many NvVideoDecoder streams on a fixed pool of worker threads.
+ */
+
+#include "DecodeScheduler.h"
+
+#include <string.h>
+#include <system_error>
+#include "NvVideoDecoder.h"
+#include "VideoConvertPool.h"
+
+// packets a stream decodes per turn before the next stream gets the worker
+static const int kTurnPackets = 4;
+
+DecodeScheduler::~DecodeScheduler() {
+	Stop();
+}
+
+bool DecodeScheduler::Start(int workers, const int * cpus, int cpu_count) {
+	Stop();
+	if (workers <= 0)
+		workers = std::thread::hardware_concurrency();
+	if (workers <= 0)
+		workers = 1;
+
+	m_exit = false;
+	m_runnable = 0;
+	for (int i = 0; i < workers; i++) {
+		m_run_queues.push_back(new RunQueue());
+	}
+	try {
+		for (int i = 0; i < workers; i++) {
+			m_workers.push_back(std::thread(&DecodeScheduler::WorkerLoop, this, i));
+			if (cpus && cpu_count > 0 && !SetThreadAffinity(m_workers.back(), cpus[i % cpu_count])) {
+				Stop();
+				return false;
+			}
+		}
+	} catch (const std::system_error &) {
+		Stop();
+		return false;
+	}
+	return true;
+}
+
+void DecodeScheduler::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_work_mutex);
+		m_exit = true;
+	}
+	m_work_cond.notify_all();
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		m_workers[i].join();
+	}
+	m_workers.clear();
+	for (size_t i = 0; i < m_run_queues.size(); i++) {
+		delete m_run_queues[i];
+	}
+	m_run_queues.clear();
+
+	std::lock_guard<std::mutex> lock(m_streams_mutex);
+	for (size_t i = 0; i < m_streams.size(); i++) {
+		if (!m_streams[i])
+			continue;
+		m_streams[i]->decoder->Stop();
+		delete m_streams[i];
+	}
+	m_streams.clear();
+}
+
+int DecodeScheduler::AddStream(NvVideoDecoder * decoder, int max_packets) {
+	if (!decoder || m_workers.empty())
+		return -1;
+	Stream * stream = new Stream();
+	stream->decoder = decoder;
+	stream->max_packets = max_packets > 0 ? max_packets : 1;
+	stream->scheduled = false;
+
+	std::lock_guard<std::mutex> lock(m_streams_mutex);
+	int id = (int)m_streams.size();
+	stream->home = id % (int)m_workers.size();
+	m_streams.push_back(stream);
+	return id;
+}
+
+DecodeScheduler::Stream * DecodeScheduler::GetStream(int id) {
+	std::lock_guard<std::mutex> lock(m_streams_mutex);
+	if (id < 0 || id >= (int)m_streams.size())
+		return nullptr;
+	return m_streams[id];
+}
+
+bool DecodeScheduler::RemoveStream(int id) {
+	Stream * stream = GetStream(id);
+	if (!stream)
+		return false;
+	{
+		std::unique_lock<std::mutex> lock(stream->mutex);
+		while (stream->scheduled)
+			stream->idle_cond.wait(lock);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_streams_mutex);
+		m_streams[id] = nullptr;
+	}
+	stream->decoder->Stop();
+	delete stream;
+	return true;
+}
+
+bool DecodeScheduler::InputData(int id, MediaDataBitStream & bs) {
+	Stream * stream = GetStream(id);
+	if (!stream)
+		return false;
+
+	std::unique_lock<std::mutex> lock(stream->mutex);
+	if (stream->packets.size() >= stream->max_packets)
+		return false;
+	Packet packet;
+	if (!stream->spare.empty()) {
+		packet.data.swap(stream->spare.back());
+		stream->spare.pop_back();
+	}
+	packet.data.assign(bs.buffer, bs.buffer + bs.buffer_len);
+	packet.pts = bs.pts;
+	stream->packets.push_back(std::move(packet));
+	if (stream->scheduled)
+		return true;
+	stream->scheduled = true;
+	lock.unlock();
+
+	Schedule(stream, stream->home);
+	return true;
+}
+
+void DecodeScheduler::Schedule(Stream * stream, int worker) {
+	RunQueue * queue = m_run_queues[worker];
+	{
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->streams.push_back(stream);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_work_mutex);
+		m_runnable++;
+	}
+	m_work_cond.notify_one();
+}
+
+DecodeScheduler::Stream * DecodeScheduler::TakeStream(int index) {
+	int count = (int)m_run_queues.size();
+	Stream * stream = nullptr;
+	for (int n = 0; n < count && !stream; n++) {
+		RunQueue * queue = m_run_queues[(index + n) % count];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		if (queue->streams.empty())
+			continue;
+		if (n == 0) {
+			stream = queue->streams.front();
+			queue->streams.pop_front();
+		} else {
+			stream = queue->streams.back();
+			queue->streams.pop_back();
+			m_steal_count.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (stream) {
+		std::lock_guard<std::mutex> lock(m_work_mutex);
+		m_runnable--;
+	}
+	return stream;
+}
+
+void DecodeScheduler::WorkerLoop(int index) {
+	for (;;) {
+		Stream * stream = TakeStream(index);
+		if (stream) {
+			RunStream(stream);
+			std::unique_lock<std::mutex> lock(stream->mutex);
+			if (stream->packets.empty()) {
+				stream->scheduled = false;
+				stream->idle_cond.notify_all();
+				continue;
+			}
+			lock.unlock();
+			// the stream stays with the worker that has its decoder state warm
+			Schedule(stream, index);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_work_mutex);
+		while (m_runnable == 0 && !m_exit)
+			m_work_cond.wait(lock);
+		// queued streams are decoded before the workers leave
+		if (m_exit && m_runnable == 0)
+			return;
+	}
+}
+
+void DecodeScheduler::RunStream(Stream * stream) {
+	for (int n = 0; n < kTurnPackets; n++) {
+		Packet packet;
+		{
+			std::lock_guard<std::mutex> lock(stream->mutex);
+			if (stream->packets.empty())
+				return;
+			packet = std::move(stream->packets.front());
+			stream->packets.pop_front();
+		}
+
+		MediaDataBitStream bs;
+		bs.buffer = packet.data.data();
+		bs.buffer_len = (int)packet.data.size();
+		bs.pts = packet.pts;
+		stream->decoder->InputData(bs);
+
+		std::lock_guard<std::mutex> lock(stream->mutex);
+		if (stream->spare.size() < stream->max_packets)
+			stream->spare.push_back(std::move(packet.data));
+	}
+}
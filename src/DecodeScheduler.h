@@ -0,0 +1,95 @@
+/*
+ * DecodeScheduler.h
+ *
+ *  Runs many NvVideoDecoder streams on a fixed pool of worker threads.
+ */
+
+#ifndef SRC_DECODESCHEDULER_H_
+#define SRC_DECODESCHEDULER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#include "MediaDef.h"
+
+class NvVideoDecoder;
+
+// Every stream has its own packet queue and is run by one worker at a time,
+// a few packets per turn, then goes to the back of that worker's run queue.
+// An idle worker steals the most recently queued stream of another worker,
+// so a burst on some streams spreads over the pool while the thread count
+// stays fixed. Frame callbacks run on the workers.
+class DecodeScheduler {
+public:
+	DecodeScheduler() = default;
+	~DecodeScheduler();
+	DecodeScheduler(const DecodeScheduler &) = delete;
+	DecodeScheduler & operator=(const DecodeScheduler &) = delete;
+
+	// workers <= 0 uses one per hardware thread. When cpus is given worker i
+	// is pinned to cpus[i % cpu_count], fails if a cpu cannot be used.
+	bool Start(int workers = 0, const int * cpus = nullptr, int cpu_count = 0);
+	// Decodes what is still queued, joins the workers, then stops the
+	// decoders of the streams not removed yet and forgets them.
+	void Stop();
+	int GetWorkerCount() const { return (int)m_workers.size(); }
+
+	// Adds a started decoder, returns the stream id. At most max_packets
+	// packets are queued for it.
+	int AddStream(NvVideoDecoder * decoder, int max_packets = 64);
+	// Waits until the queued packets are decoded, then stops the decoder.
+	// No InputData for this stream may run concurrently.
+	bool RemoveStream(int id);
+	// Copies the packet into the stream's queue, false when it is full.
+	bool InputData(int id, MediaDataBitStream & bs);
+
+	// turns a worker took from another worker's run queue
+	uint64_t GetStealCount() const { return m_steal_count.load(std::memory_order_relaxed); }
+
+private:
+	struct Packet {
+		std::vector<unsigned char> data;
+		int64_t pts;
+	};
+	struct Stream {
+		NvVideoDecoder * decoder;
+		size_t max_packets;
+		int home;
+		// guarded by mutex
+		std::mutex mutex;
+		std::condition_variable idle_cond;
+		std::deque<Packet> packets;
+		std::vector<std::vector<unsigned char>> spare;	// recycled packet buffers
+		bool scheduled;		// in a run queue or being run
+	};
+	struct RunQueue {
+		std::mutex mutex;
+		std::deque<Stream *> streams;
+	};
+
+	void WorkerLoop(int index);
+	// own queue from the front, else another queue from the back
+	Stream * TakeStream(int index);
+	void Schedule(Stream * stream, int worker);
+	void RunStream(Stream * stream);
+	Stream * GetStream(int id);
+
+	std::vector<std::thread> m_workers;
+	std::vector<RunQueue *> m_run_queues;
+	std::mutex m_streams_mutex;
+	std::vector<Stream *> m_streams;	// indexed by id, nullptr once removed
+
+	// sleeping workers, m_runnable counts queued streams over all run queues
+	std::mutex m_work_mutex;
+	std::condition_variable m_work_cond;
+	int m_runnable = 0;
+	bool m_exit = false;
+	std::atomic<uint64_t> m_steal_count{0};
+};
+
+#endif /* SRC_DECODESCHEDULER_H_ */
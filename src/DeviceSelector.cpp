@@ -0,0 +1,178 @@
+/*
+ * DeviceSelector.cpp
+ *
+ *  Places decode and encode sessions on the least loaded GPU.
+ */
+
+#include "DeviceSelector.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include "dynlink_cuda.h"
+#include "CudaContextPool.h"
+
+// estimate of a session that has not reported its rate
+static const double kDefaultPixelRate = 1920.0 * 1080 * 30;
+// devices with less free memory only get sessions when all of them do
+static const size_t kMinFreeMemory = 256 << 20;
+
+namespace {
+
+struct DeviceState {
+	int sessions = 0;
+	int unrated = 0;		// sessions without a pixel rate
+	double pixel_rate = 0;
+};
+
+struct GroupState {
+	int device;
+	int sessions;
+};
+
+struct SelectorState {
+	std::mutex mutex;
+	std::vector<DeviceState> devices;
+	std::map<int, GroupState> groups;
+};
+
+// never destroyed, sessions may outlive static destruction
+SelectorState & State() {
+	static SelectorState * state = new SelectorState();
+	return *state;
+}
+
+// caller holds the state mutex
+bool InitDevices(SelectorState & state) {
+	if (!state.devices.empty())
+		return true;
+	int count = 0;
+	if (cuDeviceGetCount(&count) != CUDA_SUCCESS || count <= 0)
+		return false;
+	state.devices.resize(count);
+	return true;
+}
+
+void GetMemory(int device, size_t & free_memory, size_t & total_memory) {
+	if (CudaContextPool::GetMemInfo(device, free_memory, total_memory))
+		return;
+	CUdevice cu_device;
+	total_memory = 0;
+	if (cuDeviceGet(&cu_device, device) == CUDA_SUCCESS)
+		cuDeviceTotalMem(&total_memory, cu_device);
+	free_memory = total_memory;
+}
+
+double GetRate(const DeviceState & device) {
+	return device.pixel_rate + device.unrated * kDefaultPixelRate;
+}
+
+}
+
+int DeviceSelector::Acquire(double pixel_rate, int device, int group) {
+	SelectorState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (!InitDevices(state))
+		return -1;
+	int count = (int)state.devices.size();
+
+	std::map<int, GroupState>::iterator group_it = state.groups.end();
+	if (group != 0) {
+		group_it = state.groups.find(group);
+		if (group_it != state.groups.end() && device < 0)
+			device = group_it->second.device;
+	}
+	if (device >= count)
+		return -1;
+
+	if (device < 0) {
+		size_t best_free = 0;
+		bool best_fits = false;
+		for (int i = 0; i < count; i++) {
+			size_t free_memory, total_memory;
+			GetMemory(i, free_memory, total_memory);
+			bool fits = free_memory >= kMinFreeMemory;
+			const DeviceState & candidate = state.devices[i];
+			bool better = device < 0;
+			if (!better && fits != best_fits)
+				better = fits;
+			else if (!better) {
+				const DeviceState & best = state.devices[device];
+				double rate = GetRate(candidate), best_rate = GetRate(best);
+				if (rate != best_rate)
+					better = rate < best_rate;
+				else if (candidate.sessions != best.sessions)
+					better = candidate.sessions < best.sessions;
+				else
+					better = free_memory > best_free;
+			}
+			if (better) {
+				device = i;
+				best_free = free_memory;
+				best_fits = fits;
+			}
+		}
+	}
+
+	DeviceState & selected = state.devices[device];
+	selected.sessions++;
+	if (pixel_rate > 0)
+		selected.pixel_rate += pixel_rate;
+	else
+		selected.unrated++;
+	if (group != 0) {
+		if (group_it == state.groups.end()) {
+			GroupState group_state = {device, 0};
+			group_it = state.groups.insert(std::make_pair(group, group_state)).first;
+		}
+		group_it->second.sessions++;
+	}
+	return device;
+}
+
+void DeviceSelector::Release(int device, double pixel_rate, int group) {
+	SelectorState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (device < 0 || device >= (int)state.devices.size())
+		return;
+	DeviceState & released = state.devices[device];
+	released.sessions--;
+	if (pixel_rate > 0)
+		released.pixel_rate -= pixel_rate;
+	else
+		released.unrated--;
+	if (group != 0) {
+		std::map<int, GroupState>::iterator it = state.groups.find(group);
+		if (it != state.groups.end() && --it->second.sessions <= 0)
+			state.groups.erase(it);
+	}
+}
+
+void DeviceSelector::Update(int device, double old_rate, double new_rate) {
+	SelectorState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (device < 0 || device >= (int)state.devices.size())
+		return;
+	DeviceState & updated = state.devices[device];
+	if (old_rate > 0)
+		updated.pixel_rate -= old_rate;
+	else
+		updated.unrated--;
+	if (new_rate > 0)
+		updated.pixel_rate += new_rate;
+	else
+		updated.unrated++;
+}
+
+bool DeviceSelector::GetLoad(int device, DeviceLoad & load) {
+	SelectorState & state = State();
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (!InitDevices(state) || device < 0 || device >= (int)state.devices.size())
+			return false;
+		load.sessions = state.devices[device].sessions;
+		load.pixel_rate = GetRate(state.devices[device]);
+	}
+	GetMemory(device, load.free_memory, load.total_memory);
+	return true;
+}
@@ -0,0 +1,41 @@
+/*
+ * DeviceSelector.h
+ *
+ *  Places decode and encode sessions on the least loaded GPU.
+ */
+
+#ifndef SRC_DEVICESELECTOR_H_
+#define SRC_DEVICESELECTOR_H_
+
+#include <stddef.h>
+
+// One GPU as the selector sees it. pixel_rate sums the sessions' estimates,
+// sessions without one count as a 1080p30 stream. The memory is from
+// cuMemGetInfo while the process has a context on the device, otherwise
+// free_memory is the device's total.
+struct DeviceLoad {
+	int sessions = 0;
+	double pixel_rate = 0;		// pixels per second
+	size_t free_memory = 0;
+	size_t total_memory = 0;
+};
+
+// Counts the sessions of the process per device. A new session goes to the
+// device with the lowest pixel rate among those with enough free memory,
+// fewer sessions and then more free memory break ties. Sessions with the
+// same non-zero group share the device the first of them was placed on, so
+// a transcode's decoder and encoder meet on one GPU. cuInit must have
+// succeeded.
+class DeviceSelector {
+public:
+	// Returns the device for a session of pixel_rate pixels per second (0 if
+	// not known yet), -1 without devices. device >= 0 pins the session to
+	// that device. Every Acquire is paired with a Release.
+	static int Acquire(double pixel_rate, int device = -1, int group = 0);
+	static void Release(int device, double pixel_rate, int group = 0);
+	// the session's estimate became known or changed
+	static void Update(int device, double old_rate, double new_rate);
+	static bool GetLoad(int device, DeviceLoad & load);
+};
+
+#endif /* SRC_DEVICESELECTOR_H_ */
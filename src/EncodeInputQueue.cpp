@@ -0,0 +1,134 @@
+/*
+ * EncodeInputQueue.cpp
+ *
+ *  Multi producer front-end of one encode session: frames from any thread
+ *  are handed to a single consumer in pts order.
+ */
+
+#include "EncodeInputQueue.h"
+
+#include <thread>
+
+EncodeInputQueue::EncodeInputQueue() : m_head(&m_stub), m_tail(&m_stub), m_seq(0),
+		m_reorder_wait(std::chrono::steady_clock::duration::zero()),
+		m_consumer_sleeping(false), m_closed(false), m_late_count(0) {
+	m_stub.next = nullptr;
+	m_stub.data = nullptr;
+}
+
+void EncodeInputQueue::Open(int reorder_depth, double reorder_wait_ms) {
+	m_reorder_depth = reorder_depth > 1 ? reorder_depth : 1;
+	m_reorder_wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double, std::milli>(reorder_wait_ms > 0 ? reorder_wait_ms : 0));
+	m_have_last = false;
+	m_closed = false;
+}
+
+void EncodeInputQueue::Close() {
+	m_closed = true;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_consumer_cond.notify_one();
+}
+
+void EncodeInputQueue::Push(Node * node) {
+	node->next.store(nullptr, std::memory_order_relaxed);
+	Node * prev = m_head.exchange(node);
+	prev->next.store(node, std::memory_order_release);
+}
+
+EncodeInputQueue::Node * EncodeInputQueue::Pop() {
+	Node * tail = m_tail;
+	Node * next = tail->next.load(std::memory_order_acquire);
+	if (tail == &m_stub) {
+		if (!next)
+			return nullptr;
+		m_tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+	if (tail != m_head.load(std::memory_order_acquire))
+		return nullptr;
+	// tail is the last node: put the stub behind it so it can be handed out
+	Push(&m_stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next) {
+		m_tail = next;
+		return tail;
+	}
+	return nullptr;
+}
+
+bool EncodeInputQueue::Submit(VideoRawData & data) {
+	Node node;
+	node.data = &data;
+	node.queued = std::chrono::steady_clock::now();
+	node.seq = m_seq.fetch_add(1, std::memory_order_relaxed);
+	node.done = false;
+	node.result = false;
+	Push(&node);
+	if (m_consumer_sleeping.load()) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_consumer_cond.notify_one();
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!node.done)
+		m_done_cond.wait(lock);
+	return node.result;
+}
+
+EncodeInputQueue::Node * EncodeInputQueue::Next() {
+	for (;;) {
+		Node * node;
+		while ((node = Pop()) != nullptr)
+			m_pending.push(node);
+
+		bool closed = m_closed.load();
+		bool empty = m_head.load() == m_tail;
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+		if (!m_pending.empty()) {
+			Node * top = m_pending.top();
+			deadline = top->queued + m_reorder_wait;
+			if (m_pending.size() >= m_reorder_depth || closed || std::chrono::steady_clock::now() >= deadline) {
+				m_pending.pop();
+				if (m_have_last && top->data->pts < m_last_pts)
+					m_late_count.fetch_add(1, std::memory_order_relaxed);
+				else
+					m_last_pts = top->data->pts;
+				m_have_last = true;
+				return top;
+			}
+		} else if (closed && empty) {
+			return nullptr;
+		}
+		if (!empty) {
+			// a producer is between its two push steps
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_consumer_sleeping = true;
+		// pairs with the push in Submit: either we see the new head or the
+		// producer sees us sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_head.load() == m_tail && !m_closed.load()) {
+			if (deadline == std::chrono::steady_clock::time_point::max())
+				m_consumer_cond.wait(lock);
+			else
+				m_consumer_cond.wait_until(lock, deadline);
+		}
+		m_consumer_sleeping = false;
+	}
+}
+
+void EncodeInputQueue::Complete(Node * node, bool result) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	node->result = result;
+	node->done = true;
+	m_done_cond.notify_all();
+}
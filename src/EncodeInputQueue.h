@@ -0,0 +1,90 @@
+/*
+ * EncodeInputQueue.h
+ *
+ *  Multi producer front-end of one encode session: frames from any thread
+ *  are handed to a single consumer in pts order.
+ */
+
+#ifndef SRC_ENCODEINPUTQUEUE_H_
+#define SRC_ENCODEINPUTQUEUE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+
+#include "MediaDef.h"
+
+class EncodeInputQueue {
+public:
+	// A queued frame. It lives on the producer's stack, the producer waits in
+	// Submit until the consumer has completed it.
+	struct Node {
+		std::atomic<Node *> next;
+		VideoRawData * data;
+		std::chrono::steady_clock::time_point queued;
+		uint64_t seq;
+		bool done;
+		bool result;
+	};
+
+	EncodeInputQueue();
+	EncodeInputQueue(const EncodeInputQueue &) = delete;
+	EncodeInputQueue & operator=(const EncodeInputQueue &) = delete;
+
+	// Frames are held back until reorder_depth of them are queued or the
+	// lowest pts has waited reorder_wait_ms, then the lowest pts goes first.
+	// Also reopens a closed queue; call while no consumer runs.
+	void Open(int reorder_depth, double reorder_wait_ms);
+	// Lets the consumer drain what is queued, Next then returns nullptr.
+	void Close();
+
+	// Producer side, lock free apart from the wait for completion. Returns
+	// the consumer's result for this frame.
+	bool Submit(VideoRawData & data);
+
+	// Consumer side, one thread only. Blocks for the next frame in pts order,
+	// nullptr once closed and drained. Every node must be completed.
+	Node * Next();
+	void Complete(Node * node, bool result);
+
+	// frames handed out with a lower pts than an earlier one
+	uint64_t GetLateCount() const { return m_late_count.load(std::memory_order_relaxed); }
+
+private:
+	struct Later {
+		bool operator()(const Node * a, const Node * b) const {
+			return a->data->pts != b->data->pts ? a->data->pts > b->data->pts : a->seq > b->seq;
+		}
+	};
+
+	void Push(Node * node);
+	// nullptr when empty or a producer is between its two push steps
+	Node * Pop();
+
+	// intrusive MPSC list: producers swap m_head, the consumer walks m_tail
+	std::atomic<Node *> m_head;
+	Node * m_tail;
+	Node m_stub;
+	std::atomic<uint64_t> m_seq;
+
+	// consumer only
+	std::priority_queue<Node *, std::vector<Node *>, Later> m_pending;
+	size_t m_reorder_depth = 1;
+	std::chrono::steady_clock::duration m_reorder_wait;
+	int64_t m_last_pts = INT64_MIN;
+	bool m_have_last = false;
+
+	// only used to sleep: the consumer when idle, producers until completion
+	std::mutex m_mutex;
+	std::condition_variable m_consumer_cond;
+	std::condition_variable m_done_cond;
+	std::atomic<bool> m_consumer_sleeping;
+	std::atomic<bool> m_closed;
+	std::atomic<uint64_t> m_late_count;
+};
+
+#endif /* SRC_ENCODEINPUTQUEUE_H_ */
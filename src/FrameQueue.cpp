@@ -12,9 +12,16 @@
 #include "FrameQueue.h"
 #include <stdio.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <errno.h>
+#endif
+
+#ifndef _WIN32
+// upper bound for a single wait, a missed wakeup costs at most this
+static const unsigned int cnWaitSliceMs = 100;
+#endif
 
-FrameQueue::FrameQueue(CUvideoctxlock ctxLock): hEvent_(0)
-    , nReadPosition_(0), nWritePosition_(0), nFramesInQueue_(0)
+FrameQueue::FrameQueue(CUvideoctxlock ctxLock): nWaiters_(0), hEvent_(0)
     , bEndOfDecode_(0), m_ctxLock(ctxLock),nPitch(0)
 {
 #ifdef _WIN32
@@ -22,9 +29,16 @@ FrameQueue::FrameQueue(CUvideoctxlock ctxLock): hEvent_(0)
     InitializeCriticalSection(&oCriticalSection_);
 #else
     pthread_mutex_init(&oCriticalSection_, NULL);
+    pthread_condattr_t oCondAttr;
+    pthread_condattr_init(&oCondAttr);
+    pthread_condattr_setclock(&oCondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&oStatusCond_, &oCondAttr);
+    pthread_condattr_destroy(&oCondAttr);
+    bEventSignaled_ = false;
 #endif
 
-    memset((void*)aIsFrameInUse_, 0, cnMaximumSize * sizeof(int));
+    for (unsigned int i = 0; i < DIV_UP(cnMaximumSize, 32); i++)
+        aFrameInUse_[i] = 0;
 }
 
 FrameQueue::~FrameQueue()
@@ -33,15 +47,51 @@ FrameQueue::~FrameQueue()
     DeleteCriticalSection(&oCriticalSection_);
     CloseHandle(hEvent_);
 #else
+    pthread_cond_destroy(&oStatusCond_);
     pthread_mutex_destroy(&oCriticalSection_);
 #endif
 }
 
+#ifndef _WIN32
+void
+FrameQueue::deadlineAfter(unsigned int nMilliseconds, struct timespec * pDeadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, pDeadline);
+    pDeadline->tv_sec += nMilliseconds / 1000;
+    pDeadline->tv_nsec += (long)(nMilliseconds % 1000) * 1000000;
+    if (pDeadline->tv_nsec >= 1000000000)
+    {
+        pDeadline->tv_sec++;
+        pDeadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Returns false once the deadline has passed.
+bool
+FrameQueue::waitStatus(const struct timespec * pDeadline)
+{
+    return pthread_cond_timedwait(&oStatusCond_, &oCriticalSection_, pDeadline) != ETIMEDOUT;
+}
+#endif
+
 void
 FrameQueue::waitForQueueUpdate()
 {
 #ifdef _WIN32
     WaitForSingleObject(hEvent_, 10);
+#else
+    if (bEventSignaled_.exchange(false))
+        return;
+
+    struct timespec oDeadline;
+    deadlineAfter(10, &oDeadline);
+    enter_CS(&oCriticalSection_);
+    nWaiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!bEventSignaled_.exchange(false) && waitStatus(&oDeadline))
+        ;
+    nWaiters_--;
+    leave_CS(&oCriticalSection_);
 #endif
 }
 
@@ -71,6 +121,17 @@ FrameQueue::set_event(HANDLE event)
 {
 #ifdef _WIN32
    SetEvent(event);
+#else
+   bEventSignaled_ = true;
+   // pairs with the fence after nWaiters_++: either the waiter sees the new
+   // state or we see the waiter
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (nWaiters_.load(std::memory_order_relaxed) > 0)
+   {
+       enter_CS(&oCriticalSection_);
+       pthread_cond_broadcast(&oStatusCond_);
+       leave_CS(&oCriticalSection_);
+   }
 #endif
 }
 
@@ -79,6 +140,8 @@ FrameQueue::reset_event(HANDLE event)
 {
 #ifdef _WIN32
    ResetEvent(event);
+#else
+   bEventSignaled_ = false;
 #endif
 }
 
@@ -89,24 +152,38 @@ const
     assert(nPictureIndex >= 0);
     assert(nPictureIndex < (int)cnMaximumSize);
 
-    return (0 != aIsFrameInUse_[nPictureIndex]);
+    uint32_t nWord = aFrameInUse_[nPictureIndex >> 5].load(std::memory_order_acquire);
+    return 0 != (nWord & (1u << (nPictureIndex & 31)));
+}
+
+void
+FrameQueue::setInUse(int nPictureIndex, bool bInUse)
+{
+    assert(nPictureIndex >= 0);
+    assert(nPictureIndex < (int)cnMaximumSize);
+
+    uint32_t nBit = 1u << (nPictureIndex & 31);
+    if (bInUse)
+        aFrameInUse_[nPictureIndex >> 5].fetch_or(nBit);
+    else
+        aFrameInUse_[nPictureIndex >> 5].fetch_and(~nBit);
 }
 
 bool
 FrameQueue::isEndOfDecode()
 const
 {
-    return (0 != bEndOfDecode_);
+    return (0 != bEndOfDecode_.load(std::memory_order_acquire));
 }
 
 void
 FrameQueue::endDecode()
 {
-    bEndOfDecode_ = true;
+    bEndOfDecode_ = 1;
     signalStatusChange();  // Signal for the display thread
 }
 
-// Spins until frame becomes available or decoding
+// Blocks until frame becomes available or decoding
 // gets canceled.
 // If the requested frame is available the method returns true.
 // If decoding was interupted before the requested frame becomes
@@ -114,6 +191,9 @@ FrameQueue::endDecode()
 bool
 FrameQueue::waitUntilFrameAvailable(int nPictureIndex)
 {
+    if (!isInUse(nPictureIndex))
+        return true;
+#ifdef _WIN32
     while (isInUse(nPictureIndex))
     {
         Sleep(1);   // Decoder is getting too far ahead from display
@@ -122,6 +202,22 @@ FrameQueue::waitUntilFrameAvailable(int nPictureIndex)
     }
 
     return true;
+#else
+    // woken by releaseFrame() and endDecode()
+    enter_CS(&oCriticalSection_);
+    nWaiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (isInUse(nPictureIndex) && !isEndOfDecode())
+    {
+        struct timespec oDeadline;
+        deadlineAfter(cnWaitSliceMs, &oDeadline);
+        waitStatus(&oDeadline);
+    }
+    nWaiters_--;
+    leave_CS(&oCriticalSection_);
+
+    return !isInUse(nPictureIndex);
+#endif
 }
 
 void
@@ -131,12 +227,49 @@ FrameQueue::signalStatusChange()
 }
 
 CUVIDFrameQueue::CUVIDFrameQueue(CUvideoctxlock ctxLock): FrameQueue(ctxLock)
+    , nWritePosition_(0), nReadPosition_(0)
+    , aDisplayQueue_(new CUVIDPARSERDISPINFO[cnDefaultCapacity])
+    , nCapacity_(cnDefaultCapacity)
 {
-    memset(aDisplayQueue_, 0, cnMaximumSize * sizeof(CUVIDPARSERDISPINFO));
+    memset(aDisplayQueue_, 0, nCapacity_ * sizeof(CUVIDPARSERDISPINFO));
 }
 
 CUVIDFrameQueue::~CUVIDFrameQueue()
-{}
+{
+    delete [] aDisplayQueue_;
+}
+
+void
+CUVIDFrameQueue::init(int frameWidth, int frameHeight, int nDecodeSurfaces)
+{
+    // every queued picture holds a decode surface, so the ring never needs
+    // more entries than there are surfaces
+    unsigned int nCapacity = 1;
+    while (nCapacity < (unsigned int)nDecodeSurfaces && nCapacity < cnMaximumSize)
+        nCapacity <<= 1;
+
+    // the consumer has nothing left to read from an empty ring and only
+    // touches the storage again after the next enqueue publishes it
+    if (nCapacity == nCapacity_ || !isEmpty())
+        return;
+
+    delete [] aDisplayQueue_;
+    aDisplayQueue_ = new CUVIDPARSERDISPINFO[nCapacity];
+    memset(aDisplayQueue_, 0, nCapacity * sizeof(CUVIDPARSERDISPINFO));
+    nCapacity_ = nCapacity;
+}
+
+bool
+CUVIDFrameQueue::tryPush(const CUVIDPARSERDISPINFO * pPicParams)
+{
+    unsigned int nWrite = nWritePosition_.load(std::memory_order_relaxed);
+    if (nWrite - nReadPosition_.load(std::memory_order_acquire) >= nCapacity_)
+        return false;
+
+    aDisplayQueue_[nWrite & (nCapacity_ - 1)] = *pPicParams;
+    nWritePosition_.store(nWrite + 1, std::memory_order_release);
+    return true;
+}
 
 void
 CUVIDFrameQueue::enqueue(const void * pData)
@@ -144,25 +277,30 @@ CUVIDFrameQueue::enqueue(const void * pData)
     // Mark the frame as 'in-use' so we don't re-use it for decoding until it is no longer needed
     // for display
     const CUVIDPARSERDISPINFO* pPicParams = (const CUVIDPARSERDISPINFO*)(pData);
-    aIsFrameInUse_[pPicParams->picture_index] = true;
+    setInUse(pPicParams->picture_index, true);
     // Wait until we have a free entry in the display queue (should never block if we have enough entries)
-    do
+    if (!tryPush(pPicParams))
     {
-        bool bPlacedFrame = false;
+#ifndef _WIN32
+        // dequeue() signals when it frees an entry
         enter_CS(&oCriticalSection_);
-        if (nFramesInQueue_ < (int)FrameQueue::cnMaximumSize)
+        nWaiters_++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!tryPush(pPicParams) && !isEndOfDecode())
         {
-            int iWritePosition = (nReadPosition_ + nFramesInQueue_) % cnMaximumSize;
-            aDisplayQueue_[iWritePosition] = *pPicParams;
-            nFramesInQueue_++;
-            bPlacedFrame = true;
+            struct timespec oDeadline;
+            deadlineAfter(cnWaitSliceMs, &oDeadline);
+            waitStatus(&oDeadline);
         }
-
+        nWaiters_--;
         leave_CS(&oCriticalSection_);
-        if (bPlacedFrame) // Done
-            break;
-        Sleep(1);   // Wait a bit
-    } while (!bEndOfDecode_);
+#else
+        do
+        {
+            Sleep(1);   // Wait a bit
+        } while (!tryPush(pPicParams) && !isEndOfDecode());
+#endif
+    }
     signalStatusChange();  // Signal for the display thread
 }
 
@@ -173,25 +311,28 @@ CUVIDFrameQueue::dequeue(void* pData)
 {
     CUVIDPARSERDISPINFO* pDisplayInfo = (CUVIDPARSERDISPINFO*)(pData);
     pDisplayInfo->picture_index = -1;
-    bool bHaveNewFrame = false;
 
-    enter_CS(&oCriticalSection_);
-    if (nFramesInQueue_ > 0)
-    {
-        int iEntry = nReadPosition_;
-        *pDisplayInfo = aDisplayQueue_[iEntry];
-        nReadPosition_ = (iEntry+1) % cnMaximumSize;
-        nFramesInQueue_--;
-        bHaveNewFrame = true;
-    }
-    leave_CS(&oCriticalSection_);
+    unsigned int nRead = nReadPosition_.load(std::memory_order_relaxed);
+    if (nRead == nWritePosition_.load(std::memory_order_acquire))
+        return false;
 
-    return bHaveNewFrame;
+    *pDisplayInfo = aDisplayQueue_[nRead & (nCapacity_ - 1)];
+    nReadPosition_.store(nRead + 1, std::memory_order_release);
+
+    signalStatusChange();  // a display queue entry is free again
+    return true;
 }
 
 void
 CUVIDFrameQueue::releaseFrame(const void * pPicParams)  {
 
     const CUVIDPARSERDISPINFO* pInfo = (const CUVIDPARSERDISPINFO*)(pPicParams);
-    aIsFrameInUse_[pInfo->picture_index] = false;
+    setInUse(pInfo->picture_index, false);
+    signalStatusChange();  // wakes waitUntilFrameAvailable()
+}
+
+bool
+CUVIDFrameQueue::isEmpty()
+{
+    return nReadPosition_.load(std::memory_order_acquire) == nWritePosition_.load(std::memory_order_acquire);
 }
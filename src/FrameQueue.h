@@ -11,6 +11,9 @@
  *
  */
 
+#include <stdint.h>
+#include <atomic>
+
 #include "dynlink_nvcuvid.h" // <nvcuvid.h>
 
 #ifdef _WIN32
@@ -20,6 +23,7 @@
   #include <unistd.h>
   #include <string.h>
   #include <pthread.h>
+  #include <time.h>
   typedef pthread_mutex_t CRITICAL_SECTION;
   typedef void* HANDLE;
 
@@ -28,16 +32,20 @@
 
 #define DIV_UP(a, b) ( ((a) + (b) - 1) / (b) )
 
+#define CACHE_LINE_SIZE 64
+
 class FrameQueue
 {
 public:
-    static const unsigned int cnMaximumSize = 100; // MAX_FRM_CNT;
+    static const unsigned int cnMaximumSize = 100; // MAX_FRM_CNT, bound for picture indices and the ring
 
     FrameQueue(CUvideoctxlock ctxLock);
 
     virtual
    ~FrameQueue();
 
+    // Waits up to 10 ms for the next status change (new frame, released
+    // frame, end of decode).
     void
     waitForQueueUpdate();
 
@@ -53,8 +61,10 @@ public:
     void
     reset_event(HANDLE event);
 
+    // nDecodeSurfaces is the decoder's ulNumDecodeSurfaces, no more pictures
+    // than that can be waiting for display at once.
     virtual void
-    init(int frameWidth, int frameHeight) { }
+    init(int frameWidth, int frameHeight, int nDecodeSurfaces) { }
 
     virtual void
     enqueue(const void * pData) = 0;
@@ -85,7 +95,7 @@ public:
     void
     endDecode();
 
-    // Spins until frame becomes available or decoding
+    // Blocks until frame becomes available or decoding
     // gets canceled.
     // If the requested frame is available the method returns true.
     // If decoding was interupted before the requested frame becomes
@@ -96,37 +106,76 @@ public:
 
     size_t getPitch() { return nPitch; }
 
-    bool isEmpty() { return nFramesInQueue_ == 0; }
+    virtual bool
+    isEmpty() = 0;
 
 protected:
+    // Wakes waiters. The lock is only taken when a thread is blocked in one of
+    // the wait calls, so the enqueue/dequeue/release fast path stays lock free.
     void
     signalStatusChange();
 
+    void
+    setInUse(int nPictureIndex, bool bInUse);
+
+#ifndef _WIN32
+    // Linux side of hEvent_: an auto-reset flag plus a condition variable,
+    // the condition is guarded by oCriticalSection_. The caller holds the lock.
+    bool
+    waitStatus(const struct timespec * pDeadline);
+
+    static void
+    deadlineAfter(unsigned int nMilliseconds, struct timespec * pDeadline);
+
+    pthread_cond_t      oStatusCond_;
+    std::atomic<bool>   bEventSignaled_;
+#endif
+    // threads blocked (or about to block) on the status event
+    std::atomic<int>    nWaiters_;
+
     HANDLE hEvent_;
     CRITICAL_SECTION    oCriticalSection_;
-    volatile int        nReadPosition_;
-    volatile int        nWritePosition_;
 
-    volatile int        nFramesInQueue_;
-    volatile int        aIsFrameInUse_[cnMaximumSize];
-    volatile int        bEndOfDecode_;
+    // one bit per picture index
+    std::atomic<uint32_t> aFrameInUse_[DIV_UP(cnMaximumSize, 32)];
+    std::atomic<int>    bEndOfDecode_;
 
     CUvideoctxlock      m_ctxLock;
     size_t              nPitch;
 };
 
+// Single producer (the parser's display callback) / single consumer (the
+// thread that maps and outputs frames) ring. Positions only ever grow, the
+// slot is position & (capacity - 1), and each index lives on its own cache
+// line.
 class CUVIDFrameQueue: public FrameQueue {
 
 public:
     CUVIDFrameQueue(CUvideoctxlock ctxLock);
     ~CUVIDFrameQueue();
 
+    // Resizes the ring to the next power of two >= nDecodeSurfaces. Called
+    // by the producer, the storage is only swapped while the ring is empty.
+    virtual void init(int frameWidth, int frameHeight, int nDecodeSurfaces);
     virtual void enqueue(const void * pData);
     virtual bool dequeue(void * pData);
     virtual void releaseFrame(const void * pPicParams);
+    virtual bool isEmpty();
 
 protected:
-    CUVIDPARSERDISPINFO aDisplayQueue_[cnMaximumSize];
+    static const unsigned int cnDefaultCapacity = 32;
+
+    bool
+    tryPush(const CUVIDPARSERDISPINFO * pPicParams);
+
+    char                        aPad0_[CACHE_LINE_SIZE];
+    std::atomic<unsigned int>   nWritePosition_;    // written by the producer
+    char                        aPad1_[CACHE_LINE_SIZE];
+    std::atomic<unsigned int>   nReadPosition_;     // written by the consumer
+    char                        aPad2_[CACHE_LINE_SIZE];
+    // producer side, published to the consumer by nWritePosition_
+    CUVIDPARSERDISPINFO *       aDisplayQueue_;
+    unsigned int                nCapacity_;
 };
 
 
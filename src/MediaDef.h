@@ -14,7 +14,23 @@ enum class VideoBaseBandFmt{
 	NONE,
 	YUV420P,
 	BGR,
-	NV12
+	NV12,
+	YUV420P10_PACKED,	// planar, 4 samples of 10 bits in 5 bytes (lsb first)
+	BGRA,
+	RGB,
+	RGBA,
+	GRAY,			// luma plane only, samples as in the YUV420P output
+	GRAY10_PACKED	// luma plane only, as in YUV420P10_PACKED
+};
+
+enum class VideoColorMatrix {
+	BT601,
+	BT709
+};
+
+enum class VideoColorRange {
+	LIMITED,
+	FULL
 };
 
 enum class VideoCodec {
@@ -33,6 +49,165 @@ struct VideoParam{
 	int gop_size = 0;
 	int b_frames = 0;
 	int bit_rate = 0;
+	// used to convert BGR/BGRA input into the NV12 input surface
+	VideoColorMatrix color_matrix = VideoColorMatrix::BT601;
+	VideoColorRange color_range = VideoColorRange::LIMITED;
+	// retrieve finished bitstreams on an encoder owned thread, the bitstream
+	// callback then runs there. InputData only blocks while every encode
+	// buffer is in flight.
+	bool async_output = false;
+	// encode buffer ring, 0 keeps a fixed ring of 10. With min_encode_buffers
+	// < max_encode_buffers (at most 32) the ring is resized at runtime: it
+	// grows while the producer waits for buffers still being encoded and
+	// shrinks when the submit to bitstream latency is above
+	// latency_target_ms (0 means no target) or buffers are never waited for.
+	int min_encode_buffers = 0;
+	int max_encode_buffers = 0;
+	double latency_target_ms = 0;
+	// makes InputData safe to call from several threads: frames pass a lock
+	// free queue to one encode thread, which submits them in pts order. It
+	// holds frames back until input_reorder_depth are queued (typically the
+	// number of producers) or the lowest pts has waited input_reorder_wait_ms.
+	// InputData still returns once its frame is in an encode buffer.
+	bool shared_input = false;
+	int input_reorder_depth = 1;
+	double input_reorder_wait_ms = 1;
+	// GPU ordinal the encoder runs on, -1 lets DeviceSelector pick the least
+	// loaded one. Sessions with the same non-zero device_group share a GPU.
+	// Device frames of a decoder on the same GPU share its context and can
+	// be encoded without a copy.
+	int device_id = -1;
+	int device_group = 0;
+};
+
+// Encoder pipeline metrics and the ring depth decisions, the window values
+// are from the last evaluation window.
+struct VideoEncodeStats{
+	uint64_t encoded_frames = 0;
+	// submissions that had to wait for a buffer still being encoded
+	uint64_t ring_full_count = 0;
+	int buffer_count = 0;
+	int grow_count = 0;
+	int shrink_count = 0;
+	double window_latency_ms = 0;	// average submit to bitstream
+	double window_stall_ratio = 0;	// share of wall time spent waiting for buffers
+	// shared_input frames that arrived after a higher pts was submitted
+	uint64_t late_input_frames = 0;
+};
+
+// Host layout of decoded high bit depth (P016) frames.
+enum class VideoOutputDepth {
+	NATIVE,		// 16 bit samples holding bit_depth significant bits
+	PACKED10,	// YUV420P10_PACKED
+	DITHER8		// 8 bit with 4x4 ordered dither
+};
+
+struct VideoRect{
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+};
+
+// Called for every downloaded frame with the region about to be copied (the
+// configured crop, or the whole frame), may change it for this frame.
+typedef void(*VideoRoiCB)(int width, int height, int64_t pts, VideoRect & roi, void * user_data);
+
+// Pipeline sizing presets, see VideoDecodeParam::profile.
+enum class VideoDecodeProfile {
+	// 10 parser surfaces, display delay 1, 2 mapped output surfaces
+	BALANCED,
+	// display delay 0 and 1 output surface: a frame is handed out as soon
+	// as the parser allows it (decode order for streams without
+	// reordering). Packets are flagged as holding exactly one frame, so
+	// every InputData must carry a whole picture.
+	ZERO_LATENCY,
+	// display delay 4, 20 parser surfaces, 4 extra decode surfaces and 4
+	// output surfaces, so decoding runs ahead of a slower consumer
+	MAX_THROUGHPUT
+};
+
+struct VideoDecodeStats{
+	uint64_t downloaded_frames = 0;
+	// bytes copied from the device, in total and for the last frame
+	uint64_t download_bytes = 0;
+	int last_download_bytes = 0;
+	// effective pipeline sizing: the parser settings are set by Start, the
+	// decoder surfaces whenever a decoder is created for a sequence
+	int parser_surfaces = 0;
+	int display_delay = 0;
+	int decode_surfaces = 0;
+	int output_surfaces = 0;
+};
+
+struct VideoDecodeParam{
+	VideoCodec codec = VideoCodec::NONE;
+	bool download_gpu_buffer = true;
+	VideoOutputDepth output_depth = VideoOutputDepth::NATIVE;
+	// YUV420P, or BGR/RGB/BGRA/RGBA converted from NV12 in the same pass
+	// (high bit depth streams are dithered to 8 bit first)
+	VideoBaseBandFmt output_fmt = VideoBaseBandFmt::YUV420P;
+	VideoColorMatrix color_matrix = VideoColorMatrix::BT601;
+	VideoColorRange color_range = VideoColorRange::LIMITED;
+	// optional planar float CHW tensor for packed RGB output, channels in
+	// output_fmt order, value = sample * tensor_scale[c] + tensor_bias[c].
+	// Needs width * height * 3 floats, frames that do not fit skip it.
+	float * tensor = nullptr;
+	int tensor_size = 0;
+	float tensor_scale[3] = {1.0f / 255, 1.0f / 255, 1.0f / 255};
+	float tensor_bias[3] = {0, 0, 0};
+	// > 1 downloads each frame in that many row chunks on a copy stream into
+	// two pinned chunk buffers, converting a chunk while the next is copied
+	int download_chunks = 0;
+	// row alignment of the pinned staging buffer in bytes, 0 packs the
+	// visible rows tightly (the surface pitch padding is never downloaded)
+	int download_align = 0;
+	// download only the luma plane, output is GRAY / GRAY10_PACKED
+	bool luma_only = false;
+	// download and convert only this rectangle, the origin is rounded down
+	// and the size up to even (clamped to the frame), an empty rectangle
+	// means the whole frame. roi_cb (called with the decoder user_data) can
+	// pick a region per frame.
+	VideoRect crop;
+	VideoRoiCB roi_cb = nullptr;
+	// done by the decoder before the frame is mapped: decode_crop selects a
+	// rectangle of the display area, which is scaled to target_width x
+	// target_height. 0 keeps that dimension (or follows the aspect ratio
+	// when only the other one is set). Applies to the surface, so also to
+	// NV12 output; crop above is then taken from the scaled frame.
+	int target_width = 0;
+	int target_height = 0;
+	VideoRect decode_crop;
+	// host conversion workers, 0 converts on the parser thread, < 0 uses one
+	// per hardware thread. Frames are split into row bands, worker i is
+	// pinned to convert_cpus[i % convert_cpu_count] when convert_cpus is set.
+	int convert_threads = 0;
+	const int * convert_cpus = nullptr;
+	int convert_cpu_count = 0;
+	// > 0 maps, downloads and delivers frames on a decoder owned output
+	// thread: InputData returns once the packet is parsed and queued, and
+	// only blocks while this many frames are waiting for output. The frame
+	// callback then runs on that thread. 0 does it all inside InputData.
+	int output_queue_depth = 0;
+	// decode surface and display delay sizing, the overrides below win over
+	// the profile. decode_surfaces > 0 sets both the parser and the decoder
+	// surface count instead of the codec's worst case DPB, display_delay
+	// >= 0 the parser's display delay, output_surfaces > 0 the number of
+	// frames that can be mapped at once. The effective values are reported
+	// in VideoDecodeStats.
+	VideoDecodeProfile profile = VideoDecodeProfile::BALANCED;
+	int decode_surfaces = 0;
+	int display_delay = -1;
+	int output_surfaces = 0;
+	// without download_gpu_buffer: a frame stays mapped after the frame
+	// callback, which takes it over and must call its release once (the
+	// encoder does, encoding straight from the surface only with
+	// async_output and copying it otherwise). The decoder waits for a
+	// release when output_surfaces frames are held.
+	bool retain_device_frames = false;
+	// GPU placement as in VideoParam, -1 picks the least loaded GPU
+	int device_id = -1;
+	int device_group = 0;
 };
 
 struct MediaDataBitStream{
@@ -43,6 +218,8 @@ struct MediaDataBitStream{
 	bool is_key = false;
 };
 
+typedef void(*VideoFrameReleaseCB)(void * release_ctx);
+
 struct VideoRawData{
 	int width = 0;
 	int height = 0;
@@ -51,7 +228,15 @@ struct VideoRawData{
 	int64_t pts = 0;
 	unsigned char * buffer[3] = {0};
 	int bit_depth = 8;
+	// NV12 device frame: luma at deviceptr with pitch line_size[0], the UV
+	// plane at deviceptr_uv with pitch line_size[1]. deviceptr_uv 0 means the
+	// UV plane follows the luma rows with the luma pitch.
 	unsigned long long deviceptr = 0;
+	unsigned long long deviceptr_uv = 0;
+	float * tensor = nullptr;
+	// set on a retained decoder surface, see retain_device_frames
+	VideoFrameReleaseCB release = nullptr;
+	void * release_ctx = nullptr;
 };
 
 typedef void(*VideoFrameCB)(VideoRawData & data, void * user_data);
@@ -0,0 +1,1210 @@
+/*
+ * MockDriver.cpp
+ *
+ *  In-process stand-in for the CUDA, NVDEC and NVENC drivers, so the
+ *  pipelines run and can be measured on machines without a GPU.
+ */
+
+#include "MockDriver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "dynlink_nvcuvid.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// pitch alignment of cuMemAllocPitch and of the decoder's output surfaces
+static const size_t kPitchAlignment = 512;
+// bytes of a synthetic bitstream that are not padding: start code, NAL
+// header, first slice byte and four 5 byte fields
+static const int kBitstreamHeaderBytes = 4 + 2 + 1 + 4 * 5;
+
+namespace {
+
+struct MockDevice {
+	size_t used_memory = 0;
+	// when the last queued picture leaves the engine
+	Clock::time_point decode_free;
+	Clock::time_point encode_free;
+};
+
+struct MockState {
+	std::mutex mutex;
+	MockDriverConfig config;
+	std::vector<MockDevice> devices;
+	std::map<CUdeviceptr, std::pair<int, size_t>> allocations;	// device, bytes
+	std::atomic<uint64_t> pictures_decoded{0};
+	std::atomic<uint64_t> frames_mapped{0};
+	std::atomic<uint64_t> frames_encoded{0};
+	std::atomic<uint64_t> bytes_copied{0};
+};
+
+std::atomic<bool> g_enabled(false);
+
+// never destroyed, sessions may outlive static destruction
+MockState & State() {
+	static MockState * state = new MockState();
+	return *state;
+}
+
+struct MockContext {
+	int device;
+};
+
+struct MockVideoLock {
+	std::recursive_mutex mutex;
+	MockContext * ctx;
+};
+
+// contexts current on this thread, the last one is used
+thread_local std::vector<MockContext *> t_contexts;
+
+int CurrentDevice() {
+	return t_contexts.empty() ? -1 : t_contexts.back()->device;
+}
+
+MockDevice * GetDevice(MockState & state, int device) {
+	if (device < 0 || device >= (int)state.devices.size())
+		return nullptr;
+	return &state.devices[device];
+}
+
+// Queues a picture on an engine, returns when it is done. Called with the
+// state mutex held.
+Clock::time_point ScheduleEngine(Clock::time_point & engine_free, int latency_us) {
+	Clock::time_point start = std::max(Clock::now(), engine_free);
+	engine_free = start + std::chrono::microseconds(std::max(0, latency_us));
+	return engine_free;
+}
+
+size_t AlignUp(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// CUDA
+
+CUresult CUDAAPI MockDriverGetVersion(int * version) {
+	if (!version)
+		return CUDA_ERROR_INVALID_VALUE;
+	*version = 9000;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceGetCount(int * count) {
+	if (!count)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	*count = (int)state.devices.size();
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceGet(CUdevice * device, int ordinal) {
+	if (!device)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (!GetDevice(state, ordinal))
+		return CUDA_ERROR_INVALID_DEVICE;
+	*device = ordinal;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceGetName(char * name, int len, CUdevice dev) {
+	if (!name || len <= 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	snprintf(name, len, "Mock GPU %d", dev);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceComputeCapability(int * major, int * minor, CUdevice dev) {
+	if (!major || !minor)
+		return CUDA_ERROR_INVALID_VALUE;
+	*major = 7;
+	*minor = 5;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceTotalMem(size_t * bytes, CUdevice dev) {
+	if (!bytes)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (!GetDevice(state, dev))
+		return CUDA_ERROR_INVALID_DEVICE;
+	*bytes = state.config.device_memory;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDeviceGetAttribute(int * pi, CUdevice_attribute attrib, CUdevice dev) {
+	if (!pi)
+		return CUDA_ERROR_INVALID_VALUE;
+	switch (attrib) {
+	case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT:
+		*pi = 16;
+		break;
+	case CU_DEVICE_ATTRIBUTE_CLOCK_RATE:
+		*pi = 1000000;
+		break;
+	default:
+		*pi = 0;
+		break;
+	}
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxCreate(CUcontext * pctx, unsigned int flags, CUdevice dev) {
+	if (!pctx)
+		return CUDA_ERROR_INVALID_VALUE;
+	{
+		MockState & state = State();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (!GetDevice(state, dev))
+			return CUDA_ERROR_INVALID_DEVICE;
+	}
+	MockContext * ctx = new MockContext();
+	ctx->device = dev;
+	t_contexts.push_back(ctx);
+	*pctx = reinterpret_cast<CUcontext>(ctx);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxDestroy(CUcontext ctx) {
+	MockContext * context = reinterpret_cast<MockContext *>(ctx);
+	if (!context)
+		return CUDA_ERROR_INVALID_VALUE;
+	t_contexts.erase(std::remove(t_contexts.begin(), t_contexts.end(), context), t_contexts.end());
+	delete context;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxPushCurrent(CUcontext ctx) {
+	if (!ctx)
+		return CUDA_ERROR_INVALID_VALUE;
+	t_contexts.push_back(reinterpret_cast<MockContext *>(ctx));
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxPopCurrent(CUcontext * pctx) {
+	if (t_contexts.empty())
+		return CUDA_ERROR_INVALID_CONTEXT;
+	if (pctx)
+		*pctx = reinterpret_cast<CUcontext>(t_contexts.back());
+	t_contexts.pop_back();
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxSynchronize() {
+	return t_contexts.empty() ? CUDA_ERROR_INVALID_CONTEXT : CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemGetInfo(size_t * free_memory, size_t * total_memory) {
+	if (!free_memory || !total_memory)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	MockDevice * device = GetDevice(state, CurrentDevice());
+	if (!device)
+		return CUDA_ERROR_INVALID_CONTEXT;
+	*total_memory = state.config.device_memory;
+	*free_memory = state.config.device_memory - std::min(device->used_memory, state.config.device_memory);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemAllocPitch(CUdeviceptr * dptr, size_t * pitch, size_t width_bytes, size_t height,
+		unsigned int element_size) {
+	if (!dptr || !pitch || width_bytes == 0 || height == 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	int index = CurrentDevice();
+	MockDevice * device = GetDevice(state, index);
+	if (!device)
+		return CUDA_ERROR_INVALID_CONTEXT;
+	size_t aligned = AlignUp(width_bytes, kPitchAlignment);
+	size_t bytes = aligned * height;
+	if (device->used_memory + bytes > state.config.device_memory)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	void * memory = malloc(bytes);
+	if (!memory)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	device->used_memory += bytes;
+	*dptr = (CUdeviceptr)memory;
+	*pitch = aligned;
+	state.allocations[*dptr] = std::make_pair(index, bytes);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemFree(CUdeviceptr dptr) {
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	std::map<CUdeviceptr, std::pair<int, size_t>>::iterator it = state.allocations.find(dptr);
+	if (it == state.allocations.end())
+		return CUDA_ERROR_INVALID_VALUE;
+	MockDevice * device = GetDevice(state, it->second.first);
+	if (device)
+		device->used_memory -= std::min(device->used_memory, it->second.second);
+	free((void *)dptr);
+	state.allocations.erase(it);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemAllocHost(void ** pp, size_t bytes) {
+	if (!pp)
+		return CUDA_ERROR_INVALID_VALUE;
+	*pp = malloc(bytes);
+	return *pp ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+CUresult CUDAAPI MockMemFreeHost(void * p) {
+	free(p);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemcpy2D(const CUDA_MEMCPY2D * copy) {
+	if (!copy)
+		return CUDA_ERROR_INVALID_VALUE;
+	const unsigned char * src;
+	unsigned char * dst;
+	if (copy->srcMemoryType == CU_MEMORYTYPE_HOST)
+		src = (const unsigned char *)copy->srcHost;
+	else if (copy->srcMemoryType == CU_MEMORYTYPE_DEVICE || copy->srcMemoryType == CU_MEMORYTYPE_UNIFIED)
+		src = (const unsigned char *)copy->srcDevice;
+	else
+		return CUDA_ERROR_INVALID_VALUE;
+	if (copy->dstMemoryType == CU_MEMORYTYPE_HOST)
+		dst = (unsigned char *)copy->dstHost;
+	else if (copy->dstMemoryType == CU_MEMORYTYPE_DEVICE || copy->dstMemoryType == CU_MEMORYTYPE_UNIFIED)
+		dst = (unsigned char *)copy->dstDevice;
+	else
+		return CUDA_ERROR_INVALID_VALUE;
+	if (copy->Height == 0 || copy->WidthInBytes == 0)
+		return CUDA_SUCCESS;
+	if (!src || !dst)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	src += copy->srcY * copy->srcPitch + copy->srcXInBytes;
+	dst += copy->dstY * copy->dstPitch + copy->dstXInBytes;
+	if (copy->srcPitch == copy->WidthInBytes && copy->dstPitch == copy->WidthInBytes) {
+		memcpy(dst, src, copy->WidthInBytes * copy->Height);
+	} else {
+		for (size_t y = 0; y < copy->Height; y++)
+			memcpy(dst + y * copy->dstPitch, src + y * copy->srcPitch, copy->WidthInBytes);
+	}
+	State().bytes_copied.fetch_add(copy->WidthInBytes * copy->Height, std::memory_order_relaxed);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockMemcpy2DAsync(const CUDA_MEMCPY2D * copy, CUstream stream) {
+	return MockMemcpy2D(copy);
+}
+
+// streams and events only need to be distinct handles, nothing is queued
+struct MockHandle {
+	int unused;
+};
+
+CUresult CUDAAPI MockStreamCreate(CUstream * stream, unsigned int flags) {
+	if (!stream)
+		return CUDA_ERROR_INVALID_VALUE;
+	*stream = reinterpret_cast<CUstream>(new MockHandle());
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockStreamDestroy(CUstream stream) {
+	delete reinterpret_cast<MockHandle *>(stream);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockStreamSynchronize(CUstream stream) {
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockEventCreate(CUevent * event, unsigned int flags) {
+	if (!event)
+		return CUDA_ERROR_INVALID_VALUE;
+	*event = reinterpret_cast<CUevent>(new MockHandle());
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockEventDestroy(CUevent event) {
+	delete reinterpret_cast<MockHandle *>(event);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockEventRecord(CUevent event, CUstream stream) {
+	return event ? CUDA_SUCCESS : CUDA_ERROR_INVALID_HANDLE;
+}
+
+CUresult CUDAAPI MockEventSynchronize(CUevent event) {
+	return event ? CUDA_SUCCESS : CUDA_ERROR_INVALID_HANDLE;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// NVDEC
+
+CUresult CUDAAPI MockCtxLockCreate(CUvideoctxlock * lck, CUcontext ctx) {
+	if (!lck || !ctx)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockVideoLock * lock = new MockVideoLock();
+	lock->ctx = reinterpret_cast<MockContext *>(ctx);
+	*lck = reinterpret_cast<CUvideoctxlock>(lock);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxLockDestroy(CUvideoctxlock lck) {
+	delete reinterpret_cast<MockVideoLock *>(lck);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxLock(CUvideoctxlock lck, unsigned int flags) {
+	MockVideoLock * lock = reinterpret_cast<MockVideoLock *>(lck);
+	if (!lock)
+		return CUDA_ERROR_INVALID_VALUE;
+	lock->mutex.lock();
+	t_contexts.push_back(lock->ctx);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCtxUnlock(CUvideoctxlock lck, unsigned int flags) {
+	MockVideoLock * lock = reinterpret_cast<MockVideoLock *>(lck);
+	if (!lock)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (!t_contexts.empty())
+		t_contexts.pop_back();
+	lock->mutex.unlock();
+	return CUDA_SUCCESS;
+}
+
+struct MockParser {
+	CUVIDPARSERPARAMS params;
+	bool sequence_sent = false;
+	unsigned int next_index = 0;
+	uint64_t pictures = 0;
+	std::deque<CUVIDPARSERDISPINFO> display;
+};
+
+// A start code of a NAL unit that begins a picture: a slice whose
+// first_mb_in_slice (H.264) or first_slice_segment_in_pic_flag (HEVC) says
+// it is the picture's first. key is set for IDR and IRAP pictures.
+bool IsPictureStart(cudaVideoCodec codec, const unsigned char * nal, size_t size, bool & key) {
+	if (codec == cudaVideoCodec_HEVC) {
+		if (size < 3)
+			return false;
+		int type = (nal[0] >> 1) & 0x3f;
+		key = type >= 16 && type <= 23;
+		return type < 32 && (nal[2] & 0x80);
+	}
+	if (size < 2)
+		return false;
+	int type = nal[0] & 0x1f;
+	key = type == 5;
+	return type >= 1 && type <= 5 && (nal[1] & 0x80);
+}
+
+void FlushDisplay(MockParser * parser, size_t keep) {
+	while (parser->display.size() > keep) {
+		CUVIDPARSERDISPINFO info = parser->display.front();
+		parser->display.pop_front();
+		if (parser->params.pfnDisplayPicture)
+			parser->params.pfnDisplayPicture(parser->params.pUserData, &info);
+	}
+}
+
+bool InDisplayQueue(MockParser * parser, int index) {
+	for (size_t i = 0; i < parser->display.size(); i++) {
+		if (parser->display[i].picture_index == index)
+			return true;
+	}
+	return false;
+}
+
+void ParsePicture(MockParser * parser, const unsigned char * data, size_t size, bool key,
+		CUvideotimestamp timestamp) {
+	MockDriverConfig config;
+	{
+		MockState & state = State();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		config = state.config;
+	}
+
+	if (!parser->sequence_sent) {
+		CUVIDEOFORMAT format;
+		memset(&format, 0, sizeof(format));
+		format.codec = parser->params.CodecType;
+		format.frame_rate.numerator = config.frame_rate_num;
+		format.frame_rate.denominator = config.frame_rate_den;
+		format.progressive_sequence = 1;
+		format.bit_depth_luma_minus8 = config.bit_depth > 8 ? config.bit_depth - 8 : 0;
+		format.bit_depth_chroma_minus8 = format.bit_depth_luma_minus8;
+		format.coded_width = AlignUp(config.width, 16);
+		format.coded_height = AlignUp(config.height, 16);
+		format.display_area.right = config.width;
+		format.display_area.bottom = config.height;
+		format.chroma_format = cudaVideoChromaFormat_420;
+		format.display_aspect_ratio.x = config.width;
+		format.display_aspect_ratio.y = config.height;
+		// 0 keeps the current decoder, only a negative result is an error
+		if (parser->params.pfnSequenceCallback &&
+				parser->params.pfnSequenceCallback(parser->params.pUserData, &format) < 0)
+			return;
+		parser->sequence_sent = true;
+		key = true;
+	}
+
+	// the next surface that is not waiting for display
+	int surfaces = std::max(1u, parser->params.ulMaxNumDecodeSurfaces);
+	int index = parser->next_index % surfaces;
+	for (int n = 0; n < surfaces && InDisplayQueue(parser, index); n++)
+		index = (index + 1) % surfaces;
+	parser->next_index = index + 1;
+
+	static const unsigned int slice_offset = 0;
+	CUVIDPICPARAMS picture;
+	memset(&picture, 0, sizeof(picture));
+	picture.PicWidthInMbs = (config.width + 15) / 16;
+	picture.FrameHeightInMbs = (config.height + 15) / 16;
+	picture.CurrPicIdx = index;
+	picture.nBitstreamDataLen = (unsigned int)size;
+	picture.pBitstreamData = data;
+	picture.nNumSlices = 1;
+	picture.pSliceDataOffsets = &slice_offset;
+	picture.ref_pic_flag = 1;
+	picture.intra_pic_flag = key ? 1 : 0;
+	if (parser->params.pfnDecodePicture &&
+			parser->params.pfnDecodePicture(parser->params.pUserData, &picture) <= 0)
+		return;
+	parser->pictures++;
+
+	CUVIDPARSERDISPINFO info;
+	memset(&info, 0, sizeof(info));
+	info.picture_index = index;
+	info.progressive_frame = 1;
+	info.timestamp = timestamp;
+	parser->display.push_back(info);
+	FlushDisplay(parser, parser->params.ulMaxDisplayDelay);
+}
+
+CUresult CUDAAPI MockCreateVideoParser(CUvideoparser * obj, CUVIDPARSERPARAMS * params) {
+	if (!obj || !params)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (params->CodecType != cudaVideoCodec_H264 && params->CodecType != cudaVideoCodec_HEVC)
+		return CUDA_ERROR_INVALID_VALUE;
+	MockParser * parser = new MockParser();
+	parser->params = *params;
+	*obj = parser;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockParseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET * packet) {
+	MockParser * parser = (MockParser *)obj;
+	if (!parser || !packet)
+		return CUDA_ERROR_INVALID_VALUE;
+	CUvideotimestamp timestamp = (packet->flags & CUVID_PKT_TIMESTAMP) ? packet->timestamp : 0;
+
+	if (packet->payload && packet->payload_size > 0) {
+		const unsigned char * data = packet->payload;
+		size_t size = packet->payload_size;
+		// offsets of the pictures' start codes, what precedes the first one
+		// belongs to it
+		std::vector<size_t> starts;
+		std::vector<bool> keys;
+		for (size_t i = 0; i + 3 < size; i++) {
+			if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+				continue;
+			bool key = false;
+			if (IsPictureStart(parser->params.CodecType, data + i + 3, size - i - 3, key)) {
+				starts.push_back(starts.empty() ? 0 : (i > 0 && data[i - 1] == 0 ? i - 1 : i));
+				keys.push_back(key);
+			}
+			i += 2;
+		}
+		if (starts.empty()) {
+			starts.push_back(0);
+			keys.push_back(false);
+		}
+		for (size_t n = 0; n < starts.size(); n++) {
+			size_t end = n + 1 < starts.size() ? starts[n + 1] : size;
+			ParsePicture(parser, data + starts[n], end - starts[n], keys[n], timestamp);
+		}
+	}
+
+	if (packet->flags & CUVID_PKT_ENDOFSTREAM) {
+		FlushDisplay(parser, 0);
+		parser->sequence_sent = false;
+	}
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDestroyVideoParser(CUvideoparser obj) {
+	delete (MockParser *)obj;
+	return CUDA_SUCCESS;
+}
+
+struct MockOutputSurface {
+	std::vector<unsigned char> data;
+	bool mapped = false;
+};
+
+struct MockDecoder {
+	std::mutex mutex;
+	CUVIDDECODECREATEINFO info;
+	int device;
+	size_t memory;			// charged to the device
+	unsigned int pitch;
+	std::vector<uint32_t> seeds;	// per decode surface
+	std::vector<Clock::time_point> ready;
+	std::vector<MockOutputSurface> outputs;
+};
+
+CUresult CUDAAPI MockGetDecoderCaps(CUVIDDECODECAPS * caps) {
+	if (!caps)
+		return CUDA_ERROR_INVALID_VALUE;
+	caps->bIsSupported = (caps->eCodecType == cudaVideoCodec_H264 || caps->eCodecType == cudaVideoCodec_HEVC) &&
+			caps->eChromaFormat == cudaVideoChromaFormat_420 && caps->nBitDepthMinus8 <= 2;
+	caps->nMaxWidth = 8192;
+	caps->nMaxHeight = 8192;
+	caps->nMaxMBCount = (8192 / 16) * (8192 / 16);
+	caps->nMinWidth = 48;
+	caps->nMinHeight = 16;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockCreateDecoder(CUvideodecoder * decoder, CUVIDDECODECREATEINFO * info) {
+	if (!decoder || !info || info->ulNumDecodeSurfaces == 0 || info->ulNumOutputSurfaces == 0 ||
+			info->ulTargetWidth == 0 || info->ulTargetHeight == 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (info->OutputFormat != cudaVideoSurfaceFormat_NV12 && info->OutputFormat != cudaVideoSurfaceFormat_P016)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	// like cuvidCreateDecoder, the decoder belongs to the current context
+	if (CurrentDevice() < 0)
+		return CUDA_ERROR_INVALID_CONTEXT;
+
+	MockDecoder * obj = new MockDecoder();
+	obj->info = *info;
+	obj->device = CurrentDevice();
+	size_t sample_bytes = info->OutputFormat == cudaVideoSurfaceFormat_P016 ? 2 : 1;
+	obj->pitch = (unsigned int)AlignUp(info->ulTargetWidth * sample_bytes, kPitchAlignment);
+	size_t frame_bytes = (size_t)obj->pitch * (info->ulTargetHeight + (info->ulTargetHeight + 1) / 2);
+	obj->memory = frame_bytes * (info->ulNumDecodeSurfaces + info->ulNumOutputSurfaces);
+	obj->seeds.assign(info->ulNumDecodeSurfaces, 0);
+	obj->ready.assign(info->ulNumDecodeSurfaces, Clock::time_point());
+	obj->outputs.resize(info->ulNumOutputSurfaces);
+
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	MockDevice * device = GetDevice(state, obj->device);
+	if (!device || device->used_memory + obj->memory > state.config.device_memory) {
+		delete obj;
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
+	device->used_memory += obj->memory;
+	*decoder = obj;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDestroyDecoder(CUvideodecoder decoder) {
+	MockDecoder * obj = (MockDecoder *)decoder;
+	if (!obj)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (CurrentDevice() < 0)
+		return CUDA_ERROR_INVALID_CONTEXT;
+	{
+		MockState & state = State();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		MockDevice * device = GetDevice(state, obj->device);
+		if (device)
+			device->used_memory -= std::min(device->used_memory, obj->memory);
+	}
+	delete obj;
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockDecodePicture(CUvideodecoder decoder, CUVIDPICPARAMS * picture) {
+	MockDecoder * obj = (MockDecoder *)decoder;
+	if (!obj || !picture || picture->CurrPicIdx < 0 || picture->CurrPicIdx >= (int)obj->seeds.size())
+		return CUDA_ERROR_INVALID_VALUE;
+	uint32_t seed = MockDriver::FrameSeed(picture->pBitstreamData, picture->nBitstreamDataLen);
+	Clock::time_point ready;
+	{
+		MockState & state = State();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		MockDevice * device = GetDevice(state, obj->device);
+		ready = device ? ScheduleEngine(device->decode_free, state.config.decode_latency_us) : Clock::now();
+	}
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	obj->seeds[picture->CurrPicIdx] = seed;
+	obj->ready[picture->CurrPicIdx] = ready;
+	State().pictures_decoded.fetch_add(1, std::memory_order_relaxed);
+	return CUDA_SUCCESS;
+}
+
+void FillFrame(unsigned char * dst, unsigned int pitch, int width, int height, bool high_depth, uint32_t seed) {
+	int chroma_height = (height + 1) / 2;
+	int row_samples = (width + 1) & ~1;
+	for (int plane = 0; plane < 2; plane++) {
+		int rows = plane == 0 ? height : chroma_height;
+		unsigned char * plane_dst = dst + (plane == 0 ? 0 : (size_t)pitch * height);
+		for (int y = 0; y < rows; y++) {
+			unsigned char * row = plane_dst + (size_t)y * pitch;
+			for (int x = 0; x < row_samples; x++) {
+				unsigned char sample = MockDriver::FrameSample(seed, plane, x, y);
+				if (high_depth) {
+					row[2 * x] = 0;
+					row[2 * x + 1] = sample;
+				} else
+					row[x] = sample;
+			}
+		}
+	}
+}
+
+CUresult CUDAAPI MockMapVideoFrame64(CUvideodecoder decoder, int index, unsigned long long * dptr,
+		unsigned int * pitch, CUVIDPROCPARAMS * params) {
+	MockDecoder * obj = (MockDecoder *)decoder;
+	if (!obj || !dptr || !pitch || index < 0 || index >= (int)obj->seeds.size())
+		return CUDA_ERROR_INVALID_VALUE;
+	std::unique_lock<std::mutex> lock(obj->mutex);
+	MockOutputSurface * surface = nullptr;
+	for (size_t i = 0; i < obj->outputs.size() && !surface; i++) {
+		if (!obj->outputs[i].mapped)
+			surface = &obj->outputs[i];
+	}
+	if (!surface)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	surface->mapped = true;
+	surface->data.resize((size_t)obj->pitch * (obj->info.ulTargetHeight + (obj->info.ulTargetHeight + 1) / 2));
+	uint32_t seed = obj->seeds[index];
+	Clock::time_point ready = obj->ready[index];
+	lock.unlock();
+
+	// the surface is ours now, it is filled while other frames map
+	std::this_thread::sleep_until(ready);
+	FillFrame(surface->data.data(), obj->pitch, obj->info.ulTargetWidth, obj->info.ulTargetHeight,
+			obj->info.OutputFormat == cudaVideoSurfaceFormat_P016, seed);
+	*dptr = (unsigned long long)surface->data.data();
+	*pitch = obj->pitch;
+	State().frames_mapped.fetch_add(1, std::memory_order_relaxed);
+	return CUDA_SUCCESS;
+}
+
+CUresult CUDAAPI MockUnmapVideoFrame64(CUvideodecoder decoder, unsigned long long dptr) {
+	MockDecoder * obj = (MockDecoder *)decoder;
+	if (!obj)
+		return CUDA_ERROR_INVALID_VALUE;
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	for (size_t i = 0; i < obj->outputs.size(); i++) {
+		if (obj->outputs[i].mapped && (unsigned long long)obj->outputs[i].data.data() == dptr) {
+			obj->outputs[i].mapped = false;
+			return CUDA_SUCCESS;
+		}
+	}
+	return CUDA_ERROR_INVALID_VALUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// NVENC
+
+bool SameGuid(const GUID & a, const GUID & b) {
+	return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+// an input buffer, a registered device pointer or a mapping of one
+struct MockEncodeSurface {
+	unsigned char * base = nullptr;
+	uint32_t pitch = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	NV_ENC_BUFFER_FORMAT format = NV_ENC_BUFFER_FORMAT_NV12;
+	std::vector<unsigned char> storage;
+};
+
+struct MockBitstream {
+	std::vector<unsigned char> data;
+	bool pending = false;
+	Clock::time_point ready;
+	uint64_t timestamp = 0;
+	uint32_t frame_index = 0;
+	NV_ENC_PIC_TYPE type = NV_ENC_PIC_TYPE_P;
+};
+
+struct MockEncoder {
+	std::mutex mutex;
+	int device = 0;
+	bool initialized = false;
+	GUID codec;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t gop = NVENC_INFINITE_GOPLENGTH;
+	uint32_t frames = 0;
+};
+
+uint32_t SampleBytes(NV_ENC_BUFFER_FORMAT format) {
+	switch (format) {
+	case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
+	case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+		return 2;
+	case NV_ENC_BUFFER_FORMAT_ARGB:
+	case NV_ENC_BUFFER_FORMAT_ARGB10:
+	case NV_ENC_BUFFER_FORMAT_AYUV:
+	case NV_ENC_BUFFER_FORMAT_ABGR:
+	case NV_ENC_BUFFER_FORMAT_ABGR10:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+// rows of pitch bytes a buffer of the format needs
+uint32_t BufferRows(NV_ENC_BUFFER_FORMAT format, uint32_t height) {
+	switch (format) {
+	case NV_ENC_BUFFER_FORMAT_YUV444:
+	case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+		return height * 3;
+	case NV_ENC_BUFFER_FORMAT_ARGB:
+	case NV_ENC_BUFFER_FORMAT_ARGB10:
+	case NV_ENC_BUFFER_FORMAT_AYUV:
+	case NV_ENC_BUFFER_FORMAT_ABGR:
+	case NV_ENC_BUFFER_FORMAT_ABGR10:
+		return height;
+	default:
+		return height + (height + 1) / 2;
+	}
+}
+
+// 32 bits in five bytes of 7 bits with the top bit set, so a synthetic
+// bitstream never contains a zero byte and thus no start code emulation
+void PutField(std::vector<unsigned char> & out, uint32_t value) {
+	for (int shift = 28; shift >= 0; shift -= 7)
+		out.push_back(0x80 | ((value >> shift) & 0x7f));
+}
+
+void BuildBitstream(std::vector<unsigned char> & out, const MockEncoder * encoder, const MockEncodeSurface * input,
+		uint32_t frame_index, bool key, int size) {
+	uint32_t checksum = 2166136261u;
+	if (input->base) {
+		uint32_t row_bytes = std::min(input->pitch, input->width * SampleBytes(input->format));
+		for (uint32_t y = 0; y < input->height; y += 8) {
+			const unsigned char * row = input->base + (size_t)y * input->pitch;
+			for (uint32_t x = 0; x < row_bytes; x++)
+				checksum = (checksum ^ row[x]) * 16777619u;
+		}
+	}
+
+	out.clear();
+	out.push_back(0);
+	out.push_back(0);
+	out.push_back(0);
+	out.push_back(1);
+	if (SameGuid(encoder->codec, NV_ENC_CODEC_HEVC_GUID)) {
+		out.push_back(key ? 19 << 1 : 1 << 1);	// IDR_W_RADL or TRAIL_R
+		out.push_back(1);
+	} else {
+		out.push_back(key ? 0x65 : 0x41);		// IDR or non-IDR slice
+		out.push_back(0x80 | (frame_index & 0x7f));
+	}
+	out.push_back(0x80);				// first slice of the picture
+	PutField(out, frame_index);
+	PutField(out, checksum);
+	PutField(out, input->width);
+	PutField(out, input->height);
+	for (int i = (int)out.size(); i < size; i++)
+		out.push_back(0x80 | ((frame_index + i) & 0x7f));
+}
+
+NVENCSTATUS NVENCAPI MockOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS * params, void ** encoder) {
+	if (!params || !encoder)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (params->deviceType != NV_ENC_DEVICE_TYPE_CUDA || !params->device)
+		return NV_ENC_ERR_UNSUPPORTED_DEVICE;
+	MockEncoder * obj = new MockEncoder();
+	obj->device = reinterpret_cast<MockContext *>(params->device)->device;
+	*encoder = obj;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockGetEncodeGUIDCount(void * encoder, uint32_t * count) {
+	if (!encoder || !count)
+		return NV_ENC_ERR_INVALID_PTR;
+	*count = 2;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockGetEncodeGUIDs(void * encoder, GUID * guids, uint32_t size, uint32_t * count) {
+	if (!encoder || !guids || !count)
+		return NV_ENC_ERR_INVALID_PTR;
+	const GUID codecs[2] = {NV_ENC_CODEC_H264_GUID, NV_ENC_CODEC_HEVC_GUID};
+	*count = std::min(size, 2u);
+	for (uint32_t i = 0; i < *count; i++)
+		guids[i] = codecs[i];
+	return NV_ENC_SUCCESS;
+}
+
+const GUID kPresets[] = {
+	NV_ENC_PRESET_DEFAULT_GUID, NV_ENC_PRESET_HP_GUID, NV_ENC_PRESET_HQ_GUID, NV_ENC_PRESET_BD_GUID,
+	NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID, NV_ENC_PRESET_LOW_LATENCY_HQ_GUID, NV_ENC_PRESET_LOW_LATENCY_HP_GUID,
+	NV_ENC_PRESET_LOSSLESS_DEFAULT_GUID, NV_ENC_PRESET_LOSSLESS_HP_GUID,
+};
+const uint32_t kPresetCount = sizeof(kPresets) / sizeof(kPresets[0]);
+
+NVENCSTATUS NVENCAPI MockGetEncodePresetCount(void * encoder, GUID codec, uint32_t * count) {
+	if (!encoder || !count)
+		return NV_ENC_ERR_INVALID_PTR;
+	*count = kPresetCount;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockGetEncodePresetGUIDs(void * encoder, GUID codec, GUID * guids, uint32_t size, uint32_t * count) {
+	if (!encoder || !guids || !count)
+		return NV_ENC_ERR_INVALID_PTR;
+	*count = std::min(size, kPresetCount);
+	for (uint32_t i = 0; i < *count; i++)
+		guids[i] = kPresets[i];
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockGetEncodeCaps(void * encoder, GUID codec, NV_ENC_CAPS_PARAM * caps, int * value) {
+	if (!encoder || !caps || !value)
+		return NV_ENC_ERR_INVALID_PTR;
+	switch (caps->capsToQuery) {
+	case NV_ENC_CAPS_WIDTH_MAX:
+	case NV_ENC_CAPS_HEIGHT_MAX:
+		*value = 8192;
+		break;
+	default:
+		*value = 0;
+		break;
+	}
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockGetEncodePresetConfig(void * encoder, GUID codec, GUID preset, NV_ENC_PRESET_CONFIG * config) {
+	if (!encoder || !config)
+		return NV_ENC_ERR_INVALID_PTR;
+	uint32_t version = config->presetCfg.version;
+	memset(&config->presetCfg, 0, sizeof(config->presetCfg));
+	config->presetCfg.version = version;
+	config->presetCfg.gopLength = NVENC_INFINITE_GOPLENGTH;
+	config->presetCfg.frameIntervalP = 1;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockInitializeEncoder(void * encoder, NV_ENC_INITIALIZE_PARAMS * params) {
+	MockEncoder * obj = (MockEncoder *)encoder;
+	if (!obj || !params)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (!SameGuid(params->encodeGUID, NV_ENC_CODEC_H264_GUID) && !SameGuid(params->encodeGUID, NV_ENC_CODEC_HEVC_GUID))
+		return NV_ENC_ERR_INVALID_PARAM;
+	if (params->encodeWidth == 0 || params->encodeHeight == 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	obj->codec = params->encodeGUID;
+	obj->width = params->encodeWidth;
+	obj->height = params->encodeHeight;
+	obj->gop = params->encodeConfig ? params->encodeConfig->gopLength : NVENC_INFINITE_GOPLENGTH;
+	obj->initialized = true;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockReconfigureEncoder(void * encoder, NV_ENC_RECONFIGURE_PARAMS * params) {
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+	return MockInitializeEncoder(encoder, &params->reInitEncodeParams);
+}
+
+NVENCSTATUS NVENCAPI MockCreateInputBuffer(void * encoder, NV_ENC_CREATE_INPUT_BUFFER * params) {
+	if (!encoder || !params)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (params->width == 0 || params->height == 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+	MockEncodeSurface * surface = new MockEncodeSurface();
+	surface->width = params->width;
+	surface->height = params->height;
+	surface->format = params->bufferFmt;
+	surface->pitch = (uint32_t)AlignUp(params->width * SampleBytes(params->bufferFmt), 32);
+	surface->storage.resize((size_t)surface->pitch * BufferRows(params->bufferFmt, params->height));
+	surface->base = surface->storage.data();
+	params->inputBuffer = surface;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockDestroySurface(void * encoder, NV_ENC_INPUT_PTR surface) {
+	if (!encoder || !surface)
+		return NV_ENC_ERR_INVALID_PTR;
+	delete (MockEncodeSurface *)surface;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockLockInputBuffer(void * encoder, NV_ENC_LOCK_INPUT_BUFFER * params) {
+	if (!encoder || !params || !params->inputBuffer)
+		return NV_ENC_ERR_INVALID_PTR;
+	MockEncodeSurface * surface = (MockEncodeSurface *)params->inputBuffer;
+	params->bufferDataPtr = surface->base;
+	params->pitch = surface->pitch;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockUnlockInputBuffer(void * encoder, NV_ENC_INPUT_PTR surface) {
+	return encoder && surface ? NV_ENC_SUCCESS : NV_ENC_ERR_INVALID_PTR;
+}
+
+NVENCSTATUS NVENCAPI MockRegisterResource(void * encoder, NV_ENC_REGISTER_RESOURCE * params) {
+	if (!encoder || !params || !params->resourceToRegister)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (params->resourceType != NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR)
+		return NV_ENC_ERR_UNIMPLEMENTED;
+	MockEncodeSurface * surface = new MockEncodeSurface();
+	surface->base = (unsigned char *)params->resourceToRegister;
+	surface->pitch = params->pitch;
+	surface->width = params->width;
+	surface->height = params->height;
+	surface->format = params->bufferFormat;
+	params->registeredResource = surface;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockUnregisterResource(void * encoder, NV_ENC_REGISTERED_PTR resource) {
+	return MockDestroySurface(encoder, resource);
+}
+
+NVENCSTATUS NVENCAPI MockMapInputResource(void * encoder, NV_ENC_MAP_INPUT_RESOURCE * params) {
+	if (!encoder || !params || !params->registeredResource)
+		return NV_ENC_ERR_INVALID_PTR;
+	MockEncodeSurface * registered = (MockEncodeSurface *)params->registeredResource;
+	MockEncodeSurface * mapped = new MockEncodeSurface(*registered);
+	params->mappedResource = mapped;
+	params->mappedBufferFmt = mapped->format;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockCreateBitstreamBuffer(void * encoder, NV_ENC_CREATE_BITSTREAM_BUFFER * params) {
+	if (!encoder || !params)
+		return NV_ENC_ERR_INVALID_PTR;
+	params->bitstreamBuffer = new MockBitstream();
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockDestroyBitstreamBuffer(void * encoder, NV_ENC_OUTPUT_PTR bitstream) {
+	if (!encoder || !bitstream)
+		return NV_ENC_ERR_INVALID_PTR;
+	delete (MockBitstream *)bitstream;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockEncodePicture(void * encoder, NV_ENC_PIC_PARAMS * params) {
+	MockEncoder * obj = (MockEncoder *)encoder;
+	if (!obj || !params)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (!obj->initialized)
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	// every picture is output when submitted, there is nothing to flush
+	if (params->encodePicFlags & NV_ENC_PIC_FLAG_EOS)
+		return NV_ENC_SUCCESS;
+	if (!params->inputBuffer || !params->outputBitstream)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	int size;
+	Clock::time_point ready;
+	{
+		MockState & state = State();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		size = std::max(state.config.encoded_frame_bytes, kBitstreamHeaderBytes);
+		MockDevice * device = GetDevice(state, obj->device);
+		ready = device ? ScheduleEngine(device->encode_free, state.config.encode_latency_us) : Clock::now();
+	}
+
+	MockBitstream * bitstream = (MockBitstream *)params->outputBitstream;
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	uint32_t frame_index = obj->frames++;
+	bool key = frame_index == 0 || (params->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR) ||
+			(obj->gop != 0 && obj->gop != NVENC_INFINITE_GOPLENGTH && frame_index % obj->gop == 0);
+	BuildBitstream(bitstream->data, obj, (const MockEncodeSurface *)params->inputBuffer, frame_index, key, size);
+	bitstream->pending = true;
+	bitstream->ready = ready;
+	bitstream->timestamp = params->inputTimeStamp;
+	bitstream->frame_index = frame_index;
+	bitstream->type = key ? NV_ENC_PIC_TYPE_IDR : NV_ENC_PIC_TYPE_P;
+	State().frames_encoded.fetch_add(1, std::memory_order_relaxed);
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockLockBitstream(void * encoder, NV_ENC_LOCK_BITSTREAM * params) {
+	MockEncoder * obj = (MockEncoder *)encoder;
+	if (!obj || !params || !params->outputBitstream)
+		return NV_ENC_ERR_INVALID_PTR;
+	MockBitstream * bitstream = (MockBitstream *)params->outputBitstream;
+	Clock::time_point ready;
+	{
+		std::lock_guard<std::mutex> lock(obj->mutex);
+		if (!bitstream->pending)
+			return NV_ENC_ERR_INVALID_PARAM;
+		ready = bitstream->ready;
+	}
+	if (params->doNotWait && Clock::now() < ready)
+		return NV_ENC_ERR_LOCK_BUSY;
+	std::this_thread::sleep_until(ready);
+
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	params->bitstreamBufferPtr = bitstream->data.data();
+	params->bitstreamSizeInBytes = (uint32_t)bitstream->data.size();
+	params->outputTimeStamp = bitstream->timestamp;
+	params->outputDuration = 0;
+	params->frameIdx = bitstream->frame_index;
+	params->pictureType = bitstream->type;
+	params->pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+	params->hwEncodeStatus = 0;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockUnlockBitstream(void * encoder, NV_ENC_OUTPUT_PTR bitstream) {
+	MockEncoder * obj = (MockEncoder *)encoder;
+	if (!obj || !bitstream)
+		return NV_ENC_ERR_INVALID_PTR;
+	std::lock_guard<std::mutex> lock(obj->mutex);
+	((MockBitstream *)bitstream)->pending = false;
+	return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI MockDestroyEncoder(void * encoder) {
+	if (!encoder)
+		return NV_ENC_ERR_INVALID_PTR;
+	delete (MockEncoder *)encoder;
+	return NV_ENC_SUCCESS;
+}
+
+}
+
+void MockDriver::Enable(const MockDriverConfig & config) {
+	MockState & state = State();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (g_enabled.load(std::memory_order_relaxed)) {
+		state.config.decode_latency_us = config.decode_latency_us;
+		state.config.encode_latency_us = config.encode_latency_us;
+		return;
+	}
+	state.config = config;
+	state.devices.assign(std::max(0, config.device_count), MockDevice());
+	g_enabled.store(true, std::memory_order_release);
+}
+
+bool MockDriver::IsEnabled() {
+	return g_enabled.load(std::memory_order_acquire);
+}
+
+MockDriverStats MockDriver::GetStats() {
+	MockState & state = State();
+	MockDriverStats stats;
+	stats.pictures_decoded = state.pictures_decoded.load(std::memory_order_relaxed);
+	stats.frames_mapped = state.frames_mapped.load(std::memory_order_relaxed);
+	stats.frames_encoded = state.frames_encoded.load(std::memory_order_relaxed);
+	stats.bytes_copied = state.bytes_copied.load(std::memory_order_relaxed);
+	return stats;
+}
+
+uint32_t MockDriver::FrameSeed(const unsigned char * data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; data && i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+unsigned char MockDriver::FrameSample(uint32_t seed, int plane, int x, int y) {
+	if (plane == 0)
+		return (unsigned char)(x + y + seed);
+	return (unsigned char)(3 * x + y + (seed >> 8));
+}
+
+CUresult MockDriver::LoadCuda() {
+	if (!IsEnabled())
+		return CUDA_ERROR_NOT_INITIALIZED;
+	cuDriverGetVersion = MockDriverGetVersion;
+	cuDeviceGet = MockDeviceGet;
+	cuDeviceGetCount = MockDeviceGetCount;
+	cuDeviceGetName = MockDeviceGetName;
+	cuDeviceComputeCapability = MockDeviceComputeCapability;
+	cuDeviceTotalMem = MockDeviceTotalMem;
+	cuDeviceGetAttribute = MockDeviceGetAttribute;
+	cuCtxCreate = MockCtxCreate;
+	cuCtxDestroy = MockCtxDestroy;
+	cuCtxPushCurrent = MockCtxPushCurrent;
+	cuCtxPopCurrent = MockCtxPopCurrent;
+	cuCtxSynchronize = MockCtxSynchronize;
+	cuMemGetInfo = MockMemGetInfo;
+	cuMemAllocPitch = MockMemAllocPitch;
+	cuMemFree = MockMemFree;
+	cuMemAllocHost = MockMemAllocHost;
+	cuMemFreeHost = MockMemFreeHost;
+	cuMemcpy2D = MockMemcpy2D;
+	cuMemcpy2DAsync = MockMemcpy2DAsync;
+	cuStreamCreate = MockStreamCreate;
+	cuStreamDestroy = MockStreamDestroy;
+	cuStreamSynchronize = MockStreamSynchronize;
+	cuEventCreate = MockEventCreate;
+	cuEventDestroy = MockEventDestroy;
+	cuEventRecord = MockEventRecord;
+	cuEventSynchronize = MockEventSynchronize;
+	return CUDA_SUCCESS;
+}
+
+CUresult MockDriver::LoadCuvid() {
+	if (!IsEnabled())
+		return CUDA_ERROR_NOT_INITIALIZED;
+	cuvidCreateVideoParser = MockCreateVideoParser;
+	cuvidParseVideoData = MockParseVideoData;
+	cuvidDestroyVideoParser = MockDestroyVideoParser;
+	cuvidGetDecoderCaps = MockGetDecoderCaps;
+	cuvidCreateDecoder = MockCreateDecoder;
+	cuvidDestroyDecoder = MockDestroyDecoder;
+	cuvidDecodePicture = MockDecodePicture;
+	cuvidMapVideoFrame64 = MockMapVideoFrame64;
+	cuvidUnmapVideoFrame64 = MockUnmapVideoFrame64;
+	cuvidMapVideoFrame = MockMapVideoFrame64;
+	cuvidUnmapVideoFrame = MockUnmapVideoFrame64;
+	cuvidCtxLockCreate = MockCtxLockCreate;
+	cuvidCtxLockDestroy = MockCtxLockDestroy;
+	cuvidCtxLock = MockCtxLock;
+	cuvidCtxUnlock = MockCtxUnlock;
+	return CUDA_SUCCESS;
+}
+
+NVENCSTATUS MockDriver::CreateEncodeInstance(NV_ENCODE_API_FUNCTION_LIST * functions) {
+	if (!IsEnabled())
+		return NV_ENC_ERR_NO_ENCODE_DEVICE;
+	if (!functions)
+		return NV_ENC_ERR_INVALID_PTR;
+	functions->nvEncOpenEncodeSessionEx = MockOpenEncodeSessionEx;
+	functions->nvEncGetEncodeGUIDCount = MockGetEncodeGUIDCount;
+	functions->nvEncGetEncodeGUIDs = MockGetEncodeGUIDs;
+	functions->nvEncGetEncodeCaps = MockGetEncodeCaps;
+	functions->nvEncGetEncodePresetCount = MockGetEncodePresetCount;
+	functions->nvEncGetEncodePresetGUIDs = MockGetEncodePresetGUIDs;
+	functions->nvEncGetEncodePresetConfig = MockGetEncodePresetConfig;
+	functions->nvEncInitializeEncoder = MockInitializeEncoder;
+	functions->nvEncReconfigureEncoder = MockReconfigureEncoder;
+	functions->nvEncCreateInputBuffer = MockCreateInputBuffer;
+	functions->nvEncDestroyInputBuffer = MockDestroySurface;
+	functions->nvEncLockInputBuffer = MockLockInputBuffer;
+	functions->nvEncUnlockInputBuffer = MockUnlockInputBuffer;
+	functions->nvEncRegisterResource = MockRegisterResource;
+	functions->nvEncUnregisterResource = MockUnregisterResource;
+	functions->nvEncMapInputResource = MockMapInputResource;
+	functions->nvEncUnmapInputResource = MockDestroySurface;
+	functions->nvEncCreateBitstreamBuffer = MockCreateBitstreamBuffer;
+	functions->nvEncDestroyBitstreamBuffer = MockDestroyBitstreamBuffer;
+	functions->nvEncEncodePicture = MockEncodePicture;
+	functions->nvEncLockBitstream = MockLockBitstream;
+	functions->nvEncUnlockBitstream = MockUnlockBitstream;
+	functions->nvEncDestroyEncoder = MockDestroyEncoder;
+	return NV_ENC_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/*
+ * MockDriver.h
+ *
+ *  In-process stand-in for the CUDA, NVDEC and NVENC drivers, so the
+ *  pipelines run and can be measured on machines without a GPU.
+ */
+
+#ifndef SRC_MOCKDRIVER_H_
+#define SRC_MOCKDRIVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dynlink_cuda.h"
+#include "nvEncodeAPI.h"
+
+// What the fake devices look like and how slow their engines are. Every
+// parsed stream has the sequence described here, whatever its bytes say.
+struct MockDriverConfig {
+	int device_count = 1;
+	size_t device_memory = (size_t)8 << 30;
+	int width = 1920;
+	int height = 1080;
+	int bit_depth = 8;			// 8 or 10
+	unsigned int frame_rate_num = 30;
+	unsigned int frame_rate_den = 1;
+	// Time one picture occupies the device's decode or encode engine. A
+	// device's pictures queue up behind each other, so sessions sharing a
+	// device slow each other down as on real hardware.
+	int decode_latency_us = 0;
+	int encode_latency_us = 0;
+	int encoded_frame_bytes = 256;	// size of every synthetic bitstream
+};
+
+struct MockDriverStats {
+	uint64_t pictures_decoded = 0;
+	uint64_t frames_mapped = 0;
+	uint64_t frames_encoded = 0;
+	uint64_t bytes_copied = 0;		// by cuMemcpy2D and cuMemcpy2DAsync
+};
+
+// Device memory is host memory, so device pointers may be read directly,
+// and every CUDA call completes before it returns. The parser takes each
+// packet as whole access units: a picture starts at every start code of the
+// first slice of a picture (or the packet is one picture if it has no start
+// code), display order is decode order. Decoded frames are FrameSample
+// patterns seeded by FrameSeed of the picture's bytes. Encoded pictures are
+// one slice NAL unit carrying the frame index and a checksum of every
+// eighth luma row, so they decode again through the mock.
+class MockDriver {
+public:
+	// Routes the drivers to the mock. Must precede the first cuInit,
+	// cuvidInit and encoder session, the driver libraries are picked once
+	// per process. Calling it again only updates the latencies.
+	static void Enable(const MockDriverConfig & config);
+	static bool IsEnabled();
+	static MockDriverStats GetStats();
+
+	static uint32_t FrameSeed(const unsigned char * data, size_t size);
+	// 8 bit sample of plane 0 (luma) or 1 (interleaved chroma, x counts
+	// samples) at (x, y); P016 frames carry it in the high byte
+	static unsigned char FrameSample(uint32_t seed, int plane, int x, int y);
+
+	// used by cuInit, cuvidInit and the NVENC loader
+	static CUresult LoadCuda();
+	static CUresult LoadCuvid();
+	static NVENCSTATUS CreateEncodeInstance(NV_ENCODE_API_FUNCTION_LIST * functions);
+};
+
+#endif /* SRC_MOCKDRIVER_H_ */
@@ -9,7 +9,10 @@
  *
  */
 
+#include <atomic>
+#include <mutex>
 #include "NvEncodeAPI.h"
+#include "MockDriver.h"
 
 NVENCSTATUS NVEncoderAPI::NvEncOpenEncodeSession(void* device, uint32_t deviceType)
 {
@@ -586,7 +589,6 @@ NVEncoderAPI::NVEncoderAPI()
     m_hEncoder = NULL;
     m_bEncoderInitialized = false;
     m_pEncodeAPI = NULL;
-    m_hinstLib = NULL;
     m_fOutput = NULL;
     m_EncodeIdx = 0;
     m_uCurWidth = 0;
@@ -603,23 +605,8 @@ NVEncoderAPI::NVEncoderAPI()
 
 NVEncoderAPI::~NVEncoderAPI()
 {
-    // clean up encode API resources here
-    if (m_pEncodeAPI)
-    {
-        delete m_pEncodeAPI;
-        m_pEncodeAPI = NULL;
-    }
-
-    if (m_hinstLib)
-    {
-#if defined (NV_WINDOWS)
-        FreeLibrary(m_hinstLib);
-#else
-        dlclose(m_hinstLib);
-#endif
-
-        m_hinstLib = NULL;
-    }
+    // the function list and the library are shared, see LoadEncodeAPI
+    m_pEncodeAPI = NULL;
 }
 
 NVENCSTATUS NVEncoderAPI::ValidateEncodeGUID (GUID inputCodecGuid)
@@ -1211,39 +1198,89 @@ NVENCSTATUS NVEncoderAPI::ProcessMVOutput(const MotionEstimationBuffer *pMEBuffe
     return nvStatus;
 }
 
-NVENCSTATUS NVEncoderAPI::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType)
+// The encode library is opened and its function list created once per
+// process, then shared by every session; it stays loaded. A failed load is
+// retried by the next session. With MockDriver enabled the list is the mock's.
+static NVENCSTATUS LoadEncodeAPI(NV_ENCODE_API_FUNCTION_LIST **ppEncodeAPI)
 {
-    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
-    MYPROC nvEncodeAPICreateInstance; // function pointer to create instance in nvEncodeAPI
+    static std::atomic<NV_ENCODE_API_FUNCTION_LIST*> pLoadedAPI(NULL);
+    static std::mutex loadMutex;
+
+    *ppEncodeAPI = pLoadedAPI.load(std::memory_order_acquire);
+    if (*ppEncodeAPI)
+        return NV_ENC_SUCCESS;
+
+    std::lock_guard<std::mutex> lock(loadMutex);
+    *ppEncodeAPI = pLoadedAPI.load(std::memory_order_relaxed);
+    if (*ppEncodeAPI)
+        return NV_ENC_SUCCESS;
 
+    if (MockDriver::IsEnabled())
+    {
+        NV_ENCODE_API_FUNCTION_LIST *pEncodeAPI = new NV_ENCODE_API_FUNCTION_LIST;
+        memset(pEncodeAPI, 0, sizeof(NV_ENCODE_API_FUNCTION_LIST));
+        pEncodeAPI->version = NV_ENCODE_API_FUNCTION_LIST_VER;
+        NVENCSTATUS nvStatus = MockDriver::CreateEncodeInstance(pEncodeAPI);
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            delete pEncodeAPI;
+            return nvStatus;
+        }
+        pLoadedAPI.store(pEncodeAPI, std::memory_order_release);
+        *ppEncodeAPI = pEncodeAPI;
+        return NV_ENC_SUCCESS;
+    }
+
+    MYPROC nvEncodeAPICreateInstance; // function pointer to create instance in nvEncodeAPI
+    HINSTANCE hinstLib;
 #if defined(NV_WINDOWS)
 #if defined (_WIN64)
-    m_hinstLib = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
+    hinstLib = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
 #else
-    m_hinstLib = LoadLibrary(TEXT("nvEncodeAPI.dll"));
+    hinstLib = LoadLibrary(TEXT("nvEncodeAPI.dll"));
 #endif
 #else
-    m_hinstLib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
+    hinstLib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
 #endif
-    if (m_hinstLib == NULL)
+    if (hinstLib == NULL)
         return NV_ENC_ERR_OUT_OF_MEMORY;
 
 #if defined(NV_WINDOWS)
-    nvEncodeAPICreateInstance = (MYPROC)GetProcAddress(m_hinstLib, "NvEncodeAPICreateInstance");
+    nvEncodeAPICreateInstance = (MYPROC)GetProcAddress(hinstLib, "NvEncodeAPICreateInstance");
 #else
-    nvEncodeAPICreateInstance = (MYPROC)dlsym(m_hinstLib, "NvEncodeAPICreateInstance");
+    nvEncodeAPICreateInstance = (MYPROC)dlsym(hinstLib, "NvEncodeAPICreateInstance");
 #endif
 
-    if (nvEncodeAPICreateInstance == NULL)
-        return NV_ENC_ERR_OUT_OF_MEMORY;
+    NV_ENCODE_API_FUNCTION_LIST *pEncodeAPI = NULL;
+    NVENCSTATUS nvStatus = NV_ENC_ERR_OUT_OF_MEMORY;
+    if (nvEncodeAPICreateInstance != NULL)
+    {
+        pEncodeAPI = new NV_ENCODE_API_FUNCTION_LIST;
+        memset(pEncodeAPI, 0, sizeof(NV_ENCODE_API_FUNCTION_LIST));
+        pEncodeAPI->version = NV_ENCODE_API_FUNCTION_LIST_VER;
+        nvStatus = nvEncodeAPICreateInstance(pEncodeAPI);
+    }
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        delete pEncodeAPI;
+#if defined (NV_WINDOWS)
+        FreeLibrary(hinstLib);
+#else
+        dlclose(hinstLib);
+#endif
+        return nvStatus;
+    }
 
-    m_pEncodeAPI = new NV_ENCODE_API_FUNCTION_LIST;
-    if (m_pEncodeAPI == NULL)
-        return NV_ENC_ERR_OUT_OF_MEMORY;
+    pLoadedAPI.store(pEncodeAPI, std::memory_order_release);
+    *ppEncodeAPI = pEncodeAPI;
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVEncoderAPI::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
-    memset(m_pEncodeAPI, 0, sizeof(NV_ENCODE_API_FUNCTION_LIST));
-    m_pEncodeAPI->version = NV_ENCODE_API_FUNCTION_LIST_VER;
-    nvStatus = nvEncodeAPICreateInstance(m_pEncodeAPI);
+    nvStatus = LoadEncodeAPI(&m_pEncodeAPI);
     if (nvStatus != NV_ENC_SUCCESS)
         return nvStatus;
 
@@ -61,6 +61,7 @@ public:
         m_uPendingCount = 0;
         m_uAvailableIdx = 0;
         m_uPendingndex = 0;
+        delete[] m_pBuffer;
         m_pBuffer = new T *[m_uSize];
         for (unsigned int i = 0; i < m_uSize; i++)
         {
@@ -100,7 +101,12 @@ public:
 typedef struct _EncodeFrameConfig
 {
     uint8_t  *yuv[3];
+    uint8_t  *bgr;                  // packed BGR/BGRA host frame, used instead of yuv when set
+    uint32_t bgrBytesPerPixel;
     CUdeviceptr dptr;
+    CUdeviceptr dptrUV;             // NV12 chroma of dptr, pitch stride[1]
+    void (*release)(void *);        // retained device frame, called once when no longer read
+    void *releaseCtx;
     uint32_t stride[3];
     uint32_t width;
     uint32_t height;
@@ -272,7 +278,6 @@ protected:
     GUID                                                 codecGUID;
 
     NV_ENCODE_API_FUNCTION_LIST*                         m_pEncodeAPI;
-    HINSTANCE                                            m_hinstLib;
     void                                                *m_hEncoder;
     NV_ENC_INITIALIZE_PARAMS                             m_stCreateEncodeParams;
     NV_ENC_CONFIG                                        m_stEncodeConfig;
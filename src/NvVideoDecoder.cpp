@@ -1,109 +1,185 @@
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
+#include <system_error>
 #include "NvVideoDecoder.h"
+#include "CudaContextPool.h"
+#include "DeviceSelector.h"
+#include "VideoConvert.h"
 
-template <class T>
-void TransferToYUV(const T *psrc,
-	T *pdst_Y, T *pdst_U, T *pdst_V,
-	int width, int height, int pitch,
-	int bit_depth_minus8 = 0) {
-	int x, y, width_2, height_2;
-	const T *py = psrc;
-	const T *puv = psrc + height*pitch / sizeof(T);
-	int rsh = bit_depth_minus8 ? 8 - bit_depth_minus8 : 0;
-	// luma
-	for (y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			pdst_Y[y*width + x] = py[x] >> rsh;
-		}
-		py += pitch / sizeof(T);
-	}
-	// De-interleave chroma
-	width_2 = width >> 1;
-	height_2 = height >> 1;
-	for (y = 0; y < height_2; y++) {
-		for (x = 0; x < width_2; x++) {
-			pdst_U[y*width_2 + x] = puv[x * 2] >> rsh;
-			pdst_V[y*width_2 + x] = puv[x * 2 + 1] >> rsh;
-		}
-		puv += pitch / sizeof(T);
-	}
-}
-
-
-
-static bool IsDecoderFitting(CUVIDDECODECREATEINFO& create_info, CUVIDEOFORMAT* format) {
+// geometry holds the display_area / target size the decoder should have
+static bool IsDecoderFitting(CUVIDDECODECREATEINFO& create_info, CUVIDEOFORMAT* format, CUVIDDECODECREATEINFO& geometry) {
 	return format->codec == create_info.CodecType &&
 			format->coded_width == create_info.ulWidth &&
 			format->coded_height == create_info.ulHeight &&
 			format->chroma_format == create_info.ChromaFormat &&
 			format->bit_depth_chroma_minus8 == create_info.bitDepthMinus8 &&
-		(unsigned long)(format->display_area.right - format->display_area.left) == create_info.ulTargetWidth &&
-		(unsigned long)(format->display_area.bottom - format->display_area.top) == create_info.ulTargetHeight &&
+		geometry.display_area.left == create_info.display_area.left &&
+		geometry.display_area.top == create_info.display_area.top &&
+		geometry.display_area.right == create_info.display_area.right &&
+		geometry.display_area.bottom == create_info.display_area.bottom &&
+		geometry.ulTargetWidth == create_info.ulTargetWidth &&
+		geometry.ulTargetHeight == create_info.ulTargetHeight &&
+		geometry.ulNumDecodeSurfaces == create_info.ulNumDecodeSurfaces &&
+		geometry.ulNumOutputSurfaces == create_info.ulNumOutputSurfaces &&
 		(format->bit_depth_chroma_minus8 ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12) == create_info.OutputFormat;
 }
 
+// Parser and surface sizing of each VideoDecodeProfile, in enum order.
+struct DecodeProfileSizing {
+	int parser_surfaces;
+	int display_delay;
+	int output_surfaces;
+	int extra_decode_surfaces;
+};
+static const DecodeProfileSizing kProfileSizing[] = {
+	{10, 1, 2, 0},	// BALANCED
+	{10, 0, 1, 0},	// ZERO_LATENCY
+	{20, 4, 4, 4},	// MAX_THROUGHPUT
+};
+// upper limit of cuvidCreateDecoder
+static const int kMaxDecodeSurfaces = 32;
+
+// Source rectangle (the display area, optionally cropped) and the size the
+// decoder's post-processor scales it to. Without a target size the cropped
+// display size is kept, with one dimension only the other follows the
+// aspect ratio. Crop and scaled sizes are rounded to even for 4:2:0.
+void NvVideoDecoder::GetDecodeGeometry(CUVIDEOFORMAT* format, CUVIDDECODECREATEINFO& geometry) {
+	int left = format->display_area.left;
+	int top = format->display_area.top;
+	int width = format->display_area.right - format->display_area.left;
+	int height = format->display_area.bottom - format->display_area.top;
+
+	const VideoRect & crop = m_decode_crop;
+	if (crop.width > 0 && crop.height > 0 && crop.x >= 0 && crop.y >= 0 && crop.x < width && crop.y < height) {
+		int x = crop.x & ~1;
+		int y = crop.y & ~1;
+		left += x;
+		top += y;
+		width = std::min(crop.width, width - x) & ~1;
+		height = std::min(crop.height, height - y) & ~1;
+		if (width < 2)
+			width = 2;
+		if (height < 2)
+			height = 2;
+	}
+	geometry.display_area.left = (short)left;
+	geometry.display_area.top = (short)top;
+	geometry.display_area.right = (short)(left + width);
+	geometry.display_area.bottom = (short)(top + height);
+
+	int target_width = m_target_width;
+	int target_height = m_target_height;
+	if (target_width <= 0 && target_height <= 0) {
+		geometry.ulTargetWidth = width;
+		geometry.ulTargetHeight = height;
+		return;
+	}
+	if (target_width <= 0)
+		target_width = (int)((int64_t)width * target_height / height);
+	else if (target_height <= 0)
+		target_height = (int)((int64_t)height * target_width / width);
+	geometry.ulTargetWidth = std::max(2, (target_width + 1) & ~1);
+	geometry.ulTargetHeight = std::max(2, (target_height + 1) & ~1);
+}
+
+// Decode and output surface counts for the current profile. Without an
+// override the decode surfaces cover the codec's worst case DPB (plus the
+// profile's extra surfaces), never fewer than the parser cycles through.
+void NvVideoDecoder::GetSurfaceCounts(CUVIDEOFORMAT* format, CUVIDDECODECREATEINFO& geometry) {
+	const DecodeProfileSizing & sizing = kProfileSizing[(int)m_profile];
+	int surfaces = m_decode_surfaces;
+	if (surfaces <= 0) {
+		surfaces = 8;
+		if ((format->codec == cudaVideoCodec_H264) ||
+			(format->codec == cudaVideoCodec_H264_SVC) ||
+			(format->codec == cudaVideoCodec_H264_MVC)) {
+			//assume worst-case of 20 decode surfaces for H264
+			surfaces = 20;
+		}
+		if (format->codec == cudaVideoCodec_VP9)
+			surfaces = 12;
+		if (format->codec == cudaVideoCodec_HEVC) {
+			//ref HEVC spec: A.4.1 General tier and level limits
+			int max_luma_ps = 35651584; // currently assuming level 6.2, 8Kx4K
+			int max_dpb_pic_buf = 6;
+			int pic_size_in_samples_y = format->coded_width * format->coded_height;
+			int max_dpb_size = 0;
+			if (pic_size_in_samples_y <= (max_luma_ps >> 2))
+				max_dpb_size = max_dpb_pic_buf * 4;
+			else if (pic_size_in_samples_y <= (max_luma_ps >> 1))
+				max_dpb_size = max_dpb_pic_buf * 2;
+			else if (pic_size_in_samples_y <= ((3 * max_luma_ps) >> 2))
+				max_dpb_size = (max_dpb_pic_buf * 4) / 3;
+			else
+				max_dpb_size = max_dpb_pic_buf;
+			max_dpb_size = max_dpb_size < 16 ? max_dpb_size : 16;
+			surfaces = max_dpb_size + 4;
+		}
+		surfaces += sizing.extra_decode_surfaces;
+	}
+	surfaces = std::max(surfaces, m_stats.parser_surfaces);
+	geometry.ulNumDecodeSurfaces = std::min(surfaces, kMaxDecodeSurfaces);
+	geometry.ulNumOutputSurfaces = m_output_surfaces > 0 ? m_output_surfaces : sizing.output_surfaces;
+}
+
 int CUDAAPI NvVideoDecoder::HandleVideoSequence(void* user_data, CUVIDEOFORMAT* format) {
 	NvVideoDecoder* obj = (NvVideoDecoder*)user_data;
 
-	if (IsDecoderFitting(obj->m_vide_decoder_create_info, format)) {
+	CUVIDDECODECREATEINFO geometry;
+	memset(&geometry, 0, sizeof(geometry));
+	obj->GetDecodeGeometry(format, geometry);
+	obj->GetSurfaceCounts(format, geometry);
+	if (IsDecoderFitting(obj->m_vide_decoder_create_info, format, geometry)) {
 		return 0;
 	}
 
+	// the output thread and the consumer of retained frames still use
+	// surfaces of the old decoder
+	obj->WaitOutputIdle();
+	obj->WaitRetainedIdle();
+	// the parser may run on any thread, e.g. a DecodeScheduler worker
+	cuCtxPushCurrent(obj->m_current_ctx);
 	memset(&obj->m_vide_decoder_create_info, 0, sizeof(CUVIDDECODECREATEINFO));
 	if (obj->m_video_decoder) {
 		cuvidDestroyDecoder(obj->m_video_decoder);
+		obj->m_video_decoder = nullptr;
 	}
 
 	obj->m_vide_decoder_create_info.CodecType = format->codec;
 	obj->m_vide_decoder_create_info.ulWidth = format->coded_width;
 	obj->m_vide_decoder_create_info.ulHeight = format->coded_height;
-	obj->m_vide_decoder_create_info.ulNumDecodeSurfaces = 8;
-	if ((obj->m_vide_decoder_create_info.CodecType == cudaVideoCodec_H264) ||
-		(obj->m_vide_decoder_create_info.CodecType == cudaVideoCodec_H264_SVC) ||
-		(obj->m_vide_decoder_create_info.CodecType == cudaVideoCodec_H264_MVC)) {
-		//assume worst-case of 20 decode surfaces for H264
-		obj->m_vide_decoder_create_info.ulNumDecodeSurfaces = 20;
-	}
-	if (obj->m_vide_decoder_create_info.CodecType == cudaVideoCodec_VP9)
-		obj->m_vide_decoder_create_info.ulNumDecodeSurfaces = 12;
-	if (obj->m_vide_decoder_create_info.CodecType == cudaVideoCodec_HEVC) {
-		//ref HEVC spec: A.4.1 General tier and level limits
-		int max_luma_ps = 35651584; // currently assuming level 6.2, 8Kx4K
-		int max_dpb_pic_buf = 6;
-		int pic_size_in_samples_y = obj->m_vide_decoder_create_info.ulWidth * obj->m_vide_decoder_create_info.ulHeight;
-		int max_dpb_size = 0;
-		if (pic_size_in_samples_y <= (max_luma_ps >> 2))
-			max_dpb_size = max_dpb_pic_buf * 4;
-		else if (pic_size_in_samples_y <= (max_luma_ps >> 1))
-			max_dpb_size = max_dpb_pic_buf * 2;
-		else if (pic_size_in_samples_y <= ((3 * max_luma_ps) >> 2))
-			max_dpb_size = (max_dpb_pic_buf * 4) / 3;
-		else
-			max_dpb_size = max_dpb_pic_buf;
-		max_dpb_size = max_dpb_size < 16 ? max_dpb_size : 16;
-		obj->m_vide_decoder_create_info.ulNumDecodeSurfaces = max_dpb_size + 4;
-	}
+	obj->m_vide_decoder_create_info.ulNumDecodeSurfaces = geometry.ulNumDecodeSurfaces;
 	obj->m_vide_decoder_create_info.ChromaFormat = format->chroma_format;
 	obj->m_vide_decoder_create_info.OutputFormat = format->bit_depth_chroma_minus8 ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12;
 	obj->m_vide_decoder_create_info.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
 	obj->m_vide_decoder_create_info.bitDepthMinus8 = format->bit_depth_chroma_minus8;
-	obj->m_vide_decoder_create_info.ulTargetWidth = format->display_area.right - format->display_area.left;
-	obj->m_vide_decoder_create_info.ulTargetHeight = format->display_area.bottom - format->display_area.top;
-	obj->m_vide_decoder_create_info.display_area.left = 0;
-	obj->m_vide_decoder_create_info.display_area.right = (short)obj->m_vide_decoder_create_info.ulTargetWidth;
-	obj->m_vide_decoder_create_info.display_area.top = 0;
-	obj->m_vide_decoder_create_info.display_area.bottom = (short)obj->m_vide_decoder_create_info.ulTargetHeight;
-	obj->m_vide_decoder_create_info.ulNumOutputSurfaces = 2;
+	// the post-processor crops display_area and scales it to the target size
+	obj->m_vide_decoder_create_info.ulTargetWidth = geometry.ulTargetWidth;
+	obj->m_vide_decoder_create_info.ulTargetHeight = geometry.ulTargetHeight;
+	obj->m_vide_decoder_create_info.display_area = geometry.display_area;
+	obj->m_vide_decoder_create_info.ulNumOutputSurfaces = geometry.ulNumOutputSurfaces;
 	obj->m_vide_decoder_create_info.ulCreationFlags = cudaVideoCreate_PreferCUVID;
 	obj->m_vide_decoder_create_info.vidLock = obj->m_ctx_lock;
+	obj->m_stats.decode_surfaces = geometry.ulNumDecodeSurfaces;
+	obj->m_stats.output_surfaces = geometry.ulNumOutputSurfaces;
+	obj->m_retained_frames.assign(geometry.ulNumOutputSurfaces, RetainedFrame());
+	double pixel_rate = 0;
+	if (format->frame_rate.numerator && format->frame_rate.denominator)
+		pixel_rate = (double)geometry.ulTargetWidth * geometry.ulTargetHeight * format->frame_rate.numerator / format->frame_rate.denominator;
+	DeviceSelector::Update(obj->m_device, obj->m_pixel_rate, pixel_rate);
+	obj->m_pixel_rate = pixel_rate;
 
 	CUresult cu_result = cuvidCreateDecoder(&obj->m_video_decoder, &obj->m_vide_decoder_create_info);
+	CUcontext ctx;
+	cuCtxPopCurrent(&ctx);
 	if (cu_result != CUDA_SUCCESS) {
+		obj->m_video_decoder = nullptr;
 		return -1;
 	}
 
-	obj->m_frame_queue->init(obj->m_vide_decoder_create_info.ulTargetWidth, obj->m_vide_decoder_create_info.ulTargetHeight);
+	obj->m_frame_queue->init(obj->m_vide_decoder_create_info.ulTargetWidth, obj->m_vide_decoder_create_info.ulTargetHeight,
+			obj->m_vide_decoder_create_info.ulNumDecodeSurfaces);
 
 	return 1;
 }
@@ -123,22 +199,47 @@ int CUDAAPI NvVideoDecoder::HandlePictureDisplay(void* user_data, CUVIDPARSERDIS
 	if(!user_data)
 		return -1;
 	NvVideoDecoder* obj = (NvVideoDecoder*)user_data;
-	obj->OutputVideoFrame();
+	// pts are handed out in display order, the frame carries its own from here
+	if(!obj->m_ptsqueue.empty()){
+		disp_params->timestamp = obj->m_ptsqueue.front();
+		obj->m_ptsqueue.pop();
+	}else
+		disp_params->timestamp = 0;
+
+	if(!obj->m_output_thread.joinable()){
+		obj->OutputVideoFrame();
+		obj->m_frame_queue->enqueue(disp_params);
+		return 1;
+	}
+
+	std::unique_lock<std::mutex> lock(obj->m_output_mutex);
+	while(obj->m_output_pending >= obj->m_output_queue_depth && !obj->m_output_exit)
+		obj->m_output_cond.wait(lock);
 	obj->m_frame_queue->enqueue(disp_params);
+	obj->m_output_pending++;
+	lock.unlock();
+	obj->m_output_cond.notify_all();
 	return 1;
 }
 
 NvVideoDecoder::~NvVideoDecoder() {
+	StopOutputThread();
+	WaitRetainedIdle();
 	if (m_frame_queue)
 		m_frame_queue->endDecode();
+	// the context is shared, everything this decoder made in it goes first
+	if(m_current_ctx)
+		cuCtxPushCurrent(m_current_ctx);
 	if (m_video_decoder)
 		cuvidDestroyDecoder(m_video_decoder);
 	if (m_video_parser)
 		cuvidDestroyVideoParser(m_video_parser);
-	if(m_ctx_lock)
-		cuvidCtxLockDestroy(m_ctx_lock);
-	if(m_current_ctx)
-		cuCtxDestroy(m_current_ctx);
+	for(int i=0;i<2;i++){
+		if(m_copy_event[i])
+			cuEventDestroy(m_copy_event[i]);
+	}
+	if(m_copy_stream)
+		cuStreamDestroy(m_copy_stream);
 
 	if (m_frame_queue){
 		delete m_frame_queue;
@@ -149,9 +250,24 @@ NvVideoDecoder::~NvVideoDecoder() {
 		if(m_gpu_buffer[i])
 			cuMemFreeHost(m_gpu_buffer[i]);
 	}
+	if(m_gpu_staging)
+		cuMemFreeHost(m_gpu_staging);
+	if(m_current_ctx){
+		CUcontext ctx;
+		cuCtxPopCurrent(&ctx);
+		ReleaseDevice();
+	}
 }
 
 bool NvVideoDecoder::Start(VideoCodec codec,VideoFrameCB cb,void * user_data,bool download_gpu_buffer){
+	VideoDecodeParam param;
+	param.codec = codec;
+	param.download_gpu_buffer = download_gpu_buffer;
+	return Start(param, cb, user_data);
+}
+
+bool NvVideoDecoder::Start(VideoDecodeParam & param,VideoFrameCB cb,void * user_data){
+	VideoCodec codec = param.codec;
 	CUresult cu_result = CUDA_SUCCESS;
 	cu_result = cuInit(0, __CUDA_API_VERSION, nullptr);
 	if(cu_result != CUDA_SUCCESS)
@@ -159,24 +275,43 @@ bool NvVideoDecoder::Start(VideoCodec codec,VideoFrameCB cb,void * user_data,boo
 	cu_result = cuvidInit();
 	if(cu_result != CUDA_SUCCESS)
 		return false;
-	CUdevice device;
-	int bestdevice = gpuGetMaxGflopsDeviceIdDRV();
-	cu_result = cuDeviceGet(&device, bestdevice);
-	if(cu_result != CUDA_SUCCESS)
-		return false;
-	cu_result = cuCtxCreate(&m_current_ctx, CU_CTX_SCHED_AUTO, device);
-	if(cu_result != CUDA_SUCCESS)
-		return false;
-	cu_result = cuvidCtxLockCreate(&m_ctx_lock, m_current_ctx);
-	if(cu_result != CUDA_SUCCESS)
-		return false;
+	// a restarted decoder keeps its device and the context it borrowed; the
+	// pixel rate is known once the sequence header is parsed
+	bool acquired = !m_current_ctx;
+	if(acquired){
+		int device = DeviceSelector::Acquire(0, param.device_id, param.device_group);
+		if(device < 0)
+			return false;
+		if(!CudaContextPool::Acquire(device, m_current_ctx, m_ctx_lock)){
+			DeviceSelector::Release(device, 0, param.device_group);
+			return false;
+		}
+		m_device = device;
+		m_device_group = param.device_group;
+	}
 	cu_result = cuCtxPushCurrent(m_current_ctx);
-	if(cu_result != CUDA_SUCCESS)
+	if(cu_result != CUDA_SUCCESS){
+		if(acquired)
+			ReleaseDevice();
 		return false;
+	}
 
 	if(!m_frame_queue)
 		m_frame_queue = new CUVIDFrameQueue(m_ctx_lock);
 
+	const DecodeProfileSizing & sizing = kProfileSizing[(int)param.profile];
+	int parser_surfaces = std::min(param.decode_surfaces > 0 ? param.decode_surfaces : sizing.parser_surfaces, kMaxDecodeSurfaces);
+	int display_delay = param.display_delay >= 0 ? param.display_delay : sizing.display_delay;
+	if (m_video_parser && (parser_surfaces != m_stats.parser_surfaces || display_delay != m_stats.display_delay)) {
+		cuvidDestroyVideoParser(m_video_parser);
+		m_video_parser = nullptr;
+	}
+	m_profile = param.profile;
+	m_decode_surfaces = param.decode_surfaces;
+	m_output_surfaces = param.output_surfaces;
+	m_stats.parser_surfaces = parser_surfaces;
+	m_stats.display_delay = display_delay;
+
 	if (!m_video_parser){
 
 		CUVIDPARSERPARAMS video_parser_params;
@@ -187,9 +322,9 @@ bool NvVideoDecoder::Start(VideoCodec codec,VideoFrameCB cb,void * user_data,boo
 		else if(codec == VideoCodec::HEVC)
 			video_parser_params.CodecType = cudaVideoCodec_HEVC;
 		else
-			return false;
-		video_parser_params.ulMaxNumDecodeSurfaces = 10;
-		video_parser_params.ulMaxDisplayDelay = 1;
+			return AbortStart(acquired);
+		video_parser_params.ulMaxNumDecodeSurfaces = parser_surfaces;
+		video_parser_params.ulMaxDisplayDelay = display_delay;
 		video_parser_params.pUserData = this;
 		video_parser_params.pfnSequenceCallback = HandleVideoSequence;
 		video_parser_params.pfnDecodePicture = HandlePictureDecode;
@@ -197,21 +332,187 @@ bool NvVideoDecoder::Start(VideoCodec codec,VideoFrameCB cb,void * user_data,boo
 
 		cu_result = cuvidCreateVideoParser(&m_video_parser, &video_parser_params);
 		if (cu_result != CUDA_SUCCESS) {
-			return false;
+			return AbortStart(acquired);
 		}
 	}
 
+	// frames still queued are delivered with the old settings
+	StopOutputThread();
 	while(!m_ptsqueue.empty()){
 		m_ptsqueue.pop();
 	}
 
 	m_frame_cb = cb;
 	m_user_data = user_data;
-	m_download_gpu_buffer = download_gpu_buffer;
+	m_download_gpu_buffer = param.download_gpu_buffer;
+	m_retain_frames = param.retain_device_frames && !param.download_gpu_buffer;
+	m_output_depth = param.output_depth;
+	m_output_fmt = param.output_fmt;
+	m_color_matrix = param.color_matrix;
+	m_color_range = param.color_range;
+	m_tensor = param.tensor;
+	m_tensor_size = param.tensor_size;
+	memcpy(m_tensor_scale, param.tensor_scale, sizeof(m_tensor_scale));
+	memcpy(m_tensor_bias, param.tensor_bias, sizeof(m_tensor_bias));
+
+	m_download_chunks = param.download_chunks;
+	m_download_align = param.download_align;
+	m_luma_only = param.luma_only;
+	m_crop = param.crop;
+	m_roi_cb = param.roi_cb;
+	m_target_width = param.target_width;
+	m_target_height = param.target_height;
+	m_decode_crop = param.decode_crop;
+	if (m_download_chunks > 1 && !m_copy_stream) {
+		cu_result = cuStreamCreate(&m_copy_stream, 0);
+		if (cu_result != CUDA_SUCCESS)
+			return AbortStart(acquired);
+		for (int i = 0; i < 2; i++) {
+			cu_result = cuEventCreate(&m_copy_event[i], CU_EVENT_DISABLE_TIMING);
+			if (cu_result != CUDA_SUCCESS)
+				return AbortStart(acquired);
+		}
+	}
 
+	if (param.convert_threads == 0)
+		m_convert_pool.Stop();
+	else if (!m_convert_pool.Start(param.convert_threads, param.convert_cpus, param.convert_cpu_count))
+		return AbortStart(acquired);
+
+	if (param.output_queue_depth > 0 && !StartOutputThread(param.output_queue_depth))
+		return AbortStart(acquired);
+
+	// the callbacks make the context current where they need it
+	CUcontext ctx;
+	cuCtxPopCurrent(&ctx);
 	return true;
 }
 
+// Undoes a Start that failed with the context pushed. When that Start
+// acquired the device, what it made in the context is destroyed and the
+// context and the device selector session are given back, so a retried
+// Start begins from scratch.
+bool NvVideoDecoder::AbortStart(bool acquired){
+	CUcontext ctx;
+	if(!acquired){
+		cuCtxPopCurrent(&ctx);
+		return false;
+	}
+	if(m_video_parser){
+		cuvidDestroyVideoParser(m_video_parser);
+		m_video_parser = nullptr;
+	}
+	for(int i=0;i<2;i++){
+		if(m_copy_event[i])
+			cuEventDestroy(m_copy_event[i]);
+		m_copy_event[i] = nullptr;
+	}
+	if(m_copy_stream){
+		cuStreamDestroy(m_copy_stream);
+		m_copy_stream = nullptr;
+	}
+	cuCtxPopCurrent(&ctx);
+	// the frame queue waits on the lock of the released context
+	delete m_frame_queue;
+	m_frame_queue = nullptr;
+	ReleaseDevice();
+	return false;
+}
+
+void NvVideoDecoder::ReleaseDevice(){
+	CudaContextPool::Release(m_current_ctx);
+	DeviceSelector::Release(m_device, m_pixel_rate, m_device_group);
+	m_current_ctx = nullptr;
+	m_ctx_lock = nullptr;
+	m_device = -1;
+	m_pixel_rate = 0;
+}
+
+
+bool NvVideoDecoder::StartOutputThread(int depth) {
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_output_queue_depth = depth;
+	m_output_exit = false;
+	try {
+		m_output_thread = std::thread(&NvVideoDecoder::OutputLoop, this);
+	} catch (const std::system_error &) {
+		return false;
+	}
+	return true;
+}
+
+void NvVideoDecoder::StopOutputThread() {
+	if (!m_output_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_output_mutex);
+		m_output_exit = true;
+	}
+	m_output_cond.notify_all();
+	m_output_thread.join();
+}
+
+void NvVideoDecoder::WaitOutputIdle() {
+	std::unique_lock<std::mutex> lock(m_output_mutex);
+	while (m_output_pending > 0 && m_output_thread.joinable())
+		m_output_cond.wait(lock);
+}
+
+void NvVideoDecoder::OutputLoop() {
+	cuCtxPushCurrent(m_current_ctx);
+	std::unique_lock<std::mutex> lock(m_output_mutex);
+	for (;;) {
+		while (m_output_pending == 0 && !m_output_exit)
+			m_output_cond.wait(lock);
+		if (m_output_pending == 0)
+			break;
+		lock.unlock();
+		OutputVideoFrame();
+		lock.lock();
+		m_output_pending--;
+		m_output_cond.notify_all();
+	}
+	lock.unlock();
+	CUcontext ctx;
+	cuCtxPopCurrent(&ctx);
+}
+
+
+NvVideoDecoder::RetainedFrame * NvVideoDecoder::AcquireRetainedSlot() {
+	std::unique_lock<std::mutex> lock(m_retain_mutex);
+	while (m_retained_count >= (int)m_retained_frames.size())
+		m_retain_cond.wait(lock);
+	for (size_t i = 0; i < m_retained_frames.size(); i++) {
+		if (!m_retained_frames[i].used) {
+			m_retained_frames[i].used = true;
+			m_retained_count++;
+			return &m_retained_frames[i];
+		}
+	}
+	return nullptr;
+}
+
+void NvVideoDecoder::ReleaseRetainedFrame(void * frame) {
+	RetainedFrame * retained = (RetainedFrame *)frame;
+	NvVideoDecoder * obj = retained->decoder;
+	{
+		CCtxAutoLock lock(obj->m_ctx_lock);
+		cuvidUnmapVideoFrame(obj->m_video_decoder, retained->device_ptr);
+	}
+	obj->m_frame_queue->releaseFrame(&retained->info);
+	{
+		std::lock_guard<std::mutex> lock(obj->m_retain_mutex);
+		retained->used = false;
+		obj->m_retained_count--;
+	}
+	obj->m_retain_cond.notify_all();
+}
+
+void NvVideoDecoder::WaitRetainedIdle() {
+	std::unique_lock<std::mutex> lock(m_retain_mutex);
+	while (m_retained_count > 0)
+		m_retain_cond.wait(lock);
+}
 
 int NvVideoDecoder::InputData(MediaDataBitStream & bs){
 	if(!m_video_parser)
@@ -221,6 +522,9 @@ int NvVideoDecoder::InputData(MediaDataBitStream & bs){
 	packet.payload = bs.buffer;
 	packet.payload_size = bs.buffer_len;
 	packet.flags = CUVID_PKT_TIMESTAMP;
+	// lets the parser decode the picture now instead of at the next start code
+	if (m_profile == VideoDecodeProfile::ZERO_LATENCY)
+		packet.flags |= CUVID_PKT_ENDOFPICTURE;
 	packet.timestamp = 0;
 	m_ptsqueue.push(bs.pts);
 	if (packet.payload_size != 0 && packet.payload != nullptr) {
@@ -229,6 +533,29 @@ int NvVideoDecoder::InputData(MediaDataBitStream & bs){
 
 	return true;
 }
+// The pts queue is filled for all packets first, then each packet goes to
+// the parser as it is: joining them into one payload would copy the batch
+// for a saving of a few calls.
+int NvVideoDecoder::InputBatch(MediaDataBitStream * packets, int count){
+	if(!m_video_parser || !packets || count < 0)
+		return false;
+	for (int i = 0; i < count; i++)
+		m_ptsqueue.push(packets[i].pts);
+
+	CUVIDSOURCEDATAPACKET packet;
+	packet.flags = CUVID_PKT_TIMESTAMP;
+	if (m_profile == VideoDecodeProfile::ZERO_LATENCY)
+		packet.flags |= CUVID_PKT_ENDOFPICTURE;
+	packet.timestamp = 0;
+	for (int i = 0; i < count; i++) {
+		if (!packets[i].buffer || packets[i].buffer_len <= 0)
+			continue;
+		packet.payload = packets[i].buffer;
+		packet.payload_size = packets[i].buffer_len;
+		cuvidParseVideoData(m_video_parser, &packet);
+	}
+	return true;
+}
 bool NvVideoDecoder::Stop(){
 	if(!m_video_parser || !m_frame_queue)
 		return false;
@@ -238,6 +565,7 @@ bool NvVideoDecoder::Stop(){
 	packet.flags = CUVID_PKT_ENDOFSTREAM;
 	packet.timestamp = 0;
 	cuvidParseVideoData(m_video_parser, &packet);
+	StopOutputThread();
 	while (!m_frame_queue->isEmpty()) {
 		OutputVideoFrame();
 	}
@@ -246,6 +574,299 @@ bool NvVideoDecoder::Stop(){
 }
 
 
+void NvVideoDecoder::GetOutputLineSize(int width, int bit_depth_minus8, int line_size[3]) {
+	if (m_luma_only) {
+		if (bit_depth_minus8 == 0 || m_output_depth == VideoOutputDepth::DITHER8)
+			line_size[0] = width;
+		else if (m_output_depth == VideoOutputDepth::PACKED10)
+			line_size[0] = Packed10LineSize(width);
+		else
+			line_size[0] = width * 2;
+		line_size[1] = line_size[2] = 0;
+	} else if (m_output_fmt == VideoBaseBandFmt::BGR || m_output_fmt == VideoBaseBandFmt::RGB) {
+		line_size[0] = width * 3;
+		line_size[1] = line_size[2] = 0;
+	} else if (m_output_fmt == VideoBaseBandFmt::BGRA || m_output_fmt == VideoBaseBandFmt::RGBA) {
+		line_size[0] = width * 4;
+		line_size[1] = line_size[2] = 0;
+	} else if (bit_depth_minus8 == 0 || m_output_depth == VideoOutputDepth::DITHER8) {
+		line_size[0] = width;
+		line_size[1] = line_size[2] = width / 2;
+	} else if (m_output_depth == VideoOutputDepth::PACKED10) {
+		line_size[0] = Packed10LineSize(width);
+		line_size[1] = line_size[2] = Packed10LineSize(width / 2);
+	} else {
+		line_size[0] = width * 2;
+		line_size[1] = line_size[2] = width / 2 * 2;
+	}
+}
+
+// Region of the surface to download: the crop rectangle, then whatever the
+// roi callback makes of it. For 4:2:0 the origin is rounded down and the
+// size up to even, clamped to the surface, so every chroma sample of the
+// region is downloaded. An empty or off-surface region means the whole frame.
+void NvVideoDecoder::GetDownloadRegion(int width, int height, int64_t pts, VideoRect & roi) {
+	roi = m_crop;
+	if (m_roi_cb)
+		m_roi_cb(width, height, pts, roi, m_user_data);
+	roi.x &= ~1;
+	roi.y &= ~1;
+	if (roi.width > 0 && roi.height > 0 && roi.x >= 0 && roi.y >= 0 && roi.x < width && roi.y < height) {
+		roi.width = std::min((roi.width + 1) & ~1, (width - roi.x) & ~1);
+		roi.height = std::min((roi.height + 1) & ~1, (height - roi.y) & ~1);
+		if (roi.width > 0 && roi.height > 0)
+			return;
+	}
+	roi.x = roi.y = 0;
+	roi.width = width;
+	roi.height = height;
+}
+
+// Converts rows [y0, y1) of the frame, src_y/src_uv point at luma row y0 and
+// chroma row y0 / 2 of the staging buffer. y0 is a multiple of 8 so bands
+// line up with chroma rows and the dither pattern.
+void NvVideoDecoder::ConvertBand(const FrameLayout & f, unsigned char * src_y, unsigned char * src_uv, int y0, int y1) {
+	int rows = y1 - y0;
+	int src_pitch = f.staging_pitch;
+	const int * line_size = f.line_size;
+	unsigned char * dst_y = m_gpu_buffer[1] + (size_t)y0 * line_size[0];
+	const unsigned short * src16_y = (const unsigned short *)src_y;
+	const unsigned short * src16_uv = (const unsigned short *)src_uv;
+
+	if (f.luma_only) {
+		if (f.bit_depth_minus8 == 0) {
+			for (int y = 0; y < rows; y++) {
+				memcpy(dst_y + (size_t)y * line_size[0], src_y + (size_t)y * src_pitch, f.width);
+			}
+		} else {
+			ConvertP016Luma(src16_y, src_pitch, dst_y, line_size[0], f.width, rows, m_output_depth, 8 - f.bit_depth_minus8);
+		}
+		return;
+	}
+
+	if (line_size[1] == 0) {
+		if (f.bit_depth_minus8) {
+			// narrow in place, the staging buffer keeps its pitch
+			ConvertP016ToNV12Dither8(src16_y, src16_uv, src_pitch, src_y, src_uv, src_pitch, f.width, rows);
+		}
+		ConvertNV12ToRGB(src_y, src_uv, src_pitch, dst_y, line_size[0],
+				m_output_fmt, f.width, rows, m_color_matrix, m_color_range,
+				f.tensor ? f.tensor + (size_t)y0 * f.width : nullptr, m_tensor_scale, m_tensor_bias,
+				(size_t)f.width * f.height);
+		return;
+	}
+
+	unsigned char * dst_u = m_gpu_buffer[2] + (size_t)(y0 / 2) * line_size[1];
+	unsigned char * dst_v = m_gpu_buffer[3] + (size_t)(y0 / 2) * line_size[2];
+	if (f.bit_depth_minus8 == 0) {
+		ConvertNV12ToI420(src_y, src_uv, src_pitch, dst_y, dst_u, dst_v, line_size[0], line_size[1], f.width, rows);
+	}
+	else if (m_output_depth == VideoOutputDepth::DITHER8) {
+		ConvertP016ToI420Dither8(src16_y, src16_uv, src_pitch,
+				dst_y, dst_u, dst_v, line_size[0], line_size[1], f.width, rows);
+	}
+	else if (m_output_depth == VideoOutputDepth::PACKED10) {
+		ConvertP016ToI420Packed10(src16_y, src16_uv, src_pitch,
+				dst_y, dst_u, dst_v, line_size[0], line_size[1], f.width, rows);
+	}
+	else {
+		ConvertP016ToI420(src16_y, src16_uv, src_pitch,
+				(unsigned short *)dst_y, (unsigned short *)dst_u, (unsigned short *)dst_v, line_size[0], line_size[1],
+				f.width, rows, 8 - f.bit_depth_minus8);
+	}
+}
+
+// ConvertBand over [y0, y1), split across the conversion pool when it runs
+void NvVideoDecoder::ConvertRows(const FrameLayout & f, unsigned char * src_y, unsigned char * src_uv, int y0, int y1) {
+	int workers = m_convert_pool.GetWorkerCount();
+	if (workers == 0) {
+		ConvertBand(f, src_y, src_uv, y0, y1);
+		return;
+	}
+	int src_pitch = f.staging_pitch;
+	int band = VideoConvertPool::GetBandRows(src_pitch * 3 / 2, y1 - y0, workers);
+	int count = (y1 - y0 + band - 1) / band;
+	m_convert_pool.Run(count, [&](int i) {
+		int offset = i * band;
+		ConvertBand(f, src_y + (size_t)offset * src_pitch, src_uv + (size_t)(offset / 2) * src_pitch,
+				y0 + offset, std::min(y1, y0 + offset + band));
+	});
+}
+
+// Copies region rows [y0, y1) and, unless luma only, their chroma rows of the
+// mapped surface into dst, chroma rows start at row chroma_row of dst. Only
+// row_bytes of every row cross the bus, padding and anything outside the
+// region stay on the device. Asynchronous when stream is set.
+bool NvVideoDecoder::CopyRows(const FrameLayout & f, unsigned char * dst, int chroma_row, int y0, int y1, CUstream stream) {
+	// x is even, so it is also the byte offset of its CbCr pair in units of samples
+	size_t x_offset = (size_t)f.x * (f.bit_depth_minus8 ? 2 : 1);
+	CUDA_MEMCPY2D copy;
+	memset(&copy, 0, sizeof(copy));
+	copy.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+	copy.srcDevice = f.device_ptr + (size_t)(f.y + y0) * f.pic_pitch + x_offset;
+	copy.srcPitch = f.pic_pitch;
+	copy.dstMemoryType = CU_MEMORYTYPE_HOST;
+	copy.dstHost = dst;
+	copy.dstPitch = f.staging_pitch;
+	copy.WidthInBytes = f.row_bytes;
+	copy.Height = y1 - y0;
+	CUresult cu_result = stream ? cuMemcpy2DAsync(&copy, stream) : cuMemcpy2D(&copy);
+	if (cu_result != CUDA_SUCCESS)
+		return false;
+
+	copy.srcDevice = f.device_ptr + (size_t)(f.surface_height + (f.y + y0) / 2) * f.pic_pitch + x_offset;
+	copy.dstHost = dst + (size_t)chroma_row * f.staging_pitch;
+	copy.Height = y1 / 2 - y0 / 2;
+	if (f.luma_only || copy.Height == 0)
+		return true;
+	cu_result = stream ? cuMemcpy2DAsync(&copy, stream) : cuMemcpy2D(&copy);
+	return cu_result == CUDA_SUCCESS;
+}
+
+// Downloads the frame in chunks on the copy stream, alternating between two
+// pinned staging buffers: chunk k is converted while chunk k + 1 is copied.
+// A chunk buffer holds chunk_rows luma rows followed by their chroma rows.
+bool NvVideoDecoder::DownloadPipelined(const FrameLayout & f, int chunk_rows) {
+	unsigned char * staging[2] = { m_gpu_buffer[0], m_gpu_staging };
+	int count = (f.height + chunk_rows - 1) / chunk_rows;
+	for (int k = 0; k <= count; k++) {
+		// queue chunk k, the buffer it reuses held chunk k - 2 which is already converted
+		if (k < count) {
+			int y0 = k * chunk_rows;
+			bool queued;
+			{
+				CCtxAutoLock lock(m_ctx_lock);
+				queued = CopyRows(f, staging[k & 1], chunk_rows, y0, std::min(f.height, y0 + chunk_rows), m_copy_stream) &&
+						cuEventRecord(m_copy_event[k & 1], m_copy_stream) == CUDA_SUCCESS;
+			}
+			if (!queued) {
+				cuStreamSynchronize(m_copy_stream);
+				return false;
+			}
+		}
+		// convert chunk k - 1 while chunk k is in flight
+		if (k > 0) {
+			int p = k - 1;
+			if (cuEventSynchronize(m_copy_event[p & 1]) != CUDA_SUCCESS) {
+				cuStreamSynchronize(m_copy_stream);
+				return false;
+			}
+			int y0 = p * chunk_rows;
+			unsigned char * src = staging[p & 1];
+			ConvertRows(f, src, src + (size_t)chunk_rows * f.staging_pitch, y0, std::min(f.height, y0 + chunk_rows));
+		}
+	}
+	return true;
+}
+
+// Downloads and converts the mapped surface into the output planes and fills
+// in the host side fields of data. Called unlocked, only the copies take the
+// ctx lock.
+bool NvVideoDecoder::DownloadFrame(CUdeviceptr device_ptr, int pic_pitch, VideoRawData & data) {
+	FrameLayout f;
+	VideoRect roi;
+	GetDownloadRegion(data.width, data.height, data.pts, roi);
+	f.device_ptr = device_ptr;
+	f.pic_pitch = pic_pitch;
+	f.surface_height = data.height;
+	f.x = roi.x;
+	f.y = roi.y;
+	f.width = roi.width;
+	f.height = roi.height;
+	f.bit_depth_minus8 = m_vide_decoder_create_info.bitDepthMinus8;
+	f.luma_only = m_luma_only;
+	GetOutputLineSize(f.width, f.bit_depth_minus8, f.line_size);
+
+	int width = f.width;
+	int height = f.height;
+	const int * line_size = f.line_size;
+	int plane_size[3] = { line_size[0] * height, line_size[1] * (height / 2), line_size[2] * (height / 2) };
+	// staging holds the whole region, or one chunk per buffer when pipelined,
+	// with rows trimmed to the region width
+	f.row_bytes = width * (f.bit_depth_minus8 ? 2 : 1);
+	f.staging_pitch = f.row_bytes;
+	if (m_download_align > 1)
+		f.staging_pitch = (f.row_bytes + m_download_align - 1) / m_download_align * m_download_align;
+	int chunk_rows = 0;
+	if (m_download_chunks > 1 && m_copy_stream)
+		chunk_rows = ((height + m_download_chunks - 1) / m_download_chunks + 7) & ~7;
+	int staging_rows = chunk_rows ? chunk_rows : height;
+	int frame_size = f.staging_pitch * (staging_rows + (f.luma_only ? 0 : staging_rows / 2));
+	if(!m_gpu_buffer[0] || m_frame_size != frame_size || (chunk_rows != 0) != (m_gpu_staging != nullptr) ||
+			memcmp(m_plane_size, plane_size, sizeof(plane_size))){
+		for(int i=0;i<4;i++){
+			if(m_gpu_buffer[i])
+				cuMemFreeHost(m_gpu_buffer[i]);
+			m_gpu_buffer[i] = nullptr;
+		}
+		if(m_gpu_staging)
+			cuMemFreeHost(m_gpu_staging);
+		m_gpu_staging = nullptr;
+
+		m_frame_size = frame_size;
+		memcpy(m_plane_size, plane_size, sizeof(plane_size));
+		cuMemAllocHost((void **)&m_gpu_buffer[0], m_frame_size);
+		if(!m_gpu_buffer[0])
+			return false;
+		if(chunk_rows){
+			cuMemAllocHost((void **)&m_gpu_staging, m_frame_size);
+			if(!m_gpu_staging)
+				return false;
+		}
+		// packed rgb and luma only output only use the first plane
+		for(int i=1;i<4;i++){
+			if(plane_size[i - 1] == 0)
+				continue;
+			cuMemAllocHost((void **)&m_gpu_buffer[i], plane_size[i - 1]);
+			if(!m_gpu_buffer[i])
+				return false;
+		}
+	}
+
+	bool rgb = !f.luma_only && line_size[1] == 0;
+	f.tensor = nullptr;
+	if (rgb && m_tensor && m_tensor_size >= width * height * 3)
+		f.tensor = m_tensor;
+	if (chunk_rows) {
+		if (!DownloadPipelined(f, chunk_rows))
+			return false;
+	} else {
+		{
+			CCtxAutoLock lock(m_ctx_lock);
+			if (!CopyRows(f, m_gpu_buffer[0], height, 0, height, nullptr))
+				return false;
+		}
+		ConvertRows(f, m_gpu_buffer[0], m_gpu_buffer[0] + (size_t)height * f.staging_pitch, 0, height);
+	}
+	m_stats.last_download_bytes = f.row_bytes * (height + (f.luma_only ? 0 : height / 2));
+	m_stats.download_bytes += m_stats.last_download_bytes;
+	m_stats.downloaded_frames++;
+
+	int bit_depth_minus8 = f.bit_depth_minus8;
+	data.width = width;
+	data.height = height;
+	data.fmt = f.luma_only ? VideoBaseBandFmt::GRAY : VideoBaseBandFmt::YUV420P;
+	data.bit_depth = 8;
+	if (rgb) {
+		data.fmt = m_output_fmt;
+		data.tensor = f.tensor;
+	}
+	else if (bit_depth_minus8 && m_output_depth == VideoOutputDepth::PACKED10) {
+		data.fmt = f.luma_only ? VideoBaseBandFmt::GRAY10_PACKED : VideoBaseBandFmt::YUV420P10_PACKED;
+		data.bit_depth = 10;
+	}
+	else if (bit_depth_minus8 && m_output_depth == VideoOutputDepth::NATIVE) {
+		data.bit_depth = 8 + bit_depth_minus8;
+	}
+	data.buffer[0] = m_gpu_buffer[1];
+	data.buffer[1] = m_gpu_buffer[2];
+	data.buffer[2] = m_gpu_buffer[3];
+	data.line_size[0] = line_size[0];
+	data.line_size[1] = line_size[1];
+	data.line_size[2] = line_size[2];
+	return true;
+}
+
 int NvVideoDecoder::OutputVideoFrame() {
 	CUdeviceptr  device_ptr;
 	unsigned int pic_pitch = 0;
@@ -255,81 +876,82 @@ int NvVideoDecoder::OutputVideoFrame() {
 	if (!(m_frame_queue->isEndOfDecode() && m_frame_queue->isEmpty())) {
 		CUVIDPARSERDISPINFO pic_info;
 		if (m_frame_queue->dequeue(&pic_info)) {
-			CCtxAutoLock lock(m_ctx_lock);
+			// waits before the ctx lock, the consumer needs it to release
+			RetainedFrame * retained = m_retain_frames && m_frame_cb ? AcquireRetainedSlot() : nullptr;
 			video_processing_params.progressive_frame = pic_info.progressive_frame;
 			video_processing_params.top_field_first = pic_info.top_field_first;
 			video_processing_params.unpaired_field = (pic_info.repeat_first_field < 0);
 			video_processing_params.second_field = 0;
 
-			cuvidMapVideoFrame(m_video_decoder,pic_info.picture_index,&device_ptr,&pic_pitch, &video_processing_params);
-
-			int bit_depth_minus8 = m_vide_decoder_create_info.bitDepthMinus8;
 			int width = m_vide_decoder_create_info.ulTargetWidth;
 			int height = m_vide_decoder_create_info.ulTargetHeight;
 
 			VideoRawData data;
 			data.width = width;
 			data.height = height;
-			data.deviceptr = device_ptr;
-
-			if(m_frame_cb){
-				if(m_download_gpu_buffer){
-					int factor = bit_depth_minus8 ? 2 : 1;
-					int frame_size = pic_pitch * height * 3 / 2;
-					if(!m_gpu_buffer[0] || m_frame_size != frame_size){
-						for(int i=0;i<4;i++){
-							if(m_gpu_buffer[i])
-								cuMemFreeHost(m_gpu_buffer[i]);
-						}
-
-						m_frame_size = frame_size;
-						cuMemAllocHost((void **)&m_gpu_buffer[0], m_frame_size);
-						cuMemAllocHost((void **)&m_gpu_buffer[1], factor*(width * height));
-						cuMemAllocHost((void **)&m_gpu_buffer[2], factor*(width * height / 4));
-						cuMemAllocHost((void **)&m_gpu_buffer[3], factor*(width * height / 4));
-
-						for(int i=0;i<4;i++){
-							if(!m_gpu_buffer[i])
-								return -1;
-						}
-					}
-					cuMemcpyDtoH(m_gpu_buffer[0], device_ptr, frame_size);
-
-					if (bit_depth_minus8 == 0) {
-						TransferToYUV(m_gpu_buffer[0], m_gpu_buffer[1], m_gpu_buffer[2], m_gpu_buffer[3], width, height, pic_pitch, bit_depth_minus8);
+			data.pts = pic_info.timestamp;
+			bool device_frame = m_frame_cb && !m_download_gpu_buffer;
+			{
+				CCtxAutoLock lock(m_ctx_lock);
+				if (cuvidMapVideoFrame(m_video_decoder,pic_info.picture_index,&device_ptr,&pic_pitch, &video_processing_params) != CUDA_SUCCESS) {
+					if (retained) {
+						std::lock_guard<std::mutex> retain_lock(m_retain_mutex);
+						retained->used = false;
+						m_retained_count--;
 					}
-					else {
-						TransferToYUV((unsigned short *)m_gpu_buffer[0], (unsigned short *)m_gpu_buffer[1], (unsigned short *)m_gpu_buffer[2], (unsigned short *)m_gpu_buffer[3],
-								width, height, pic_pitch, bit_depth_minus8);
-					}
-					data.fmt = VideoBaseBandFmt::YUV420P;
-					data.buffer[0] = m_gpu_buffer[1];
-					data.buffer[1] = m_gpu_buffer[2];
-					data.buffer[2] = m_gpu_buffer[3];
-					data.line_size[0] = width * factor;
-					data.line_size[1] = width * factor / 2;
-					data.line_size[2] =  width * factor / 2;
-				}else{
-					data.line_size[0] = pic_pitch;
-					data.line_size[1] = pic_pitch / 2;
-					data.line_size[2] =  pic_pitch / 2;
-					data.fmt = VideoBaseBandFmt::NV12;
+					m_frame_queue->releaseFrame(&pic_info);
+					return -1;
 				}
+			}
+			data.deviceptr = device_ptr;
 
-				if(!m_ptsqueue.empty()){
-					data.pts = m_ptsqueue.front();
-					m_ptsqueue.pop();
-				}else
-					data.pts = 0;
-				m_frame_cb(data,m_user_data);
+			// current but unlocked: sessions sharing this context only
+			// serialize on the driver calls, not on conversion and callbacks
+			CUcontext ctx;
+			cuCtxPushCurrent(m_current_ctx);
+			if (!device_frame) {
+				bool downloaded = true;
+				if (m_frame_cb) {
+					downloaded = DownloadFrame(device_ptr, pic_pitch, data);
+					if (downloaded)
+						m_frame_cb(data,m_user_data);
+				}
+				cuCtxPopCurrent(&ctx);
+				{
+					CCtxAutoLock lock(m_ctx_lock);
+					cuvidUnmapVideoFrame(m_video_decoder, device_ptr);
+				}
+				m_frame_queue->releaseFrame(&pic_info);
+				return downloaded ? 0 : -1;
 			}
 
-			cuvidUnmapVideoFrame(m_video_decoder, device_ptr);
+			// the UV plane follows the surface's luma rows
+			data.line_size[0] = pic_pitch;
+			data.line_size[1] = pic_pitch;
+			data.line_size[2] = 0;
+			data.deviceptr_uv = device_ptr + (size_t)pic_pitch * height;
+			data.fmt = VideoBaseBandFmt::NV12;
+			if (retained) {
+				retained->decoder = this;
+				retained->device_ptr = device_ptr;
+				retained->info = pic_info;
+				data.release = ReleaseRetainedFrame;
+				data.release_ctx = retained;
+			}
+			// the callback may pass the surface to an encoder sharing this
+			// context, which takes the ctx lock itself
+			m_frame_cb(data,m_user_data);
+			cuCtxPopCurrent(&ctx);
+			if (retained)
+				return 0;
+
+			{
+				CCtxAutoLock lock(m_ctx_lock);
+				cuvidUnmapVideoFrame(m_video_decoder, device_ptr);
+			}
 			m_frame_queue->releaseFrame(&pic_info);
 		}
 
 	}
 	return 0;
 }
-
-
@@ -2,6 +2,10 @@
 #define NV_DECODER_H
 
 #include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "helper_functions.h"
 #include "helper_cuda_drvapi.h"
@@ -9,6 +13,7 @@
 #include "dynlink_cuda.h"
 #include "FrameQueue.h"
 #include "MediaDef.h"
+#include "VideoConvertPool.h"
 
 
 class NvVideoDecoder {
@@ -16,10 +21,63 @@ public:
 	NvVideoDecoder() = default;
     ~NvVideoDecoder();
     bool Start(VideoCodec codec,VideoFrameCB cb,void * user_data,bool download_gpu_buffer = true);
+    bool Start(VideoDecodeParam & param,VideoFrameCB cb,void * user_data);
 	int InputData(MediaDataBitStream & bs);
+	// count packets of one stream in order, their pts queued together
+	int InputBatch(MediaDataBitStream * packets, int count);
 	bool Stop();
+	// updated on the thread that outputs frames, with an output thread read
+	// it after Stop()
+	const VideoDecodeStats & GetStats() const { return m_stats; }
+	// GPU ordinal of the decoder's context, -1 before the first Start
+	int GetDevice() const { return m_device; }
 private:
 	int OutputVideoFrame();
+	bool AbortStart(bool acquired);
+	// gives the pooled context and the device selector session back
+	void ReleaseDevice();
+	bool StartOutputThread(int depth);
+	// lets the output thread drain the queued frames, then joins it
+	void StopOutputThread();
+	// blocks until the output thread has delivered every queued frame
+	void WaitOutputIdle();
+	void OutputLoop();
+	// retained frames: a mapped surface with its frame queue entry, released
+	// from whatever thread the consumer is done on
+	struct RetainedFrame {
+		NvVideoDecoder * decoder;
+		CUdeviceptr device_ptr;
+		CUVIDPARSERDISPINFO info;
+		bool used;
+	};
+	static void ReleaseRetainedFrame(void * frame);
+	RetainedFrame * AcquireRetainedSlot();
+	// blocks until the consumer released every retained frame
+	void WaitRetainedIdle();
+	void GetOutputLineSize(int width, int bit_depth_minus8, int line_size[3]);
+	// one frame's download: the copied region of the mapped surface and the
+	// staging / output layout it is converted with
+	struct FrameLayout {
+		CUdeviceptr device_ptr;
+		int pic_pitch;
+		int surface_height;
+		int x, y;				// region origin on the surface, even
+		int width, height;		// region size, also the output size
+		int bit_depth_minus8;
+		int row_bytes;			// bytes downloaded per row
+		int staging_pitch;
+		int line_size[3];		// output planes
+		bool luma_only;
+		float * tensor;
+	};
+	void GetDecodeGeometry(CUVIDEOFORMAT* format, CUVIDDECODECREATEINFO& geometry);
+	void GetSurfaceCounts(CUVIDEOFORMAT* format, CUVIDDECODECREATEINFO& geometry);
+	void GetDownloadRegion(int width, int height, int64_t pts, VideoRect & roi);
+	bool DownloadFrame(CUdeviceptr device_ptr, int pic_pitch, VideoRawData & data);
+	void ConvertBand(const FrameLayout & f, unsigned char * src_y, unsigned char * src_uv, int y0, int y1);
+	void ConvertRows(const FrameLayout & f, unsigned char * src_y, unsigned char * src_uv, int y0, int y1);
+	bool CopyRows(const FrameLayout & f, unsigned char * dst, int chroma_row, int y0, int y1, CUstream stream);
+	bool DownloadPipelined(const FrameLayout & f, int chunk_rows);
 private:
 	static int CUDAAPI HandleVideoSequence(void* user_data, CUVIDEOFORMAT* format);
 	static int CUDAAPI HandlePictureDisplay(void* user_data, CUVIDPARSERDISPINFO* pic_params);
@@ -33,10 +91,52 @@ private:
 	FrameQueue*    m_frame_queue = nullptr;
 	std::queue<int64_t> m_ptsqueue;
 	unsigned char  *m_gpu_buffer[4] = {nullptr};
+	unsigned char  *m_gpu_staging = nullptr;
 	int m_frame_size = 0;
+	int m_plane_size[3] = {0};
 	VideoFrameCB m_frame_cb = nullptr;
 	void * m_user_data = nullptr;
 	bool m_download_gpu_buffer = true;
+	VideoOutputDepth m_output_depth = VideoOutputDepth::NATIVE;
+	VideoBaseBandFmt m_output_fmt = VideoBaseBandFmt::YUV420P;
+	VideoColorMatrix m_color_matrix = VideoColorMatrix::BT601;
+	VideoColorRange m_color_range = VideoColorRange::LIMITED;
+	float * m_tensor = nullptr;
+	int m_tensor_size = 0;
+	float m_tensor_scale[3] = {0};
+	float m_tensor_bias[3] = {0};
+	VideoConvertPool m_convert_pool;
+	int m_download_chunks = 0;
+	int m_download_align = 0;
+	bool m_luma_only = false;
+	VideoRect m_crop;
+	VideoRoiCB m_roi_cb = nullptr;
+	int m_target_width = 0;
+	int m_target_height = 0;
+	VideoRect m_decode_crop;
+	VideoDecodeProfile m_profile = VideoDecodeProfile::BALANCED;
+	int m_decode_surfaces = 0;
+	int m_output_surfaces = 0;
+	VideoDecodeStats m_stats;
+	CUstream m_copy_stream = nullptr;
+	CUevent m_copy_event[2] = {nullptr};
+	// asynchronous output, m_output_pending counts frames enqueued but not
+	// yet delivered and is guarded by m_output_mutex
+	std::thread m_output_thread;
+	std::mutex m_output_mutex;
+	std::condition_variable m_output_cond;
+	int m_output_queue_depth = 0;
+	int m_output_pending = 0;
+	bool m_output_exit = false;
+	int m_device = -1;
+	int m_device_group = 0;
+	double m_pixel_rate = 0;	// reported to DeviceSelector
+	// sized with the output surfaces, guarded by m_retain_mutex
+	bool m_retain_frames = false;
+	std::mutex m_retain_mutex;
+	std::condition_variable m_retain_cond;
+	std::vector<RetainedFrame> m_retained_frames;
+	int m_retained_count = 0;
 };
 
 #endif
@@ -5,10 +5,25 @@
  *      Author: jason
  */
 
+#include <system_error>
+#include <algorithm>
 #include "NvVideoEncoder.h"
+#include "CudaContextPool.h"
+#include "DeviceSelector.h"
+#include "VideoConvert.h"
 
 #define BITSTREAM_BUFFER_SIZE 2 * 1024 * 1024
 
+// ring depth controller: a window is evaluated every kWindowFrames
+// submissions. A producer wait of at least kFullWait counts as a full ring.
+static const uint32_t kDefaultEncodeBuffers = 10;
+static const int kWindowFrames = 32;
+static const double kFullWaitMs = 0.1;
+static const double kGrowStallRatio = 0.05;		// grow by 2 above this
+static const double kIdleStallRatio = 0.005;	// shrink by 1 after kIdleWindows below this
+static const int kIdleWindows = 4;
+static const int kHoldWindows = 16;				// no idle shrinking for this long after a grow
+
 NvVideoEncoder::NvVideoEncoder() {
 	// TODO Auto-generated constructor stub
 	for(int i=0;i<MAX_ENCODE_QUEUE;i++){
@@ -57,10 +72,22 @@ bool NvVideoEncoder::Start(VideoParam & param,VideoBitstreamCB cb,void * user_da
 	m_encode_config.vbvMaxBitrate = param.bit_rate;
 	m_encode_config.refnum = 2;
 
+	m_pixel_rate = 0;
+	if(param.frame_rate_den > 0)
+		m_pixel_rate = (double)param.width * param.height * param.frame_rate_num / param.frame_rate_den;
+	m_device_group = param.device_group;
+	if(cuInit(0, __CUDA_API_VERSION, nullptr) != CUDA_SUCCESS)
+		return false;
+	int device = DeviceSelector::Acquire(m_pixel_rate, param.device_id, m_device_group);
+	if(device < 0)
+		return false;
+	m_encode_config.deviceID = device;
 	nv_status = InitCuda(m_encode_config.deviceID);
 
-	if (nv_status != NV_ENC_SUCCESS)
+	if (nv_status != NV_ENC_SUCCESS){
+		DeviceSelector::Release(device, m_pixel_rate, m_device_group);
 		return false;
+	}
 
 	if(!m_nvencoder_api)
 		m_nvencoder_api = new NVEncoderAPI();
@@ -68,20 +95,33 @@ bool NvVideoEncoder::Start(VideoParam & param,VideoBitstreamCB cb,void * user_da
 	nv_status = m_nvencoder_api->Initialize(m_cuda_device, NV_ENC_DEVICE_TYPE_CUDA);
 
 	if (nv_status != NV_ENC_SUCCESS)
-		return false;
+		return AbortStart();
 
 	m_encode_config.presetGUID = m_nvencoder_api->GetPresetGUID(m_encode_config.encoderPreset, m_encode_config.codec);
 
 	nv_status = m_nvencoder_api->CreateEncoder(&m_encode_config);
 	if (nv_status != NV_ENC_SUCCESS)
-		return false;
-
-	m_encoder_buffer_count = 10;
+		return AbortStart();
+
+	m_encoder_buffer_count = kDefaultEncodeBuffers;
+	m_min_buffers = m_max_buffers = m_encoder_buffer_count;
+	if(param.max_encode_buffers > 0){
+		m_max_buffers = std::min(param.max_encode_buffers, MAX_ENCODE_QUEUE);
+		m_min_buffers = std::max(1, std::min(param.min_encode_buffers, (int)m_max_buffers));
+		m_encoder_buffer_count = std::max(m_min_buffers, std::min(m_encoder_buffer_count, m_max_buffers));
+	}
+	m_latency_target_ms = param.latency_target_ms;
+	m_stats = VideoEncodeStats();
+	m_stats.buffer_count = m_encoder_buffer_count;
+	m_window_start = std::chrono::steady_clock::now();
+	m_window_frames = m_window_outputs = 0;
+	m_window_latency_ms = m_window_stall_ms = 0;
+	m_idle_windows = 0;
 
 	nv_status = AllocateIOBuffers(m_encode_config.width, m_encode_config.height, m_encode_config.inputFormat);
 
 	if (nv_status != NV_ENC_SUCCESS)
-		return false;
+		return AbortStart();
 
 	while(!m_ptsqueue.empty()){
 		m_ptsqueue.pop();
@@ -90,16 +130,128 @@ bool NvVideoEncoder::Start(VideoParam & param,VideoBitstreamCB cb,void * user_da
 	m_inited = true;
 	m_cb = cb;
 	m_user_data = user_data;
+	m_color_matrix = param.color_matrix;
+	m_color_range = param.color_range;
+
+	if(param.async_output && !StartOutputThread())
+		return AbortStart();
+
+	if(param.shared_input){
+		m_input_queue.Open(param.input_reorder_depth, param.input_reorder_wait_ms);
+		try {
+			m_input_thread = std::thread(&NvVideoEncoder::InputLoop, this);
+		} catch (const std::system_error &) {
+			m_input_queue.Close();
+			return AbortStart();
+		}
+	}
 
 	return true;
 }
+
+// Undoes a Start that failed once the device was acquired: the encoder, its
+// buffers, the pooled context and the device selector session are released,
+// so a retried Start begins from scratch.
+bool NvVideoEncoder::AbortStart(){
+	StopOutputThread();
+	if(m_nvencoder_api){
+		Deinitialize();
+		delete m_nvencoder_api;
+		m_nvencoder_api = nullptr;
+	}
+	m_inited = false;
+	return false;
+}
 bool NvVideoEncoder::InputData(VideoRawData & data){
 	if(!m_inited)
 		return false;
+	if(m_input_thread.joinable())
+		return m_input_queue.Submit(data);
+	return SubmitFrame(data);
+}
 
-	EncodeFrameConfig frame = {0};
+// With synchronous output, device frames are copied in groups under one
+// context lock per group. Buffers are freed and outputs delivered outside
+// the lock, it is held for the copies only.
+bool NvVideoEncoder::InputBatch(VideoRawData * frames, int count){
+	if(!m_inited || !frames || count < 0)
+		return false;
+	bool ok = true;
+	if(m_input_thread.joinable()){
+		for(int i = 0; i < count; i++)
+			ok = m_input_queue.Submit(frames[i]) && ok;
+		return ok;
+	}
+	// the output thread hands out buffers one at a time, see AcquireBuffer
+	if(m_output_thread.joinable()){
+		for(int i = 0; i < count; i++)
+			ok = SubmitFrame(frames[i]) && ok;
+		return ok;
+	}
+
+	EncodeFrameConfig group[MAX_ENCODE_QUEUE];
+	EncodeBuffer * buffers[MAX_ENCODE_QUEUE];
+	NVENCSTATUS status[MAX_ENCODE_QUEUE];
+	for(int i = 0; i < count;){
+		// a group ends at a host frame or when the ring is full, only its
+		// first frame waits for an output
+		int n = 0;
+		for(; n < MAX_ENCODE_QUEUE && i + n < count && frames[i + n].deviceptr; n++){
+			buffers[n] = n == 0 ? GetSyncBuffer() : m_encoder_buffer_queue.GetAvailable();
+			if(!buffers[n])
+				break;
+			GetFrameConfig(frames[i + n], group[n]);
+			m_ptsqueue.push(frames[i + n].pts);
+		}
+		if(n == 0){
+			ok = SubmitFrame(frames[i++]) && ok;
+			continue;
+		}
+
+		{
+			CCtxAutoLock lock(m_ctx_lock);
+			m_batch_locked = true;
+			for(int k = 0; k < n; k++){
+				buffers[k]->stInputBfr.bDeviceSurface = true;
+				status[k] = MapDeviceFrame(&group[k], buffers[k]);
+			}
+			m_batch_locked = false;
+		}
+		for(size_t k = 0; k < m_deferred_releases.size(); k++)
+			m_deferred_releases[k].release(m_deferred_releases[k].release_ctx);
+		m_deferred_releases.clear();
+
+		for(int k = 0; k < n; k++){
+			if(status[k] == NV_ENC_SUCCESS)
+				status[k] = m_nvencoder_api->NvEncEncodeFrame(buffers[k], nullptr, group[k].width,
+						group[k].height, (NV_ENC_PIC_STRUCT)m_encode_config.pictureStruct);
+			m_submit_time[buffers[k] - m_encoder_buffer] = std::chrono::steady_clock::now();
+			ok = status[k] == NV_ENC_SUCCESS && ok;
+		}
+		// a resize retrieves every buffer, so only once the group is submitted
+		for(int k = 0; k < n; k++)
+			ControlDepth();
+		i += n;
+	}
+	return ok;
+}
+
+void NvVideoEncoder::InputLoop(){
+	EncodeInputQueue::Node * node;
+	while((node = m_input_queue.Next()) != nullptr)
+		m_input_queue.Complete(node, SubmitFrame(*node->data));
+}
+
+void NvVideoEncoder::GetFrameConfig(VideoRawData & data, EncodeFrameConfig & frame){
+	memset(&frame, 0, sizeof(frame));
 	if(data.deviceptr){
 		frame.dptr = (CUdeviceptr)data.deviceptr;
+		frame.dptrUV = (CUdeviceptr)data.deviceptr_uv;
+		frame.release = data.release;
+		frame.releaseCtx = data.release_ctx;
+	}else if(data.fmt == VideoBaseBandFmt::BGR || data.fmt == VideoBaseBandFmt::BGRA){
+		frame.bgr = data.buffer[0];
+		frame.bgrBytesPerPixel = data.fmt == VideoBaseBandFmt::BGRA ? 4 : 3;
 	}else{
 		frame.yuv[0] = data.buffer[0];
 		frame.yuv[1] = data.buffer[1];
@@ -108,14 +260,33 @@ bool NvVideoEncoder::InputData(VideoRawData & data){
 	frame.stride[0] = data.line_size[0];
 	frame.stride[1] = data.line_size[1];
 	frame.stride[2] = data.line_size[2];
+	if(frame.bgr && frame.stride[0] == 0)
+		frame.stride[0] = data.width * frame.bgrBytesPerPixel;
 	frame.width = data.width;
 	frame.height = data.height;
-	m_ptsqueue.push(data.pts);
-	EncodeFrame(&frame);
+}
 
-	return true;
+bool NvVideoEncoder::SubmitFrame(VideoRawData & data){
+	EncodeFrameConfig frame;
+	GetFrameConfig(data, frame);
+	NVENCSTATUS nv_status = EncodeFrame(&frame, data.pts);
+	// host frames are copied by now, device frames are released by the encoder
+	if(!data.deviceptr && data.release)
+		data.release(data.release_ctx);
+
+	return nv_status == NV_ENC_SUCCESS;
+}
+VideoEncodeStats NvVideoEncoder::GetStats(){
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_stats.late_input_frames = m_input_queue.GetLateCount();
+	return m_stats;
 }
+
 bool NvVideoEncoder::Stop(){
+	if(m_input_thread.joinable()){
+		m_input_queue.Close();
+		m_input_thread.join();
+	}
 	if(!m_nvencoder_api)
 		return NV_ENC_SUCCESS;
 	FlushEncoder();
@@ -134,101 +305,313 @@ NVENCSTATUS NvVideoEncoder::Deinitialize() {
     nv_status = m_nvencoder_api->NvEncDestroyEncoder();
 
     if (m_cuda_device) {
-		CUresult cu_result = CUDA_SUCCESS;
-		cu_result = cuCtxDestroy((CUcontext)m_cuda_device);
-		if (cu_result != CUDA_SUCCESS)
-			PRINTERR("cuCtxDestroy error:0x%x\n", cu_result);
+        CudaContextPool::Release((CUcontext)m_cuda_device);
+        DeviceSelector::Release(m_encode_config.deviceID, m_pixel_rate, m_device_group);
         m_cuda_device = nullptr;
-    }
-    if(m_ctx_lock){
-		cuvidCtxLockDestroy(m_ctx_lock);
-		m_ctx_lock = nullptr;
+        m_ctx_lock = nullptr;
     }
     return nv_status;
 }
 
-void NvVideoEncoder::OutputFrame(NV_ENC_LOCK_BITSTREAM lockBitstreamData){
+void NvVideoEncoder::OutputFrame(NV_ENC_LOCK_BITSTREAM lockBitstreamData, int64_t pts){
 
 	MediaDataBitStream bs;
 	bs.buffer = (unsigned char*)lockBitstreamData.bitstreamBufferPtr;
 	bs.buffer_len = lockBitstreamData.bitstreamSizeInBytes;
 	bs.is_key = lockBitstreamData.pictureType == NV_ENC_PIC_TYPE_IDR ? true : false;
-	if(!m_ptsqueue.empty()){
-		bs.pts = m_ptsqueue.front();
-		bs.dts = m_ptsqueue.front();
-		m_ptsqueue.pop();
-	}else{
-		bs.pts = 0;
-		bs.dts = 0;
-	}
+	bs.pts = pts;
+	bs.dts = pts;
 	if(m_cb){
 		m_cb(bs,m_user_data);
 	}
 }
 
-static void YUV420ToNV12( unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
-        unsigned char *nv12_luma, unsigned char *nv12_chroma,
-        int width, int height , int src_stride, int dst_stride) {
-	if (src_stride == 0)
-		src_stride = width;
-	if (dst_stride == 0)
-		dst_stride = width;
+int64_t NvVideoEncoder::PopPts(){
+	if(m_ptsqueue.empty())
+		return 0;
+	int64_t pts = m_ptsqueue.front();
+	m_ptsqueue.pop();
+	return pts;
+}
+
+bool NvVideoEncoder::StartOutputThread(){
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_output_exit = false;
+	m_buffers_in_flight = 0;
+	try {
+		m_output_thread = std::thread(&NvVideoEncoder::OutputLoop, this);
+	} catch (const std::system_error &) {
+		return false;
+	}
+	return true;
+}
+
+void NvVideoEncoder::StopOutputThread(){
+	if(!m_output_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_output_mutex);
+		m_output_exit = true;
+	}
+	m_output_cond.notify_all();
+	m_output_thread.join();
+}
+
+// Waits for each submitted buffer in order. Without completion events (they
+// are Windows only) the blocking nvEncLockBitstream is the wait, and the
+// bitstream is delivered before it is unlocked.
+void NvVideoEncoder::OutputLoop(){
+	std::unique_lock<std::mutex> lock(m_output_mutex);
+	for(;;){
+		while(m_output_queue.empty() && !m_output_exit)
+			m_output_cond.wait(lock);
+		if(m_output_queue.empty())
+			break;
+		PendingOutput output = m_output_queue.front();
+		m_output_queue.pop();
+		m_encoder_buffer_queue.GetPending();
+		lock.unlock();
+
+		if(output.encoded){
+			NV_ENC_LOCK_BITSTREAM bit_stream;
+			memset(&bit_stream, 0, sizeof(bit_stream));
+			SET_VER(bit_stream, NV_ENC_LOCK_BITSTREAM);
+			bit_stream.outputBitstream = output.buffer->stOutputBfr.hBitstreamBuffer;
+			bit_stream.doNotWait = false;
+			if(m_nvencoder_api->NvEncLockBitstream(&bit_stream) == NV_ENC_SUCCESS){
+				OutputFrame(bit_stream, output.pts);
+				m_nvencoder_api->NvEncUnlockBitstream(output.buffer->stOutputBfr.hBitstreamBuffer);
+			}else
+				PRINTERR("lock bitstream function failed \n");
+		}
+		UnmapInput(output.buffer);
+		RecordOutput(output.buffer);
+
+		lock.lock();
+		m_buffers_in_flight--;
+		m_output_cond.notify_all();
+	}
+}
+
+EncodeBuffer * NvVideoEncoder::AcquireBuffer(){
+	std::unique_lock<std::mutex> lock(m_output_mutex);
+	if(m_buffers_in_flight == m_encoder_buffer_count){
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		while(m_buffers_in_flight == m_encoder_buffer_count)
+			m_output_cond.wait(lock);
+		lock.unlock();
+		RecordStall(std::chrono::steady_clock::now() - start);
+		lock.lock();
+	}
+	m_buffers_in_flight++;
+	return m_encoder_buffer_queue.GetAvailable();
+}
 
-	for (int y = 0 ; y < height ; y++) {
-		memcpy( nv12_luma + (dst_stride*y), yuv_luma + (src_stride*y) , width );
+void NvVideoEncoder::RecordOutput(EncodeBuffer * encode_buffer){
+	std::chrono::duration<double, std::milli> latency =
+			std::chrono::steady_clock::now() - m_submit_time[encode_buffer - m_encoder_buffer];
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_window_outputs++;
+	m_window_latency_ms += latency.count();
+}
+
+void NvVideoEncoder::RecordStall(std::chrono::steady_clock::duration wait){
+	double wait_ms = std::chrono::duration<double, std::milli>(wait).count();
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_window_stall_ms += wait_ms;
+	if(wait_ms >= kFullWaitMs)
+		m_stats.ring_full_count++;
+}
+
+// Latency above the target shrinks the ring first, waiting for buffers grows
+// it, and a ring that is never waited for gives back a buffer now and then.
+void NvVideoEncoder::ControlDepth(){
+	uint32_t count = m_encoder_buffer_count;
+	uint32_t new_count = count;
+	{
+		std::lock_guard<std::mutex> lock(m_output_mutex);
+		m_stats.encoded_frames++;
+		if(++m_window_frames < kWindowFrames)
+			return;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double wall_ms = std::chrono::duration<double, std::milli>(now - m_window_start).count();
+		double latency = m_window_outputs ? m_window_latency_ms / m_window_outputs : 0;
+		double stall = wall_ms > 0 ? m_window_stall_ms / wall_ms : 0;
+		m_stats.window_latency_ms = latency;
+		m_stats.window_stall_ratio = stall;
+		m_window_start = now;
+		m_window_frames = m_window_outputs = 0;
+		m_window_latency_ms = m_window_stall_ms = 0;
+		if(m_min_buffers == m_max_buffers)
+			return;
+
+		if(m_latency_target_ms > 0 && latency > m_latency_target_ms && count > m_min_buffers){
+			new_count = count - 1;
+			m_idle_windows = 0;
+		}else if(stall > kGrowStallRatio && count < m_max_buffers &&
+				(m_latency_target_ms <= 0 || latency < m_latency_target_ms * 0.8)){
+			new_count = std::min(count + 2, m_max_buffers);
+			m_idle_windows = -kHoldWindows;
+		}else if(stall < kIdleStallRatio && count > m_min_buffers){
+			if(++m_idle_windows >= kIdleWindows){
+				new_count = count - 1;
+				m_idle_windows = 0;
+			}
+		}else if(m_idle_windows > 0)
+			m_idle_windows = 0;
 	}
+	if(new_count == count || ResizeBuffers(new_count) != NV_ENC_SUCCESS)
+		return;
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	if(new_count > count)
+		m_stats.grow_count++;
+	else
+		m_stats.shrink_count++;
+	m_stats.buffer_count = new_count;
+}
 
-	for (int y = 0 ; y < height/2 ; y++) {
-		for (int x= 0 ; x < width; x=x+2) {
-			nv12_chroma[(y*dst_stride) + x] = yuv_cb[((src_stride/2)*y) + (x >>1)];
-			nv12_chroma[(y*dst_stride) +(x+1)] = yuv_cr[((src_stride/2)*y) + (x >>1)];
+// The ring order changes with its size, so every submitted buffer is
+// retrieved before buffers are added or released.
+NVENCSTATUS NvVideoEncoder::ResizeBuffers(uint32_t count){
+	if(m_output_thread.joinable()){
+		std::unique_lock<std::mutex> lock(m_output_mutex);
+		while(m_buffers_in_flight > 0)
+			m_output_cond.wait(lock);
+	}else
+		DrainOutput();
+
+	uint32_t old_count = m_encoder_buffer_count;
+	for(uint32_t i = old_count; i < count; i++){
+		NVENCSTATUS nv_status = AllocateIOBuffer(i, m_encode_config.width, m_encode_config.height, m_encode_config.inputFormat);
+		if(nv_status != NV_ENC_SUCCESS){
+			for(uint32_t j = old_count; j <= i; j++)
+				ReleaseIOBuffer(j);
+			return nv_status;
 		}
 	}
+	for(uint32_t i = count; i < old_count; i++)
+		ReleaseIOBuffer(i);
+
+	std::lock_guard<std::mutex> lock(m_output_mutex);
+	m_encoder_buffer_count = count;
+	m_encoder_buffer_queue.Initialize(m_encoder_buffer, count);
+	return NV_ENC_SUCCESS;
+}
+
+void NvVideoEncoder::DrainOutput(){
+	EncodeBuffer * encode_buffer = nullptr;
+	while((encode_buffer = m_encoder_buffer_queue.GetPending()) != nullptr){
+		NV_ENC_LOCK_BITSTREAM bit_stream;
+		m_nvencoder_api->ProcessOutput(encode_buffer,bit_stream);
+		OutputFrame(bit_stream, PopPts());
+		UnmapInput(encode_buffer);
+		RecordOutput(encode_buffer);
+	}
+}
+
+void NvVideoEncoder::UnmapInput(EncodeBuffer * encode_buffer){
+	if (encode_buffer->stInputBfr.hDeviceInputSurface) {
+		m_nvencoder_api->NvEncUnmapInputResource(encode_buffer->stInputBfr.hDeviceInputSurface);
+		encode_buffer->stInputBfr.hDeviceInputSurface = nullptr;
+	}
+	RetainedInput & input = m_retained_input[encode_buffer - m_encoder_buffer];
+	if (!input.release)
+		return;
+	m_nvencoder_api->NvEncUnregisterResource(input.registered);
+	ReleaseInput(input);
+	input.release = nullptr;
+	input.registered = nullptr;
+}
+
+// A batch holds the ctx lock, which the release may take; it releases the
+// frames once it has dropped the lock.
+void NvVideoEncoder::ReleaseInput(const RetainedInput & input){
+	if (m_batch_locked)
+		m_deferred_releases.push_back(input);
+	else
+		input.release(input.release_ctx);
+}
+
+static void YUV420ToNV12( unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
+        unsigned char *nv12_luma, unsigned char *nv12_chroma,
+        int width, int height , const uint32_t src_stride[3], int dst_stride) {
+	int stride_y = src_stride[0] ? src_stride[0] : width;
+	int stride_cb = src_stride[1] ? src_stride[1] : stride_y / 2;
+	int stride_cr = src_stride[2] ? src_stride[2] : stride_y / 2;
+	if (dst_stride == 0)
+		dst_stride = width;
+
+	ConvertI420ToNV12(yuv_luma, yuv_cb, yuv_cr, stride_y, stride_cb, stride_cr,
+			nv12_luma, nv12_chroma, dst_stride, width, height);
 }
 
-NVENCSTATUS NvVideoEncoder::EncodeFrame(EncodeFrameConfig * frame) {
+NVENCSTATUS NvVideoEncoder::EncodeFrame(EncodeFrameConfig * frame, int64_t pts) {
     NVENCSTATUS nv_status = NV_ENC_SUCCESS;
-    uint32_t locked_pitch = 0;
     EncodeBuffer * encode_buffer = nullptr;
 
     if (!frame) {
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
-    encode_buffer = m_encoder_buffer_queue.GetAvailable();
-	if(!encode_buffer) {
-		NV_ENC_LOCK_BITSTREAM bit_stream;
-		encode_buffer = m_encoder_buffer_queue.GetPending();
-		if(!encode_buffer)
-			return NV_ENC_ERR_OUT_OF_MEMORY;
-		m_nvencoder_api->ProcessOutput(encode_buffer,bit_stream);
-		OutputFrame(bit_stream);
-		if (encode_buffer->stInputBfr.hDeviceInputSurface) {
-			nv_status = m_nvencoder_api->NvEncUnmapInputResource(encode_buffer->stInputBfr.hDeviceInputSurface);
-			encode_buffer->stInputBfr.hDeviceInputSurface = nullptr;
-		}
-		encode_buffer = m_encoder_buffer_queue.GetAvailable();
+    if (m_output_thread.joinable()) {
+        encode_buffer = AcquireBuffer();
+        nv_status = EncodeToBuffer(frame, encode_buffer);
+        m_submit_time[encode_buffer - m_encoder_buffer] = std::chrono::steady_clock::now();
+        PendingOutput output = {encode_buffer, pts, nv_status == NV_ENC_SUCCESS};
+        {
+            std::lock_guard<std::mutex> lock(m_output_mutex);
+            m_output_queue.push(output);
+        }
+        m_output_cond.notify_all();
+        ControlDepth();
+        return nv_status;
+    }
+
+    m_ptsqueue.push(pts);
+    encode_buffer = GetSyncBuffer();
+	if(!encode_buffer){
+		if(frame->release)
+			frame->release(frame->releaseCtx);
+		return NV_ENC_ERR_OUT_OF_MEMORY;
 	}
+    nv_status = EncodeToBuffer(frame, encode_buffer);
+    m_submit_time[encode_buffer - m_encoder_buffer] = std::chrono::steady_clock::now();
+    ControlDepth();
+    return nv_status;
+}
+
+// Without the output thread a full ring is made room in here: its oldest
+// buffer is retrieved and delivered.
+EncodeBuffer * NvVideoEncoder::GetSyncBuffer(){
+	EncodeBuffer * encode_buffer = m_encoder_buffer_queue.GetAvailable();
+	if(encode_buffer)
+		return encode_buffer;
+	encode_buffer = m_encoder_buffer_queue.GetPending();
+	if(!encode_buffer)
+		return nullptr;
+	NV_ENC_LOCK_BITSTREAM bit_stream;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m_nvencoder_api->ProcessOutput(encode_buffer,bit_stream);
+	RecordStall(std::chrono::steady_clock::now() - start);
+	OutputFrame(bit_stream, PopPts());
+	UnmapInput(encode_buffer);
+	RecordOutput(encode_buffer);
+	return m_encoder_buffer_queue.GetAvailable();
+}
+
+NVENCSTATUS NvVideoEncoder::EncodeToBuffer(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer) {
+    NVENCSTATUS nv_status = NV_ENC_SUCCESS;
+    uint32_t locked_pitch = 0;
+
     if(frame->dptr > 0){
     	encode_buffer->stInputBfr.bDeviceSurface = true;
-    	CCtxAutoLock lock(m_ctx_lock);
-    	CUDA_MEMCPY2D memcpy2D  = {0};
-		memcpy2D.srcMemoryType  = CU_MEMORYTYPE_DEVICE;
-		memcpy2D.srcDevice      = frame->dptr;
-		memcpy2D.srcPitch       = frame->stride[0];
-		memcpy2D.dstMemoryType  = CU_MEMORYTYPE_DEVICE;
-		memcpy2D.dstDevice      = (CUdeviceptr)encode_buffer->stInputBfr.pNV12devPtr;
-		memcpy2D.dstPitch       = encode_buffer->stInputBfr.uNV12Stride;
-		memcpy2D.WidthInBytes   = frame->width;
-		memcpy2D.Height         = frame->height*3/2;
-		CUresult cu_result = cuMemcpy2D(&memcpy2D);
-		if(cu_result != CUDA_SUCCESS)
-			return NV_ENC_ERR_GENERIC;
-		nv_status = m_nvencoder_api->NvEncMapInputResource(encode_buffer->stInputBfr.nvRegisteredResource, &encode_buffer->stInputBfr.hDeviceInputSurface);
-		if (nv_status != NV_ENC_SUCCESS) {
-			PRINTERR("Failed to Map input buffer %p\n", encode_buffer->stInputBfr.hDeviceInputSurface);
-			return nv_status;
-		}
+    	{
+    		CCtxAutoLock lock(m_ctx_lock);
+    		nv_status = MapDeviceFrame(frame, encode_buffer);
+    	}
+    	if (nv_status != NV_ENC_SUCCESS)
+    		return nv_status;
     }else{
 		encode_buffer->stInputBfr.bDeviceSurface = false;
 		unsigned char * input_surface;
@@ -236,8 +619,13 @@ NVENCSTATUS NvVideoEncoder::EncodeFrame(EncodeFrameConfig * frame) {
 		if (nv_status != NV_ENC_SUCCESS)
 			return nv_status;
 		unsigned char * input_surface_ch = input_surface + (encode_buffer->stInputBfr.dwHeight*locked_pitch);
-		YUV420ToNV12(frame->yuv[0], frame->yuv[1], frame->yuv[2], input_surface, input_surface_ch,
-				frame->width, frame->height, frame->stride[0], locked_pitch);
+		if (frame->bgr) {
+			ConvertBGRToNV12(frame->bgr, frame->stride[0], frame->bgrBytesPerPixel, input_surface, input_surface_ch,
+					locked_pitch, frame->width, frame->height, m_color_matrix, m_color_range);
+		} else {
+			YUV420ToNV12(frame->yuv[0], frame->yuv[1], frame->yuv[2], input_surface, input_surface_ch,
+					frame->width, frame->height, frame->stride, locked_pitch);
+		}
 		nv_status = m_nvencoder_api->NvEncUnlockInputBuffer(encode_buffer->stInputBfr.hHostInputSurface);
 		if (nv_status != NV_ENC_SUCCESS)
 			return nv_status;
@@ -247,10 +635,94 @@ NVENCSTATUS NvVideoEncoder::EncodeFrame(EncodeFrameConfig * frame) {
     		frame->height, (NV_ENC_PIC_STRUCT)m_encode_config.pictureStruct);
     return nv_status;
 }
+// Needs the context lock. A retained frame that fits the encoder is mapped
+// in place when the output thread retrieves it, any other frame is copied
+// into the buffer's own surface (and a retained one released after the copy).
+// Without the output thread a frame would stay held until the ring fills,
+// while the decoder handing it out on the same thread waits for it.
+NVENCSTATUS NvVideoEncoder::MapDeviceFrame(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer) {
+    NVENCSTATUS nv_status;
+    if (frame->release && m_output_thread.joinable()) {
+        void * registered = RegisterFrame(frame);
+        if (registered) {
+            nv_status = m_nvencoder_api->NvEncMapInputResource(registered, &encode_buffer->stInputBfr.hDeviceInputSurface);
+            if (nv_status == NV_ENC_SUCCESS) {
+                RetainedInput & input = m_retained_input[encode_buffer - m_encoder_buffer];
+                input.release = frame->release;
+                input.release_ctx = frame->releaseCtx;
+                input.registered = registered;
+                return NV_ENC_SUCCESS;
+            }
+            m_nvencoder_api->NvEncUnregisterResource(registered);
+            PRINTERR("Failed to map frame %p, copying it\n", (void*)frame->dptr);
+        }
+    }
+    nv_status = CopyDeviceFrame(frame, encode_buffer);
+    if (frame->release) {
+        RetainedInput input = {frame->release, frame->releaseCtx, nullptr};
+        ReleaseInput(input);
+    }
+    return nv_status;
+}
+
+// NVENC reads NV12 with the UV plane right after pitch * height luma bytes.
+// A registration lasts as long as the frame is retained: once the decoder
+// gets the surface back its address may be mapped to another surface, so
+// nothing registered under it earlier can be trusted.
+void * NvVideoEncoder::RegisterFrame(EncodeFrameConfig * frame) {
+    uint32_t width = m_encode_config.width;
+    uint32_t height = m_encode_config.height;
+    uint32_t pitch = frame->stride[0];
+    if (frame->width != width || frame->height != height || m_encode_config.inputFormat != NV_ENC_BUFFER_FORMAT_NV12)
+        return nullptr;
+    if (frame->dptrUV && (frame->dptrUV != frame->dptr + (CUdeviceptr)pitch * height || frame->stride[1] != pitch))
+        return nullptr;
+
+    void * registered = nullptr;
+    if (m_nvencoder_api->NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, (void*)frame->dptr,
+            width, height, pitch, &registered) != NV_ENC_SUCCESS)
+        return nullptr;
+    return registered;
+}
+
+// Needs the context lock. Luma and chroma are copied separately, each with
+// its own pitch, clipped to the buffer.
+NVENCSTATUS NvVideoEncoder::CopyDeviceFrame(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer) {
+    uint32_t width = std::min(frame->width, encode_buffer->stInputBfr.dwWidth);
+    uint32_t height = std::min(frame->height, encode_buffer->stInputBfr.dwHeight);
+    uint32_t dst_pitch = encode_buffer->stInputBfr.uNV12Stride;
+    CUdeviceptr dst = encode_buffer->stInputBfr.pNV12devPtr;
+
+    CUDA_MEMCPY2D memcpy2D  = {0};
+    memcpy2D.srcMemoryType  = CU_MEMORYTYPE_DEVICE;
+    memcpy2D.srcDevice      = frame->dptr;
+    memcpy2D.srcPitch       = frame->stride[0];
+    memcpy2D.dstMemoryType  = CU_MEMORYTYPE_DEVICE;
+    memcpy2D.dstDevice      = dst;
+    memcpy2D.dstPitch       = dst_pitch;
+    memcpy2D.WidthInBytes   = width;
+    memcpy2D.Height         = height;
+    CUresult cu_result = cuMemcpy2D(&memcpy2D);
+    if(cu_result != CUDA_SUCCESS)
+        return NV_ENC_ERR_GENERIC;
+
+    memcpy2D.srcDevice      = frame->dptrUV ? frame->dptrUV : frame->dptr + (CUdeviceptr)frame->stride[0] * frame->height;
+    memcpy2D.srcPitch       = frame->dptrUV ? frame->stride[1] : frame->stride[0];
+    memcpy2D.dstDevice      = dst + (CUdeviceptr)dst_pitch * encode_buffer->stInputBfr.dwHeight;
+    memcpy2D.Height         = (height + 1) / 2;
+    cu_result = cuMemcpy2D(&memcpy2D);
+    if(cu_result != CUDA_SUCCESS)
+        return NV_ENC_ERR_GENERIC;
+
+    NVENCSTATUS nv_status = m_nvencoder_api->NvEncMapInputResource(encode_buffer->stInputBfr.nvRegisteredResource, &encode_buffer->stInputBfr.hDeviceInputSurface);
+    if (nv_status != NV_ENC_SUCCESS)
+        PRINTERR("Failed to Map input buffer %p\n", encode_buffer->stInputBfr.hDeviceInputSurface);
+    return nv_status;
+}
+
 NVENCSTATUS NvVideoEncoder::InitCuda(uint32_t device_id) {
     CUresult cu_result;
     CUdevice device;
-    CUcontext cu_ctx;
     int  device_count = 0;
     int  sm_minor = 0, sm_major = 0;
 
@@ -292,24 +764,12 @@ NVENCSTATUS NvVideoEncoder::InitCuda(uint32_t device_id) {
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
 
-    cu_result = cuCtxCreate((CUcontext*)(&m_cuda_device), 0, device);
-    if (cu_result != CUDA_SUCCESS) {
-        PRINTERR("cuCtxCreate error:0x%x\n", cu_result);
-        return NV_ENC_ERR_NO_ENCODE_DEVICE;
-    }
-
-    cu_result = cuCtxPopCurrent(&cu_ctx);
-    if (cu_result != CUDA_SUCCESS) {
-        PRINTERR("cuCtxPopCurrent error:0x%x\n", cu_result);
+    CUcontext cu_ctx;
+    if (!CudaContextPool::Acquire(device_id, cu_ctx, m_ctx_lock)) {
+        PRINTERR("Failed to get the context of GPU %d\n", device_id);
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
-
-    cu_result = cuvidCtxLockCreate(&m_ctx_lock, cu_ctx);
-    if (cu_result != CUDA_SUCCESS) {
-		PRINTERR("cuvidCtxLockCreate error:0x%x\n", cu_result);
-		return NV_ENC_ERR_NO_ENCODE_DEVICE;
-	}
-
+    m_cuda_device = cu_ctx;
 
     return NV_ENC_SUCCESS;
 }
@@ -318,73 +778,78 @@ NVENCSTATUS NvVideoEncoder::AllocateIOBuffers(uint32_t width, uint32_t height, N
     NVENCSTATUS nv_status = NV_ENC_SUCCESS;
 
     m_encoder_buffer_queue.Initialize(m_encoder_buffer, m_encoder_buffer_count);
-    CCtxAutoLock lock(m_ctx_lock);
     for (uint32_t i = 0; i < m_encoder_buffer_count; i++) {
-    	nv_status = m_nvencoder_api->NvEncCreateInputBuffer(width, height, &m_encoder_buffer[i].stInputBfr.hHostInputSurface, bufefr_fmt);
+        nv_status = AllocateIOBuffer(i, width, height, bufefr_fmt);
         if (nv_status != NV_ENC_SUCCESS)
             return nv_status;
+    }
+    return NV_ENC_SUCCESS;
+}
 
-        m_encoder_buffer[i].stInputBfr.bufferFmt = bufefr_fmt;
-        m_encoder_buffer[i].stInputBfr.dwWidth = width;
-        m_encoder_buffer[i].stInputBfr.dwHeight = height;
+NVENCSTATUS NvVideoEncoder::AllocateIOBuffer(uint32_t i, uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufefr_fmt) {
+    NVENCSTATUS nv_status = NV_ENC_SUCCESS;
 
-        CUresult cu_result = cuMemAllocPitch(&m_encoder_buffer[i].stInputBfr.pNV12devPtr,
-                    (size_t*)&m_encoder_buffer[i].stInputBfr.uNV12Stride,
-					width, height * 3 / 2, 16);
+    CCtxAutoLock lock(m_ctx_lock);
+    nv_status = m_nvencoder_api->NvEncCreateInputBuffer(width, height, &m_encoder_buffer[i].stInputBfr.hHostInputSurface, bufefr_fmt);
+    if (nv_status != NV_ENC_SUCCESS)
+        return nv_status;
 
-        if(cu_result != CUDA_SUCCESS)
-        	return NV_ENC_ERR_GENERIC;
+    m_encoder_buffer[i].stInputBfr.bufferFmt = bufefr_fmt;
+    m_encoder_buffer[i].stInputBfr.dwWidth = width;
+    m_encoder_buffer[i].stInputBfr.dwHeight = height;
 
-        nv_status = m_nvencoder_api->NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
-				   (void*)m_encoder_buffer[i].stInputBfr.pNV12devPtr,
-				   width, height,
-				   m_encoder_buffer[i].stInputBfr.uNV12Stride,
-				   &m_encoder_buffer[i].stInputBfr.nvRegisteredResource);
+    CUresult cu_result = cuMemAllocPitch(&m_encoder_buffer[i].stInputBfr.pNV12devPtr,
+                (size_t*)&m_encoder_buffer[i].stInputBfr.uNV12Stride,
+				width, height * 3 / 2, 16);
 
-	    if (nv_status != NV_ENC_SUCCESS)
-		   return nv_status;
+    if(cu_result != CUDA_SUCCESS)
+    	return NV_ENC_ERR_GENERIC;
 
-        nv_status = m_nvencoder_api->NvEncCreateBitstreamBuffer(BITSTREAM_BUFFER_SIZE, &m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer);
-        if (nv_status != NV_ENC_SUCCESS)
-            return nv_status;
-        m_encoder_buffer[i].stOutputBfr.dwBitstreamBufferSize = BITSTREAM_BUFFER_SIZE;
-    }
+    nv_status = m_nvencoder_api->NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+			   (void*)m_encoder_buffer[i].stInputBfr.pNV12devPtr,
+			   width, height,
+			   m_encoder_buffer[i].stInputBfr.uNV12Stride,
+			   &m_encoder_buffer[i].stInputBfr.nvRegisteredResource);
+
+    if (nv_status != NV_ENC_SUCCESS)
+	   return nv_status;
+
+    nv_status = m_nvencoder_api->NvEncCreateBitstreamBuffer(BITSTREAM_BUFFER_SIZE, &m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer);
+    if (nv_status != NV_ENC_SUCCESS)
+        return nv_status;
+    m_encoder_buffer[i].stOutputBfr.dwBitstreamBufferSize = BITSTREAM_BUFFER_SIZE;
     return NV_ENC_SUCCESS;
 }
+
 NVENCSTATUS NvVideoEncoder::ReleaseIOBuffers() {
-	CCtxAutoLock lock(m_ctx_lock);
     for (uint32_t i = 0; i < m_encoder_buffer_count; i++) {
-	    cuMemFree(m_encoder_buffer[i].stInputBfr.pNV12devPtr);
-		m_nvencoder_api->NvEncDestroyInputBuffer(m_encoder_buffer[i].stInputBfr.hHostInputSurface);
-        m_encoder_buffer[i].stInputBfr.hHostInputSurface = nullptr;
-        m_nvencoder_api->NvEncUnregisterResource(m_encoder_buffer[i].stInputBfr.nvRegisteredResource);
-		m_nvencoder_api->NvEncDestroyBitstreamBuffer(m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer);
-        m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer = nullptr;
+        ReleaseIOBuffer(i);
     }
     return NV_ENC_SUCCESS;
 }
 
+// also used on partially allocated entries, the entry is left zeroed
+void NvVideoEncoder::ReleaseIOBuffer(uint32_t i) {
+	CCtxAutoLock lock(m_ctx_lock);
+	if (m_encoder_buffer[i].stInputBfr.nvRegisteredResource)
+		m_nvencoder_api->NvEncUnregisterResource(m_encoder_buffer[i].stInputBfr.nvRegisteredResource);
+	if (m_encoder_buffer[i].stInputBfr.pNV12devPtr)
+		cuMemFree(m_encoder_buffer[i].stInputBfr.pNV12devPtr);
+	if (m_encoder_buffer[i].stInputBfr.hHostInputSurface)
+		m_nvencoder_api->NvEncDestroyInputBuffer(m_encoder_buffer[i].stInputBfr.hHostInputSurface);
+	if (m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer)
+		m_nvencoder_api->NvEncDestroyBitstreamBuffer(m_encoder_buffer[i].stOutputBfr.hBitstreamBuffer);
+	memset(&m_encoder_buffer[i], 0, sizeof(EncodeBuffer));
+}
+
 NVENCSTATUS NvVideoEncoder::FlushEncoder() {
     NVENCSTATUS nv_status = m_nvencoder_api->NvEncFlushEncoderQueue(nullptr);
+    StopOutputThread();
     if (nv_status != NV_ENC_SUCCESS) {
         return nv_status;
     }
 
-    EncodeBuffer * encode_buffer = nullptr;
-    do{
-    	encode_buffer = m_encoder_buffer_queue.GetPending();
-    	if(!encode_buffer){
-			break;
-		}
-    	NV_ENC_LOCK_BITSTREAM bit_stream;
-    	m_nvencoder_api->ProcessOutput(encode_buffer,bit_stream);
-		OutputFrame(bit_stream);
-		if (encode_buffer->stInputBfr.hDeviceInputSurface) {
-			nv_status = m_nvencoder_api->NvEncUnmapInputResource(encode_buffer->stInputBfr.hDeviceInputSurface);
-			encode_buffer->stInputBfr.hDeviceInputSurface = nullptr;
-		}
-    }while(true);
-
+    DrainOutput();
     return nv_status;
 }
 
@@ -9,10 +9,16 @@
 #define SRC_MEDIA_NVIDIA_NVVIDEOENCODER_H_
 
 #include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
 
 #include "NvEncodeAPI.h"
 #include "dynlink_nvcuvid.h"
 #include "MediaDef.h"
+#include "EncodeInputQueue.h"
 
 class NvVideoEncoder{
 public:
@@ -20,9 +26,32 @@ public:
 	~NvVideoEncoder();
 	bool Start(VideoParam & param,VideoBitstreamCB cb,void * user_data);
 	bool InputData(VideoRawData & data);
+	// count frames in order; with shared_input they are queued one by one
+	bool InputBatch(VideoRawData * frames, int count);
 	bool Stop();
+	VideoEncodeStats GetStats();
 private:
-	void OutputFrame(NV_ENC_LOCK_BITSTREAM lockBitstreamData);
+	void OutputFrame(NV_ENC_LOCK_BITSTREAM lockBitstreamData, int64_t pts);
+	int64_t PopPts();
+	// asynchronous output: buffers are handed to OutputLoop in submit order
+	bool StartOutputThread();
+	// lets the output thread drain the submitted buffers, then joins it
+	void StopOutputThread();
+	void OutputLoop();
+	EncodeBuffer * AcquireBuffer();
+	// shared input: the encode thread takes frames from m_input_queue
+	void InputLoop();
+	bool SubmitFrame(VideoRawData & data);
+	void GetFrameConfig(VideoRawData & data, EncodeFrameConfig & frame);
+	// submit to bitstream latency of a retrieved buffer, stall time of the
+	// producer; both feed the ring depth controller
+	void RecordOutput(EncodeBuffer * encode_buffer);
+	void RecordStall(std::chrono::steady_clock::duration wait);
+	// evaluates a finished window and resizes the ring when needed
+	void ControlDepth();
+	NVENCSTATUS ResizeBuffers(uint32_t count);
+	// retrieves every submitted buffer on the calling thread
+	void DrainOutput();
 private:
 	NVEncoderAPI *m_nvencoder_api = nullptr;
 	uint32_t m_encoder_buffer_count = 0;
@@ -35,12 +64,63 @@ private:
 	bool m_inited = false;
 	VideoBitstreamCB m_cb = nullptr;
 	void * m_user_data = nullptr;
+	VideoColorMatrix m_color_matrix = VideoColorMatrix::BT601;
+	VideoColorRange m_color_range = VideoColorRange::LIMITED;
+	struct PendingOutput {
+		EncodeBuffer * buffer;
+		int64_t pts;
+		bool encoded;	// false when submitting failed, only recycled
+	};
+	std::thread m_output_thread;
+	std::mutex m_output_mutex;			// guards the members below and m_encoder_buffer_queue
+	std::condition_variable m_output_cond;
+	std::queue<PendingOutput> m_output_queue;
+	uint32_t m_buffers_in_flight = 0;	// acquired and not yet recycled
+	bool m_output_exit = false;
+	// ring depth controller, window state is guarded by m_output_mutex
+	uint32_t m_min_buffers = 0;
+	uint32_t m_max_buffers = 0;
+	double m_latency_target_ms = 0;
+	std::chrono::steady_clock::time_point m_submit_time[MAX_ENCODE_QUEUE];
+	std::chrono::steady_clock::time_point m_window_start;
+	int m_window_frames = 0;
+	int m_window_outputs = 0;
+	double m_window_latency_ms = 0;
+	double m_window_stall_ms = 0;
+	int m_idle_windows = 0;
+	VideoEncodeStats m_stats;
+	EncodeInputQueue m_input_queue;
+	// InputBatch holds m_ctx_lock while it copies a group of frames, the
+	// releases of the copied frames wait
+	bool m_batch_locked = false;
+	// retained decoder frames encoded in place, per buffer until retrieved
+	struct RetainedInput {
+		VideoFrameReleaseCB release;
+		void * release_ctx;
+		void * registered;		// NVENC registration of the frame
+	};
+	RetainedInput m_retained_input[MAX_ENCODE_QUEUE] = {};
+	std::vector<RetainedInput> m_deferred_releases;
+	// placement reported to DeviceSelector
+	double m_pixel_rate = 0;
+	int m_device_group = 0;
+	std::thread m_input_thread;
 private:
 	NVENCSTATUS Deinitialize();
-	NVENCSTATUS EncodeFrame(EncodeFrameConfig * frame);
+	bool AbortStart();
+	NVENCSTATUS EncodeFrame(EncodeFrameConfig * frame, int64_t pts);
+	EncodeBuffer * GetSyncBuffer();
+	NVENCSTATUS EncodeToBuffer(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer);
+	NVENCSTATUS MapDeviceFrame(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer);
+	void * RegisterFrame(EncodeFrameConfig * frame);
+	NVENCSTATUS CopyDeviceFrame(EncodeFrameConfig * frame, EncodeBuffer * encode_buffer);
+	void UnmapInput(EncodeBuffer * encode_buffer);
+	void ReleaseInput(const RetainedInput & input);
 	NVENCSTATUS InitCuda(uint32_t device_id=0);
 	NVENCSTATUS AllocateIOBuffers(uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufefr_fmt);
+	NVENCSTATUS AllocateIOBuffer(uint32_t index, uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufefr_fmt);
 	NVENCSTATUS ReleaseIOBuffers();
+	void ReleaseIOBuffer(uint32_t index);
 	NVENCSTATUS FlushEncoder();
 };
 
@@ -0,0 +1,416 @@
+/*
+ * VideoConvert.cpp
+ *
+ *  Scalar kernels, cpu detection and the frame level entry points.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "VideoConvert.h"
+#include "VideoConvertKernels.h"
+
+static void SplitUV8Scalar(const uint8_t * uv, uint8_t * u, uint8_t * v, int n) {
+	for (int x = 0; x < n; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+}
+
+static void MergeUV8Scalar(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n) {
+	for (int x = 0; x < n; x++) {
+		uv[x * 2] = u[x];
+		uv[x * 2 + 1] = v[x];
+	}
+}
+
+static void BGR24ToNV12Row2Scalar(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	BGRToNV12Row2Tail(src0, src1, 3, y0, y1, uv, 0, width, c);
+}
+
+static void BGRAToNV12Row2Scalar(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	BGRToNV12Row2Tail(src0, src1, 4, y0, y1, uv, 0, width, c);
+}
+
+static void NV12ToRgbRowScalar(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int width, int layout,
+		const YuvToRgbCoeffs * c, const RgbTensorRow * t) {
+	NV12ToRgbTail(y, uv, dst, 0, width, layout, c, t);
+}
+
+static void ShiftRow16Scalar(const uint16_t * src, uint16_t * dst, int n, int rsh) {
+	for (int x = 0; x < n; x++) {
+		dst[x] = src[x] >> rsh;
+	}
+}
+
+static void SplitUV16Scalar(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh) {
+	for (int x = 0; x < n; x++) {
+		u[x] = uv[x * 2] >> rsh;
+		v[x] = uv[x * 2 + 1] >> rsh;
+	}
+}
+
+static void Pack10Row16Scalar(const uint16_t * src, uint8_t * dst, int n) {
+	Pack10Row16Tail(src, dst, n);
+}
+
+static void SplitUV16Pack10Scalar(const uint16_t * uv, uint8_t * u, uint8_t * v, int n) {
+	SplitUV16Pack10Tail(uv, u, v, n);
+}
+
+static void DitherRow16Scalar(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither) {
+	Dither16Tail(src, dst, n, dither);
+}
+
+static void SplitUV16DitherScalar(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither) {
+	SplitUV16DitherTail(uv, u, v, n, dither);
+}
+
+void InitVideoConvertKernelsScalar(VideoConvertKernels & k) {
+	k.split_uv8 = SplitUV8Scalar;
+	k.merge_uv8 = MergeUV8Scalar;
+	k.bgr24_to_nv12_row2 = BGR24ToNV12Row2Scalar;
+	k.bgra_to_nv12_row2 = BGRAToNV12Row2Scalar;
+	k.nv12_to_rgb_row = NV12ToRgbRowScalar;
+	k.shift_row16 = ShiftRow16Scalar;
+	k.split_uv16 = SplitUV16Scalar;
+	k.pack10_row16 = Pack10Row16Scalar;
+	k.split_uv16_pack10 = SplitUV16Pack10Scalar;
+	k.dither_row16 = DitherRow16Scalar;
+	k.split_uv16_dither = SplitUV16DitherScalar;
+}
+
+// 4x4 bayer matrix scaled to the 8 bits dropped by the 16 -> 8 bit conversion
+static const uint16_t kDither4x4[4][4] = {
+	{   8, 136,  40, 168 },
+	{ 200,  72, 232, 104 },
+	{  56, 184,  24, 152 },
+	{ 248, 120, 216,  88 }
+};
+
+CpuSimdLevel DetectCpuSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return CpuSimdLevel::AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return CpuSimdLevel::AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return CpuSimdLevel::SSE2;
+	return CpuSimdLevel::SCALAR;
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+	return CpuSimdLevel::NEON;
+#else
+	return CpuSimdLevel::SCALAR;
+#endif
+}
+
+static bool IsSimdLevelSupported(CpuSimdLevel level) {
+	CpuSimdLevel best = DetectCpuSimdLevel();
+	if (level == CpuSimdLevel::SCALAR)
+		return true;
+	if (best == CpuSimdLevel::NEON || level == CpuSimdLevel::NEON)
+		return level == best;
+	return (int)level <= (int)best;
+}
+
+static void BuildKernels(VideoConvertKernels & k, CpuSimdLevel level) {
+	InitVideoConvertKernelsScalar(k);
+#if defined(__x86_64__) || defined(__i386__)
+	if (level == CpuSimdLevel::SSE2 || level == CpuSimdLevel::AVX2 || level == CpuSimdLevel::AVX512)
+		InitVideoConvertKernelsSSE2(k);
+	if (level == CpuSimdLevel::AVX2 || level == CpuSimdLevel::AVX512)
+		InitVideoConvertKernelsAVX2(k);
+	if (level == CpuSimdLevel::AVX512)
+		InitVideoConvertKernelsAVX512(k);
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+	if (level == CpuSimdLevel::NEON)
+		InitVideoConvertKernelsNEON(k);
+#endif
+}
+
+struct VideoConvertDispatch {
+	VideoConvertKernels kernels;
+	CpuSimdLevel level;
+	VideoConvertDispatch() {
+		level = DetectCpuSimdLevel();
+		BuildKernels(kernels, level);
+	}
+};
+
+static VideoConvertDispatch & Dispatch() {
+	static VideoConvertDispatch dispatch;
+	return dispatch;
+}
+
+CpuSimdLevel GetVideoConvertSimdLevel() {
+	return Dispatch().level;
+}
+
+// Not synchronized with running conversions, call it before any session starts.
+bool SetVideoConvertSimdLevel(CpuSimdLevel level) {
+	if (!IsSimdLevelSupported(level))
+		return false;
+	VideoConvertDispatch & dispatch = Dispatch();
+	BuildKernels(dispatch.kernels, level);
+	dispatch.level = level;
+	return true;
+}
+
+const char * CpuSimdLevelName(CpuSimdLevel level) {
+	switch (level) {
+	case CpuSimdLevel::SSE2: return "sse2";
+	case CpuSimdLevel::AVX2: return "avx2";
+	case CpuSimdLevel::AVX512: return "avx512";
+	case CpuSimdLevel::NEON: return "neon";
+	default: return "scalar";
+	}
+}
+
+void ConvertNV12ToI420(const uint8_t * src_y, const uint8_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	int width_2 = width >> 1;
+	int height_2 = height >> 1;
+
+	if (src_pitch == width && dst_stride_y == width) {
+		memcpy(dst_y, src_y, (size_t)width * height);
+	} else {
+		for (int y = 0; y < height; y++) {
+			memcpy(dst_y + (size_t)y * dst_stride_y, src_y + (size_t)y * src_pitch, width);
+		}
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.split_uv8(src_uv + (size_t)y * src_pitch,
+				dst_u + (size_t)y * dst_stride_uv, dst_v + (size_t)y * dst_stride_uv, width_2);
+	}
+}
+
+void ConvertI420ToNV12(const uint8_t * src_y, const uint8_t * src_u, const uint8_t * src_v,
+		int src_stride_y, int src_stride_u, int src_stride_v,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	int height_2 = (height + 1) >> 1;
+
+	if (src_stride_y == dst_pitch) {
+		memcpy(dst_y, src_y, (size_t)(height - 1) * dst_pitch + width);
+	} else {
+		for (int y = 0; y < height; y++) {
+			memcpy(dst_y + (size_t)y * dst_pitch, src_y + (size_t)y * src_stride_y, width);
+		}
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.merge_uv8(src_u + (size_t)y * src_stride_u, src_v + (size_t)y * src_stride_v,
+				dst_uv + (size_t)y * dst_pitch, (width + 1) >> 1);
+	}
+}
+
+static int16_t ToFixed14(double v) {
+	return (int16_t)lrint(v * (1 << 14));
+}
+
+static RgbToYuvCoeffs GetRgbToYuvCoeffs(VideoColorMatrix matrix, VideoColorRange range) {
+	double kr = matrix == VideoColorMatrix::BT709 ? 0.2126 : 0.299;
+	double kb = matrix == VideoColorMatrix::BT709 ? 0.0722 : 0.114;
+	double kg = 1.0 - kr - kb;
+	double ys = range == VideoColorRange::FULL ? 1.0 : 219.0 / 255.0;
+	double cs = range == VideoColorRange::FULL ? 1.0 : 224.0 / 255.0;
+	double us = cs / (2.0 * (1.0 - kb));
+	double vs = cs / (2.0 * (1.0 - kr));
+	RgbToYuvCoeffs c;
+	c.yr = ToFixed14(kr * ys);
+	c.yg = ToFixed14(kg * ys);
+	c.yb = ToFixed14(kb * ys);
+	c.ur = ToFixed14(-kr * us);
+	c.ug = ToFixed14(-kg * us);
+	c.ub = ToFixed14((1.0 - kb) * us);
+	c.vr = ToFixed14((1.0 - kr) * vs);
+	c.vg = ToFixed14(-kg * vs);
+	c.vb = ToFixed14(-kb * vs);
+	c.y_offset = range == VideoColorRange::FULL ? 0 : 16;
+	return c;
+}
+
+void ConvertBGRToNV12(const uint8_t * src, int src_stride, int bytes_per_pixel,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height,
+		VideoColorMatrix matrix, VideoColorRange range) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	RgbToYuvCoeffs c = GetRgbToYuvCoeffs(matrix, range);
+	void (*row2)(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, int, const RgbToYuvCoeffs *) =
+			bytes_per_pixel == 4 ? k.bgra_to_nv12_row2 : k.bgr24_to_nv12_row2;
+
+	for (int y = 0; y < height; y += 2) {
+		// an odd last row is paired with itself
+		int y1 = y + 1 < height ? y + 1 : y;
+		row2(src + (size_t)y * src_stride, src + (size_t)y1 * src_stride,
+				dst_y + (size_t)y * dst_pitch, dst_y + (size_t)y1 * dst_pitch,
+				dst_uv + (size_t)(y / 2) * dst_pitch, width, &c);
+	}
+}
+
+static YuvToRgbCoeffs GetYuvToRgbCoeffs(VideoColorMatrix matrix, VideoColorRange range) {
+	double kr = matrix == VideoColorMatrix::BT709 ? 0.2126 : 0.299;
+	double kb = matrix == VideoColorMatrix::BT709 ? 0.0722 : 0.114;
+	double kg = 1.0 - kr - kb;
+	double ys = range == VideoColorRange::FULL ? 1.0 : 255.0 / 219.0;
+	double cs = range == VideoColorRange::FULL ? 1.0 : 255.0 / 224.0;
+	YuvToRgbCoeffs c;
+	c.ky = (int16_t)lrint(ys * (1 << 13));
+	c.rv = (int16_t)lrint(2.0 * (1.0 - kr) * cs * (1 << 13));
+	c.gu = (int16_t)lrint(-2.0 * (1.0 - kb) * kb / kg * cs * (1 << 13));
+	c.gv = (int16_t)lrint(-2.0 * (1.0 - kr) * kr / kg * cs * (1 << 13));
+	c.bu = (int16_t)lrint(2.0 * (1.0 - kb) * cs * (1 << 13));
+	c.y_offset = range == VideoColorRange::FULL ? 0 : 16;
+	return c;
+}
+
+void ConvertNV12ToRGB(const uint8_t * src_y, const uint8_t * src_uv, int src_pitch,
+		uint8_t * dst, int dst_stride, VideoBaseBandFmt fmt, int width, int height,
+		VideoColorMatrix matrix, VideoColorRange range,
+		float * tensor, const float * scale, const float * bias, size_t tensor_plane) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	YuvToRgbCoeffs c = GetYuvToRgbCoeffs(matrix, range);
+	int layout = RGB_LAYOUT_BGR;
+	if (fmt == VideoBaseBandFmt::RGB)
+		layout = RGB_LAYOUT_RGB;
+	else if (fmt == VideoBaseBandFmt::BGRA)
+		layout = RGB_LAYOUT_BGRA;
+	else if (fmt == VideoBaseBandFmt::RGBA)
+		layout = RGB_LAYOUT_RGBA;
+	bool rgb = layout == RGB_LAYOUT_RGB || layout == RGB_LAYOUT_RGBA;
+
+	// tensor planes follow the channel order of fmt, the kernels want r, g, b
+	RgbTensorRow t;
+	size_t plane = tensor_plane ? tensor_plane : (size_t)width * height;
+	int ri = rgb ? 0 : 2;
+	int bi = rgb ? 2 : 0;
+	if (tensor) {
+		static const float default_scale[3] = {1.0f / 255, 1.0f / 255, 1.0f / 255};
+		static const float default_bias[3] = {0, 0, 0};
+		if (!scale)
+			scale = default_scale;
+		if (!bias)
+			bias = default_bias;
+		t.scale[0] = scale[ri];
+		t.scale[1] = scale[1];
+		t.scale[2] = scale[bi];
+		t.bias[0] = bias[ri];
+		t.bias[1] = bias[1];
+		t.bias[2] = bias[bi];
+	}
+
+	for (int y = 0; y < height; y++) {
+		if (tensor) {
+			t.r = tensor + ri * plane + (size_t)y * width;
+			t.g = tensor + plane + (size_t)y * width;
+			t.b = tensor + bi * plane + (size_t)y * width;
+		}
+		k.nv12_to_rgb_row(src_y + (size_t)y * src_pitch, src_uv + (size_t)(y / 2) * src_pitch,
+				dst + (size_t)y * dst_stride, width, layout, &c, tensor ? &t : nullptr);
+	}
+}
+
+void ConvertP016ToI420(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint16_t * dst_y, uint16_t * dst_u, uint16_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height, int rsh) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	const uint8_t * py = (const uint8_t *)src_y;
+	const uint8_t * puv = (const uint8_t *)src_uv;
+	uint8_t * dy = (uint8_t *)dst_y;
+	uint8_t * du = (uint8_t *)dst_u;
+	uint8_t * dv = (uint8_t *)dst_v;
+	int width_2 = width >> 1;
+	int height_2 = height >> 1;
+
+	for (int y = 0; y < height; y++) {
+		if (rsh == 0)
+			memcpy(dy + (size_t)y * dst_stride_y, py + (size_t)y * src_pitch, width * sizeof(uint16_t));
+		else
+			k.shift_row16((const uint16_t *)(py + (size_t)y * src_pitch),
+					(uint16_t *)(dy + (size_t)y * dst_stride_y), width, rsh);
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.split_uv16((const uint16_t *)(puv + (size_t)y * src_pitch),
+				(uint16_t *)(du + (size_t)y * dst_stride_uv), (uint16_t *)(dv + (size_t)y * dst_stride_uv),
+				width_2, rsh);
+	}
+}
+
+int Packed10LineSize(int width) {
+	return (width + 3) / 4 * 5;
+}
+
+void ConvertP016ToI420Packed10(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	const uint8_t * py = (const uint8_t *)src_y;
+	const uint8_t * puv = (const uint8_t *)src_uv;
+	int width_2 = width >> 1;
+	int height_2 = height >> 1;
+
+	for (int y = 0; y < height; y++) {
+		k.pack10_row16((const uint16_t *)(py + (size_t)y * src_pitch), dst_y + (size_t)y * dst_stride_y, width);
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.split_uv16_pack10((const uint16_t *)(puv + (size_t)y * src_pitch),
+				dst_u + (size_t)y * dst_stride_uv, dst_v + (size_t)y * dst_stride_uv, width_2);
+	}
+}
+
+void ConvertP016ToI420Dither8(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	const uint8_t * py = (const uint8_t *)src_y;
+	const uint8_t * puv = (const uint8_t *)src_uv;
+	int width_2 = width >> 1;
+	int height_2 = height >> 1;
+
+	for (int y = 0; y < height; y++) {
+		k.dither_row16((const uint16_t *)(py + (size_t)y * src_pitch), dst_y + (size_t)y * dst_stride_y,
+				width, kDither4x4[y & 3]);
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.split_uv16_dither((const uint16_t *)(puv + (size_t)y * src_pitch),
+				dst_u + (size_t)y * dst_stride_uv, dst_v + (size_t)y * dst_stride_uv, width_2, kDither4x4[y & 3]);
+	}
+}
+
+void ConvertP016ToNV12Dither8(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	const uint8_t * py = (const uint8_t *)src_y;
+	const uint8_t * puv = (const uint8_t *)src_uv;
+	int width_uv = width & ~1;
+	int height_2 = height >> 1;
+
+	for (int y = 0; y < height; y++) {
+		k.dither_row16((const uint16_t *)(py + (size_t)y * src_pitch), dst_y + (size_t)y * dst_pitch,
+				width, kDither4x4[y & 3]);
+	}
+	for (int y = 0; y < height_2; y++) {
+		k.dither_row16((const uint16_t *)(puv + (size_t)y * src_pitch), dst_uv + (size_t)y * dst_pitch,
+				width_uv, kDither4x4[y & 3]);
+	}
+}
+
+void ConvertP016Luma(const uint16_t * src_y, int src_pitch, uint8_t * dst, int dst_stride,
+		int width, int height, VideoOutputDepth depth, int rsh) {
+	const VideoConvertKernels & k = Dispatch().kernels;
+	const uint8_t * py = (const uint8_t *)src_y;
+
+	for (int y = 0; y < height; y++) {
+		const uint16_t * src = (const uint16_t *)(py + (size_t)y * src_pitch);
+		uint8_t * row = dst + (size_t)y * dst_stride;
+		if (depth == VideoOutputDepth::DITHER8)
+			k.dither_row16(src, row, width, kDither4x4[y & 3]);
+		else if (depth == VideoOutputDepth::PACKED10)
+			k.pack10_row16(src, row, width);
+		else
+			k.shift_row16(src, (uint16_t *)row, width, rsh);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * VideoConvert.h
+ *
+ *  Host side pixel format conversion with runtime SIMD dispatch.
+ */
+
+#ifndef SRC_VIDEOCONVERT_H_
+#define SRC_VIDEOCONVERT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "MediaDef.h"
+
+enum class CpuSimdLevel {
+	SCALAR,
+	SSE2,
+	AVX2,
+	AVX512,
+	NEON
+};
+
+// Best level supported by the running cpu (cpuid on x86, NEON is always on aarch64).
+CpuSimdLevel DetectCpuSimdLevel();
+// Level the conversion kernels are currently dispatched to.
+CpuSimdLevel GetVideoConvertSimdLevel();
+// Force a lower level (e.g. for benchmarking); fails if the cpu does not support it.
+bool SetVideoConvertSimdLevel(CpuSimdLevel level);
+const char * CpuSimdLevelName(CpuSimdLevel level);
+
+// NV12 (Y plane followed by interleaved CbCr) to planar I420.
+// All pitches/strides are in bytes.
+void ConvertNV12ToI420(const uint8_t * src_y, const uint8_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height);
+
+// Planar I420 to NV12, chroma rows are read with their own strides.
+// The luma plane is copied with one memcpy when src_stride_y == dst_pitch.
+// Odd sizes have (width + 1) / 2 by (height + 1) / 2 chroma samples.
+void ConvertI420ToNV12(const uint8_t * src_y, const uint8_t * src_u, const uint8_t * src_v,
+		int src_stride_y, int src_stride_u, int src_stride_v,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height);
+
+// Packed BGR (bytes_per_pixel 3) or BGRA (4) to NV12 in one pass, chroma is
+// the average of each 2x2 block. dst_uv receives (height + 1) / 2 rows.
+void ConvertBGRToNV12(const uint8_t * src, int src_stride, int bytes_per_pixel,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height,
+		VideoColorMatrix matrix, VideoColorRange range);
+
+// NV12 to packed BGR/RGB/BGRA/RGBA (alpha 255) in one pass. When tensor is
+// set it also receives three width * height float planes in fmt channel
+// order, value = sample * scale[c] + bias[c] (defaults 1/255 and 0).
+// tensor_plane is the distance between the planes in floats, 0 means
+// width * height; set it when converting a band of a larger frame.
+void ConvertNV12ToRGB(const uint8_t * src_y, const uint8_t * src_uv, int src_pitch,
+		uint8_t * dst, int dst_stride, VideoBaseBandFmt fmt, int width, int height,
+		VideoColorMatrix matrix, VideoColorRange range,
+		float * tensor = nullptr, const float * scale = nullptr, const float * bias = nullptr,
+		size_t tensor_plane = 0);
+
+// P016 (msb aligned 16 bit NV12) to 16 bit planar I420, every sample shifted right by rsh.
+void ConvertP016ToI420(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint16_t * dst_y, uint16_t * dst_u, uint16_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height, int rsh);
+
+// P016 to YUV420P10_PACKED: the top 10 bits of every sample, 4 samples per 5 bytes.
+int Packed10LineSize(int width);
+void ConvertP016ToI420Packed10(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height);
+
+// P016 to 8 bit I420 with a 4x4 ordered dither.
+void ConvertP016ToI420Dither8(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_u, uint8_t * dst_v, int dst_stride_y, int dst_stride_uv,
+		int width, int height);
+
+// The luma plane of a P016 surface alone, in the sample layout of the given
+// output depth: 16 bit shifted right by rsh (NATIVE), Packed10 or Dither8.
+void ConvertP016Luma(const uint16_t * src_y, int src_pitch, uint8_t * dst, int dst_stride,
+		int width, int height, VideoOutputDepth depth, int rsh);
+
+// P016 to 8 bit NV12 with a 4x4 ordered dither. dst may alias src when the
+// pitches match, rows are narrowed front to back.
+void ConvertP016ToNV12Dither8(const uint16_t * src_y, const uint16_t * src_uv, int src_pitch,
+		uint8_t * dst_y, uint8_t * dst_uv, int dst_pitch, int width, int height);
+
+#endif /* SRC_VIDEOCONVERT_H_ */
@@ -0,0 +1,375 @@
+/*
+ * VideoConvertAVX2.cpp
+ *
+ *  AVX2 row kernels, see VideoConvertKernels.h.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#include "VideoConvertKernels.h"
+
+static void SplitUV8AVX2(const uint8_t * uv, uint8_t * u, uint8_t * v, int n) {
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(uv + x * 2));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(uv + x * 2 + 32));
+		// packus works per 128 bit lane, put the 64 bit blocks back in order
+		__m256i ou = _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+		__m256i ov = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+		_mm256_storeu_si256((__m256i *)(u + x), _mm256_permute4x64_epi64(ou, _MM_SHUFFLE(3, 1, 2, 0)));
+		_mm256_storeu_si256((__m256i *)(v + x), _mm256_permute4x64_epi64(ov, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+}
+
+static void MergeUV8AVX2(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n) {
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(u + x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(v + x));
+		__m256i lo = _mm256_unpacklo_epi8(a, b);
+		__m256i hi = _mm256_unpackhi_epi8(a, b);
+		_mm256_storeu_si256((__m256i *)(uv + x * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(uv + x * 2 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	for (; x < n; x++) {
+		uv[x * 2] = u[x];
+		uv[x * 2 + 1] = v[x];
+	}
+}
+
+static void ShiftRow16AVX2(const uint16_t * src, uint16_t * dst, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + x));
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_srl_epi16(a, shift));
+	}
+	for (; x < n; x++) {
+		dst[x] = src[x] >> rsh;
+	}
+}
+
+// 16 u/v pairs -> 16 u in the low, 16 v in the high output
+static inline void Deinterleave16x16(__m256i a, __m256i b, __m256i & u, __m256i & v) {
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	u = _mm256_packus_epi32(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+	v = _mm256_packus_epi32(_mm256_srli_epi32(a, 16), _mm256_srli_epi32(b, 16));
+	u = _mm256_permute4x64_epi64(u, _MM_SHUFFLE(3, 1, 2, 0));
+	v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void SplitUV16AVX2(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m256i ou, ov;
+		Deinterleave16x16(_mm256_loadu_si256((const __m256i *)(uv + x * 2)),
+				_mm256_loadu_si256((const __m256i *)(uv + x * 2 + 16)), ou, ov);
+		_mm256_storeu_si256((__m256i *)(u + x), _mm256_srl_epi16(ou, shift));
+		_mm256_storeu_si256((__m256i *)(v + x), _mm256_srl_epi16(ov, shift));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2] >> rsh;
+		v[x] = uv[x * 2 + 1] >> rsh;
+	}
+}
+
+// 16 samples -> four 40 bit groups in the low 5 bytes of each 64 bit lane
+static inline __m256i Pack10x16(__m256i s) {
+	const __m256i lo = _mm256_set1_epi64x(0xFFFFFFFF);
+	__m256i p = _mm256_madd_epi16(_mm256_srli_epi16(s, 6), _mm256_set1_epi32(0x04000001));
+	return _mm256_or_si256(_mm256_and_si256(p, lo), _mm256_srli_epi64(_mm256_andnot_si256(lo, p), 12));
+}
+
+// writes 23 bytes, the last 3 are zero and get overwritten by the next group
+static inline void Store10x16(uint8_t * dst, __m256i q) {
+	__m128i l = _mm256_castsi256_si128(q);
+	__m128i h = _mm256_extracti128_si256(q, 1);
+	_mm_storel_epi64((__m128i *)dst, l);
+	_mm_storel_epi64((__m128i *)(dst + 5), _mm_unpackhi_epi64(l, l));
+	_mm_storel_epi64((__m128i *)(dst + 10), h);
+	_mm_storel_epi64((__m128i *)(dst + 15), _mm_unpackhi_epi64(h, h));
+}
+
+static void Pack10Row16AVX2(const uint16_t * src, uint8_t * dst, int n) {
+	int x = 0;
+	for (; x + 16 < n; x += 16) {
+		Store10x16(dst + x / 4 * 5, Pack10x16(_mm256_loadu_si256((const __m256i *)(src + x))));
+	}
+	Pack10Row16Tail(src + x, dst + x / 4 * 5, n - x);
+}
+
+static void SplitUV16Pack10AVX2(const uint16_t * uv, uint8_t * u, uint8_t * v, int n) {
+	int x = 0;
+	for (; x + 16 < n; x += 16) {
+		__m256i ou, ov;
+		Deinterleave16x16(_mm256_loadu_si256((const __m256i *)(uv + x * 2)),
+				_mm256_loadu_si256((const __m256i *)(uv + x * 2 + 16)), ou, ov);
+		Store10x16(u + x / 4 * 5, Pack10x16(ou));
+		Store10x16(v + x / 4 * 5, Pack10x16(ov));
+	}
+	SplitUV16Pack10Tail(uv + x * 2, u + x / 4 * 5, v + x / 4 * 5, n - x);
+}
+
+static inline __m256i LoadDither(const uint16_t * dither) {
+	return _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)dither));
+}
+
+static inline __m256i Dither16x32(__m256i a, __m256i b, __m256i d) {
+	a = _mm256_srli_epi16(_mm256_adds_epu16(a, d), 8);
+	b = _mm256_srli_epi16(_mm256_adds_epu16(b, d), 8);
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void DitherRow16AVX2(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither) {
+	const __m256i d = LoadDither(dither);
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + x + 16));
+		_mm256_storeu_si256((__m256i *)(dst + x), Dither16x32(a, b, d));
+	}
+	Dither16Tail(src + x, dst + x, n - x, dither);
+}
+
+static void SplitUV16DitherAVX2(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither) {
+	const __m256i d = LoadDither(dither);
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i u0, v0, u1, v1;
+		Deinterleave16x16(_mm256_loadu_si256((const __m256i *)(uv + x * 2)),
+				_mm256_loadu_si256((const __m256i *)(uv + x * 2 + 16)), u0, v0);
+		Deinterleave16x16(_mm256_loadu_si256((const __m256i *)(uv + x * 2 + 32)),
+				_mm256_loadu_si256((const __m256i *)(uv + x * 2 + 48)), u1, v1);
+		_mm256_storeu_si256((__m256i *)(u + x), Dither16x32(u0, u1, d));
+		_mm256_storeu_si256((__m256i *)(v + x), Dither16x32(v0, v1, d));
+	}
+	SplitUV16DitherTail(uv + x * 2, u + x, v + x, n - x, dither);
+}
+
+// 1.14 weights as 16 bit pairs for madd: [b, g] and [r, 1] (the 1 picks up the rounding term)
+struct RgbToYuvVec {
+	__m256i ybg, yr1, ubg, ur1, vbg, vr1, yoff;
+};
+
+static inline __m256i WeightPair(int lo, int hi) {
+	return _mm256_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+static inline void LoadRgbToYuvVec(const RgbToYuvCoeffs * c, RgbToYuvVec & w) {
+	w.ybg = WeightPair(c->yb, c->yg);
+	w.yr1 = WeightPair(c->yr, 1 << 13);
+	w.ubg = WeightPair(c->ub, c->ug);
+	w.ur1 = WeightPair(c->ur, 1 << 13);
+	w.vbg = WeightPair(c->vb, c->vg);
+	w.vr1 = WeightPair(c->vr, 1 << 13);
+	w.yoff = _mm256_set1_epi32(c->y_offset);
+}
+
+// dwords [B G R x] of pixels 0-3|8-11 and 4-7|12-15 -> 16 bit B, G and R in pixel order
+static inline void BGRAToPlanar16(__m256i a, __m256i b, __m256i & B, __m256i & G, __m256i & R) {
+	const __m256i ff = _mm256_set1_epi32(0xFF);
+	B = _mm256_packs_epi32(_mm256_and_si256(a, ff), _mm256_and_si256(b, ff));
+	G = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 8), ff), _mm256_and_si256(_mm256_srli_epi32(b, 8), ff));
+	R = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 16), ff), _mm256_and_si256(_mm256_srli_epi32(b, 16), ff));
+}
+
+static inline void LoadBGRA16(const uint8_t * src, __m256i & B, __m256i & G, __m256i & R) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)src);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+	BGRAToPlanar16(_mm256_permute2x128_si256(a, b, 0x20), _mm256_permute2x128_si256(a, b, 0x31), B, G, R);
+}
+
+// reads 52 bytes for 16 pixels
+static inline void LoadBGR24x16(const uint8_t * src, __m256i & B, __m256i & G, __m256i & R) {
+	const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	__m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+			_mm_loadu_si128((const __m128i *)(src + 24)), 1);
+	__m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + 12))),
+			_mm_loadu_si128((const __m128i *)(src + 36)), 1);
+	BGRAToPlanar16(_mm256_shuffle_epi8(a, expand), _mm256_shuffle_epi8(b, expand), B, G, R);
+}
+
+// 16 bytes in the low half, lanes are put back in order
+static inline __m128i PackLow16(__m256i x) {
+	x = _mm256_packus_epi16(x, x);
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+static inline __m128i Luma16(__m256i B, __m256i G, __m256i R, const RgbToYuvVec & w) {
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(B, G), w.ybg),
+			_mm256_madd_epi16(_mm256_unpacklo_epi16(R, one), w.yr1));
+	__m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(B, G), w.ybg),
+			_mm256_madd_epi16(_mm256_unpackhi_epi16(R, one), w.yr1));
+	lo = _mm256_add_epi32(_mm256_srai_epi32(lo, 14), w.yoff);
+	hi = _mm256_add_epi32(_mm256_srai_epi32(hi, 14), w.yoff);
+	return PackLow16(_mm256_packs_epi32(lo, hi));
+}
+
+// sum of two rows -> 2x2 block average as 32 bit
+static inline __m256i Average2x2(__m256i s0, __m256i s1) {
+	__m256i s = _mm256_madd_epi16(_mm256_add_epi16(s0, s1), _mm256_set1_epi16(1));
+	return _mm256_srli_epi32(_mm256_add_epi32(s, _mm256_set1_epi32(2)), 2);
+}
+
+static inline __m256i ChromaPair(__m256i bg, __m256i r1, __m256i wbg, __m256i wr1) {
+	__m256i t = _mm256_add_epi32(_mm256_madd_epi16(bg, wbg), _mm256_madd_epi16(r1, wr1));
+	return _mm256_add_epi32(_mm256_srai_epi32(t, 14), _mm256_set1_epi32(128));
+}
+
+// 2x16 pixels -> 8 interleaved CbCr pairs
+static inline __m128i Chroma8(__m256i B0, __m256i G0, __m256i R0, __m256i B1, __m256i G1, __m256i R1,
+		const RgbToYuvVec & w) {
+	__m256i b = Average2x2(B0, B1);
+	__m256i g = Average2x2(G0, G1);
+	__m256i r = Average2x2(R0, R1);
+	__m256i bg = _mm256_or_si256(b, _mm256_slli_epi32(g, 16));
+	__m256i r1 = _mm256_or_si256(r, _mm256_set1_epi32(1 << 16));
+	__m256i u = ChromaPair(bg, r1, w.ubg, w.ur1);
+	__m256i v = ChromaPair(bg, r1, w.vbg, w.vr1);
+	return PackLow16(_mm256_packs_epi32(_mm256_unpacklo_epi32(u, v), _mm256_unpackhi_epi32(u, v)));
+}
+
+static void BGRAToNV12Row2AVX2(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	RgbToYuvVec w;
+	LoadRgbToYuvVec(c, w);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i B0, G0, R0, B1, G1, R1;
+		LoadBGRA16(src0 + x * 4, B0, G0, R0);
+		LoadBGRA16(src1 + x * 4, B1, G1, R1);
+		_mm_storeu_si128((__m128i *)(y0 + x), Luma16(B0, G0, R0, w));
+		_mm_storeu_si128((__m128i *)(y1 + x), Luma16(B1, G1, R1, w));
+		_mm_storeu_si128((__m128i *)(uv + x), Chroma8(B0, G0, R0, B1, G1, R1, w));
+	}
+	BGRToNV12Row2Tail(src0, src1, 4, y0, y1, uv, x, width, c);
+}
+
+static void BGR24ToNV12Row2AVX2(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	RgbToYuvVec w;
+	LoadRgbToYuvVec(c, w);
+	int x = 0;
+	// keep 2 pixels of slack for the 4 byte over-read of LoadBGR24x16
+	for (; x + 18 <= width; x += 16) {
+		__m256i B0, G0, R0, B1, G1, R1;
+		LoadBGR24x16(src0 + x * 3, B0, G0, R0);
+		LoadBGR24x16(src1 + x * 3, B1, G1, R1);
+		_mm_storeu_si128((__m128i *)(y0 + x), Luma16(B0, G0, R0, w));
+		_mm_storeu_si128((__m128i *)(y1 + x), Luma16(B1, G1, R1, w));
+		_mm_storeu_si128((__m128i *)(uv + x), Chroma8(B0, G0, R0, B1, G1, R1, w));
+	}
+	BGRToNV12Row2Tail(src0, src1, 3, y0, y1, uv, x, width, c);
+}
+
+// 2.13 weights: [ky, 0] for luma, [u, v] pairs for the chroma terms of r, g and b
+struct YuvToRgbVec {
+	__m256i ky, rc, gc, bc, yoff, round;
+};
+
+static inline void LoadYuvToRgbVec(const YuvToRgbCoeffs * c, YuvToRgbVec & w) {
+	w.ky = WeightPair(c->ky, 0);
+	w.rc = WeightPair(0, c->rv);
+	w.gc = WeightPair(c->gu, c->gv);
+	w.bc = WeightPair(c->bu, 0);
+	w.yoff = _mm256_set1_epi16(c->y_offset);
+	w.round = _mm256_set1_epi32(1 << 12);
+}
+
+// luma terms of 16 pixels + chroma terms of their 8 CbCr pairs -> clamped 16 bit in pixel order
+static inline __m256i RgbChannel16(__m256i ylo, __m256i yhi, __m256i c) {
+	__m256i lo = _mm256_srai_epi32(_mm256_add_epi32(ylo, _mm256_unpacklo_epi32(c, c)), 13);
+	__m256i hi = _mm256_srai_epi32(_mm256_add_epi32(yhi, _mm256_unpackhi_epi32(c, c)), 13);
+	__m256i s = _mm256_packs_epi32(lo, hi);
+	return _mm256_min_epi16(_mm256_max_epi16(s, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+}
+
+static inline void StoreTensor16(float * dst, __m256i s, float scale, float bias) {
+	__m256 k = _mm256_set1_ps(scale);
+	__m256 b = _mm256_set1_ps(bias);
+	__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(s)));
+	__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+	_mm256_storeu_ps(dst, _mm256_add_ps(_mm256_mul_ps(lo, k), b));
+	_mm256_storeu_ps(dst + 8, _mm256_add_ps(_mm256_mul_ps(hi, k), b));
+}
+
+static void NV12ToRgbRowAVX2(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int width, int layout,
+		const YuvToRgbCoeffs * c, const RgbTensorRow * t) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha = _mm256_set1_epi8(-1);
+	const __m256i compact = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	bool rgb = layout == RGB_LAYOUT_RGB || layout == RGB_LAYOUT_RGBA;
+	bool packed24 = layout < RGB_LAYOUT_BGRA;
+	// 24 bit stores spill 4 bytes into the next pixels
+	int end = packed24 ? width - 2 : width;
+	YuvToRgbVec w;
+	LoadYuvToRgbVec(c, w);
+	int x = 0;
+	for (; x + 16 <= end; x += 16) {
+		__m256i Y = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x))), w.yoff);
+		__m256i ylo = _mm256_madd_epi16(_mm256_unpacklo_epi16(Y, zero), w.ky);
+		__m256i yhi = _mm256_madd_epi16(_mm256_unpackhi_epi16(Y, zero), w.ky);
+		__m256i UV = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(uv + x))),
+				_mm256_set1_epi16(128));
+		__m256i R = RgbChannel16(ylo, yhi, _mm256_add_epi32(_mm256_madd_epi16(UV, w.rc), w.round));
+		__m256i G = RgbChannel16(ylo, yhi, _mm256_add_epi32(_mm256_madd_epi16(UV, w.gc), w.round));
+		__m256i B = RgbChannel16(ylo, yhi, _mm256_add_epi32(_mm256_madd_epi16(UV, w.bc), w.round));
+		if (t) {
+			StoreTensor16(t->r + x, R, t->scale[0], t->bias[0]);
+			StoreTensor16(t->g + x, G, t->scale[1], t->bias[1]);
+			StoreTensor16(t->b + x, B, t->scale[2], t->bias[2]);
+		}
+		__m256i c0 = _mm256_packus_epi16(rgb ? R : B, zero);
+		__m256i c2 = _mm256_packus_epi16(rgb ? B : R, zero);
+		__m256i lo = _mm256_unpacklo_epi8(c0, _mm256_packus_epi16(G, zero));
+		__m256i hi = _mm256_unpacklo_epi8(c2, alpha);
+		__m256i q0 = _mm256_unpacklo_epi16(lo, hi);
+		__m256i q1 = _mm256_unpackhi_epi16(lo, hi);
+		__m256i p0 = _mm256_permute2x128_si256(q0, q1, 0x20);
+		__m256i p1 = _mm256_permute2x128_si256(q0, q1, 0x31);
+		if (packed24) {
+			uint8_t * d = dst + x * 3;
+			p0 = _mm256_shuffle_epi8(p0, compact);
+			p1 = _mm256_shuffle_epi8(p1, compact);
+			_mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(p0));
+			_mm_storeu_si128((__m128i *)(d + 12), _mm256_extracti128_si256(p0, 1));
+			_mm_storeu_si128((__m128i *)(d + 24), _mm256_castsi256_si128(p1));
+			_mm_storeu_si128((__m128i *)(d + 36), _mm256_extracti128_si256(p1, 1));
+		} else {
+			_mm256_storeu_si256((__m256i *)(dst + x * 4), p0);
+			_mm256_storeu_si256((__m256i *)(dst + x * 4 + 32), p1);
+		}
+	}
+	NV12ToRgbTail(y, uv, dst, x, width, layout, c, t);
+}
+
+void InitVideoConvertKernelsAVX2(VideoConvertKernels & k) {
+	k.split_uv8 = SplitUV8AVX2;
+	k.merge_uv8 = MergeUV8AVX2;
+	k.bgr24_to_nv12_row2 = BGR24ToNV12Row2AVX2;
+	k.bgra_to_nv12_row2 = BGRAToNV12Row2AVX2;
+	k.nv12_to_rgb_row = NV12ToRgbRowAVX2;
+	k.shift_row16 = ShiftRow16AVX2;
+	k.split_uv16 = SplitUV16AVX2;
+	k.pack10_row16 = Pack10Row16AVX2;
+	k.split_uv16_pack10 = SplitUV16Pack10AVX2;
+	k.dither_row16 = DitherRow16AVX2;
+	k.split_uv16_dither = SplitUV16DitherAVX2;
+}
+
+#pragma GCC pop_options
+
+#endif
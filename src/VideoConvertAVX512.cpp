@@ -0,0 +1,97 @@
+/*
+ * VideoConvertAVX512.cpp
+ *
+ *  AVX-512 (F + BW) row kernels, see VideoConvertKernels.h.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+#include <immintrin.h>
+
+#include "VideoConvertKernels.h"
+
+// The unmasked forms of permutexvar_epi64 and srli_epi32 pass an undefined
+// vector through, which gcc 12 reports as maybe uninitialized at -O2; the
+// zero masked forms with every lane set are the same instruction without it.
+
+static void SplitUV8AVX512(const uint8_t * uv, uint8_t * u, uint8_t * v, int n) {
+	const __m512i mask = _mm512_set1_epi16(0x00FF);
+	const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+	int x = 0;
+	for (; x + 64 <= n; x += 64) {
+		__m512i a = _mm512_loadu_si512((const void *)(uv + x * 2));
+		__m512i b = _mm512_loadu_si512((const void *)(uv + x * 2 + 64));
+		__m512i ou = _mm512_packus_epi16(_mm512_and_si512(a, mask), _mm512_and_si512(b, mask));
+		__m512i ov = _mm512_packus_epi16(_mm512_srli_epi16(a, 8), _mm512_srli_epi16(b, 8));
+		_mm512_storeu_si512((void *)(u + x), _mm512_maskz_permutexvar_epi64(0xFF, order, ou));
+		_mm512_storeu_si512((void *)(v + x), _mm512_maskz_permutexvar_epi64(0xFF, order, ov));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+}
+
+static void MergeUV8AVX512(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n) {
+	const __m512i order0 = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+	const __m512i order1 = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+	int x = 0;
+	for (; x + 64 <= n; x += 64) {
+		__m512i a = _mm512_loadu_si512((const void *)(u + x));
+		__m512i b = _mm512_loadu_si512((const void *)(v + x));
+		__m512i lo = _mm512_unpacklo_epi8(a, b);
+		__m512i hi = _mm512_unpackhi_epi8(a, b);
+		_mm512_storeu_si512((void *)(uv + x * 2), _mm512_permutex2var_epi64(lo, order0, hi));
+		_mm512_storeu_si512((void *)(uv + x * 2 + 64), _mm512_permutex2var_epi64(lo, order1, hi));
+	}
+	for (; x < n; x++) {
+		uv[x * 2] = u[x];
+		uv[x * 2 + 1] = v[x];
+	}
+}
+
+static void ShiftRow16AVX512(const uint16_t * src, uint16_t * dst, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m512i a = _mm512_loadu_si512((const void *)(src + x));
+		_mm512_storeu_si512((void *)(dst + x), _mm512_srl_epi16(a, shift));
+	}
+	for (; x < n; x++) {
+		dst[x] = src[x] >> rsh;
+	}
+}
+
+static void SplitUV16AVX512(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	const __m512i mask = _mm512_set1_epi32(0xFFFF);
+	const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m512i a = _mm512_loadu_si512((const void *)(uv + x * 2));
+		__m512i b = _mm512_loadu_si512((const void *)(uv + x * 2 + 32));
+		__m512i ou = _mm512_packus_epi32(_mm512_and_si512(a, mask), _mm512_and_si512(b, mask));
+		__m512i ov = _mm512_packus_epi32(_mm512_maskz_srli_epi32(0xFFFF, a, 16), _mm512_maskz_srli_epi32(0xFFFF, b, 16));
+		ou = _mm512_maskz_permutexvar_epi64(0xFF, order, ou);
+		ov = _mm512_maskz_permutexvar_epi64(0xFF, order, ov);
+		_mm512_storeu_si512((void *)(u + x), _mm512_srl_epi16(ou, shift));
+		_mm512_storeu_si512((void *)(v + x), _mm512_srl_epi16(ov, shift));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2] >> rsh;
+		v[x] = uv[x * 2 + 1] >> rsh;
+	}
+}
+
+void InitVideoConvertKernelsAVX512(VideoConvertKernels & k) {
+	k.split_uv8 = SplitUV8AVX512;
+	k.merge_uv8 = MergeUV8AVX512;
+	k.shift_row16 = ShiftRow16AVX512;
+	k.split_uv16 = SplitUV16AVX512;
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * VideoConvertKernels.h
+ *
+ *  Row kernels behind VideoConvert.h. Every ISA file overrides the entries it
+ *  implements, anything left untouched keeps the scalar version, so all levels
+ *  produce bit identical output.
+ */
+
+#ifndef SRC_VIDEOCONVERTKERNELS_H_
+#define SRC_VIDEOCONVERTKERNELS_H_
+
+#include <stdint.h>
+
+// RGB -> YCbCr weights in 1.14 fixed point, see GetRgbToYuvCoeffs
+struct RgbToYuvCoeffs {
+	int16_t yr, yg, yb;
+	int16_t ur, ug, ub;
+	int16_t vr, vg, vb;
+	int16_t y_offset;
+};
+
+// YCbCr -> RGB weights in 2.13 fixed point, see GetYuvToRgbCoeffs
+struct YuvToRgbCoeffs {
+	int16_t ky;
+	int16_t rv;
+	int16_t gu, gv;
+	int16_t bu;
+	int16_t y_offset;
+};
+
+enum {
+	RGB_LAYOUT_BGR,
+	RGB_LAYOUT_RGB,
+	RGB_LAYOUT_BGRA,
+	RGB_LAYOUT_RGBA
+};
+
+// one row of the optional float planes, scale/bias are in r, g, b order
+struct RgbTensorRow {
+	float * r;
+	float * g;
+	float * b;
+	float scale[3];
+	float bias[3];
+};
+
+struct VideoConvertKernels {
+	// u[i] = uv[2i], v[i] = uv[2i+1], n pairs
+	void (*split_uv8)(const uint8_t * uv, uint8_t * u, uint8_t * v, int n);
+	// uv[2i] = u[i], uv[2i+1] = v[i], n pairs
+	void (*merge_uv8)(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n);
+	// dst[i] = src[i] >> rsh
+	void (*shift_row16)(const uint16_t * src, uint16_t * dst, int n, int rsh);
+	// u[i] = uv[2i] >> rsh, v[i] = uv[2i+1] >> rsh, n pairs
+	void (*split_uv16)(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh);
+	// groups of 4 samples (src >> 6) packed into 5 bytes, see YUV420P10_PACKED
+	void (*pack10_row16)(const uint16_t * src, uint8_t * dst, int n);
+	void (*split_uv16_pack10)(const uint16_t * uv, uint8_t * u, uint8_t * v, int n);
+	// two rows of packed BGR (3 bytes) / BGRA (4 bytes) to two luma rows and
+	// one CbCr row averaged over 2x2 blocks
+	void (*bgr24_to_nv12_row2)(const uint8_t * src0, const uint8_t * src1,
+			uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c);
+	void (*bgra_to_nv12_row2)(const uint8_t * src0, const uint8_t * src1,
+			uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c);
+	// one NV12 row to packed RGB_LAYOUT_*, alpha is 255, t may be null
+	void (*nv12_to_rgb_row)(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int width, int layout,
+			const YuvToRgbCoeffs * c, const RgbTensorRow * t);
+	// dst[i] = min(255, (src[i] + dither[i & 3]) >> 8)
+	void (*dither_row16)(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither);
+	void (*split_uv16_dither)(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither);
+};
+
+// Scalar loops shared by the scalar kernels and the tails of the SIMD ones.
+// They have internal linkage on purpose: every ISA file is compiled for a
+// different target and must not hand its copy to the others.
+static inline void Pack10Group(const uint16_t * s, int step, int count, uint8_t * dst) {
+	uint64_t w = 0;
+	for (int i = 0; i < count; i++)
+		w |= (uint64_t)(s[i * step] >> 6) << (10 * i);
+	for (int b = 0; b < 5; b++)
+		dst[b] = (uint8_t)(w >> (8 * b));
+}
+
+static inline void Pack10Row16Tail(const uint16_t * src, uint8_t * dst, int n) {
+	for (int x = 0; x < n; x += 4)
+		Pack10Group(src + x, 1, n - x < 4 ? n - x : 4, dst + x / 4 * 5);
+}
+
+static inline void SplitUV16Pack10Tail(const uint16_t * uv, uint8_t * u, uint8_t * v, int n) {
+	for (int x = 0; x < n; x += 4) {
+		Pack10Group(uv + x * 2, 2, n - x < 4 ? n - x : 4, u + x / 4 * 5);
+		Pack10Group(uv + x * 2 + 1, 2, n - x < 4 ? n - x : 4, v + x / 4 * 5);
+	}
+}
+
+static inline uint8_t Dither16To8(uint16_t s, uint16_t d) {
+	unsigned int r = ((unsigned int)s + d) >> 8;
+	return (uint8_t)(r > 255 ? 255 : r);
+}
+
+// n counts from a multiple of 4 so the dither phase stays aligned
+static inline void Dither16Tail(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither) {
+	for (int x = 0; x < n; x++)
+		dst[x] = Dither16To8(src[x], dither[x & 3]);
+}
+
+static inline void SplitUV16DitherTail(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither) {
+	for (int x = 0; x < n; x++) {
+		u[x] = Dither16To8(uv[x * 2], dither[x & 3]);
+		v[x] = Dither16To8(uv[x * 2 + 1], dither[x & 3]);
+	}
+}
+
+static inline uint8_t ClampToByte(int v) {
+	return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline uint8_t RgbToY(int r, int g, int b, const RgbToYuvCoeffs * c) {
+	return ClampToByte(((c->yr * r + c->yg * g + c->yb * b + (1 << 13)) >> 14) + c->y_offset);
+}
+
+// starts at an even x, the last column of an odd width is averaged with itself
+static inline void BGRToNV12Row2Tail(const uint8_t * src0, const uint8_t * src1, int bpp,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int x, int width, const RgbToYuvCoeffs * c) {
+	for (; x < width; x += 2) {
+		int x1 = x + 1 < width ? x + 1 : x;
+		const uint8_t * p[4] = { src0 + x * bpp, src0 + x1 * bpp, src1 + x * bpp, src1 + x1 * bpp };
+		y0[x] = RgbToY(p[0][2], p[0][1], p[0][0], c);
+		y0[x1] = RgbToY(p[1][2], p[1][1], p[1][0], c);
+		y1[x] = RgbToY(p[2][2], p[2][1], p[2][0], c);
+		y1[x1] = RgbToY(p[3][2], p[3][1], p[3][0], c);
+		int b = (p[0][0] + p[1][0] + p[2][0] + p[3][0] + 2) >> 2;
+		int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+		int r = (p[0][2] + p[1][2] + p[2][2] + p[3][2] + 2) >> 2;
+		uv[x] = ClampToByte(((c->ur * r + c->ug * g + c->ub * b + (1 << 13)) >> 14) + 128);
+		uv[x + 1] = ClampToByte(((c->vr * r + c->vg * g + c->vb * b + (1 << 13)) >> 14) + 128);
+	}
+}
+
+static inline void NV12ToRgbTail(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int x, int width, int layout,
+		const YuvToRgbCoeffs * c, const RgbTensorRow * t) {
+	int bpp = layout >= RGB_LAYOUT_BGRA ? 4 : 3;
+	bool rgb = layout == RGB_LAYOUT_RGB || layout == RGB_LAYOUT_RGBA;
+	for (; x < width; x++) {
+		int yy = (y[x] - c->y_offset) * c->ky;
+		int u = uv[x & ~1] - 128;
+		int v = uv[(x & ~1) + 1] - 128;
+		uint8_t r = ClampToByte((yy + c->rv * v + (1 << 12)) >> 13);
+		uint8_t g = ClampToByte((yy + c->gu * u + c->gv * v + (1 << 12)) >> 13);
+		uint8_t b = ClampToByte((yy + c->bu * u + (1 << 12)) >> 13);
+		uint8_t * p = dst + x * bpp;
+		p[0] = rgb ? r : b;
+		p[1] = g;
+		p[2] = rgb ? b : r;
+		if (bpp == 4)
+			p[3] = 255;
+		if (t) {
+			t->r[x] = r * t->scale[0] + t->bias[0];
+			t->g[x] = g * t->scale[1] + t->bias[1];
+			t->b[x] = b * t->scale[2] + t->bias[2];
+		}
+	}
+}
+
+void InitVideoConvertKernelsScalar(VideoConvertKernels & k);
+#if defined(__x86_64__) || defined(__i386__)
+void InitVideoConvertKernelsSSE2(VideoConvertKernels & k);
+void InitVideoConvertKernelsAVX2(VideoConvertKernels & k);
+void InitVideoConvertKernelsAVX512(VideoConvertKernels & k);
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+void InitVideoConvertKernelsNEON(VideoConvertKernels & k);
+#endif
+
+#endif /* SRC_VIDEOCONVERTKERNELS_H_ */
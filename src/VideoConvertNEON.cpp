@@ -0,0 +1,274 @@
+/*
+ * VideoConvertNEON.cpp
+ *
+ *  NEON row kernels, see VideoConvertKernels.h.
+ */
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+#include "VideoConvertKernels.h"
+
+static void SplitUV8NEON(const uint8_t * uv, uint8_t * u, uint8_t * v, int n) {
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		uint8x16x2_t p = vld2q_u8(uv + x * 2);
+		vst1q_u8(u + x, p.val[0]);
+		vst1q_u8(v + x, p.val[1]);
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+}
+
+static void MergeUV8NEON(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n) {
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		uint8x16x2_t p;
+		p.val[0] = vld1q_u8(u + x);
+		p.val[1] = vld1q_u8(v + x);
+		vst2q_u8(uv + x * 2, p);
+	}
+	for (; x < n; x++) {
+		uv[x * 2] = u[x];
+		uv[x * 2 + 1] = v[x];
+	}
+}
+
+static void ShiftRow16NEON(const uint16_t * src, uint16_t * dst, int n, int rsh) {
+	const int16x8_t shift = vdupq_n_s16(-rsh);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		vst1q_u16(dst + x, vshlq_u16(vld1q_u16(src + x), shift));
+	}
+	for (; x < n; x++) {
+		dst[x] = src[x] >> rsh;
+	}
+}
+
+static void SplitUV16NEON(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh) {
+	const int16x8_t shift = vdupq_n_s16(-rsh);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		uint16x8x2_t p = vld2q_u16(uv + x * 2);
+		vst1q_u16(u + x, vshlq_u16(p.val[0], shift));
+		vst1q_u16(v + x, vshlq_u16(p.val[1], shift));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2] >> rsh;
+		v[x] = uv[x * 2 + 1] >> rsh;
+	}
+}
+
+// 8 samples -> two 40 bit groups in the low 5 bytes of each 64 bit lane
+static inline uint64x2_t Pack10x8(uint16x8_t s) {
+	uint32x4_t p = vreinterpretq_u32_u16(vshrq_n_u16(s, 6));
+	p = vorrq_u32(vandq_u32(p, vdupq_n_u32(0xFFFF)), vshlq_n_u32(vshrq_n_u32(p, 16), 10));
+	uint64x2_t q = vreinterpretq_u64_u32(p);
+	return vorrq_u64(vandq_u64(q, vdupq_n_u64(0xFFFFFFFF)), vshlq_n_u64(vshrq_n_u64(q, 32), 20));
+}
+
+// writes 13 bytes, the last 3 are zero and get overwritten by the next group
+static inline void Store10x8(uint8_t * dst, uint64x2_t q) {
+	vst1_u8(dst, vreinterpret_u8_u64(vget_low_u64(q)));
+	vst1_u8(dst + 5, vreinterpret_u8_u64(vget_high_u64(q)));
+}
+
+static void Pack10Row16NEON(const uint16_t * src, uint8_t * dst, int n) {
+	int x = 0;
+	for (; x + 8 < n; x += 8) {
+		Store10x8(dst + x / 4 * 5, Pack10x8(vld1q_u16(src + x)));
+	}
+	Pack10Row16Tail(src + x, dst + x / 4 * 5, n - x);
+}
+
+static void SplitUV16Pack10NEON(const uint16_t * uv, uint8_t * u, uint8_t * v, int n) {
+	int x = 0;
+	for (; x + 8 < n; x += 8) {
+		uint16x8x2_t p = vld2q_u16(uv + x * 2);
+		Store10x8(u + x / 4 * 5, Pack10x8(p.val[0]));
+		Store10x8(v + x / 4 * 5, Pack10x8(p.val[1]));
+	}
+	SplitUV16Pack10Tail(uv + x * 2, u + x / 4 * 5, v + x / 4 * 5, n - x);
+}
+
+static void DitherRow16NEON(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither) {
+	const uint16x8_t d = vcombine_u16(vld1_u16(dither), vld1_u16(dither));
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		vst1_u8(dst + x, vshrn_n_u16(vqaddq_u16(vld1q_u16(src + x), d), 8));
+	}
+	Dither16Tail(src + x, dst + x, n - x, dither);
+}
+
+static void SplitUV16DitherNEON(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither) {
+	const uint16x8_t d = vcombine_u16(vld1_u16(dither), vld1_u16(dither));
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		uint16x8x2_t p = vld2q_u16(uv + x * 2);
+		vst1_u8(u + x, vshrn_n_u16(vqaddq_u16(p.val[0], d), 8));
+		vst1_u8(v + x, vshrn_n_u16(vqaddq_u16(p.val[1], d), 8));
+	}
+	SplitUV16DitherTail(uv + x * 2, u + x, v + x, n - x, dither);
+}
+
+static inline uint8x8_t Luma8(int16x8_t B, int16x8_t G, int16x8_t R, const RgbToYuvCoeffs * c) {
+	int32x4_t lo = vdupq_n_s32(1 << 13);
+	int32x4_t hi = vdupq_n_s32(1 << 13);
+	lo = vmlal_n_s16(lo, vget_low_s16(R), c->yr);
+	lo = vmlal_n_s16(lo, vget_low_s16(G), c->yg);
+	lo = vmlal_n_s16(lo, vget_low_s16(B), c->yb);
+	hi = vmlal_n_s16(hi, vget_high_s16(R), c->yr);
+	hi = vmlal_n_s16(hi, vget_high_s16(G), c->yg);
+	hi = vmlal_n_s16(hi, vget_high_s16(B), c->yb);
+	lo = vaddq_s32(vshrq_n_s32(lo, 14), vdupq_n_s32(c->y_offset));
+	hi = vaddq_s32(vshrq_n_s32(hi, 14), vdupq_n_s32(c->y_offset));
+	return vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+}
+
+// sum of two rows -> 2x2 block average as 32 bit
+static inline int32x4_t Average2x2(int16x8_t s0, int16x8_t s1) {
+	return vshrq_n_s32(vaddq_s32(vpaddlq_s16(vaddq_s16(s0, s1)), vdupq_n_s32(2)), 2);
+}
+
+static inline int16x4_t ChromaPair(int32x4_t r, int32x4_t g, int32x4_t b, int cr, int cg, int cb) {
+	int32x4_t t = vdupq_n_s32(1 << 13);
+	t = vmlaq_n_s32(t, r, cr);
+	t = vmlaq_n_s32(t, g, cg);
+	t = vmlaq_n_s32(t, b, cb);
+	return vqmovn_s32(vaddq_s32(vshrq_n_s32(t, 14), vdupq_n_s32(128)));
+}
+
+// 2x8 pixels -> 4 interleaved CbCr pairs
+static inline uint8x8_t Chroma4(int16x8_t B0, int16x8_t G0, int16x8_t R0, int16x8_t B1, int16x8_t G1, int16x8_t R1,
+		const RgbToYuvCoeffs * c) {
+	int32x4_t b = Average2x2(B0, B1);
+	int32x4_t g = Average2x2(G0, G1);
+	int32x4_t r = Average2x2(R0, R1);
+	int16x4x2_t uv = vzip_s16(ChromaPair(r, g, b, c->ur, c->ug, c->ub), ChromaPair(r, g, b, c->vr, c->vg, c->vb));
+	return vqmovun_s16(vcombine_s16(uv.val[0], uv.val[1]));
+}
+
+static inline int16x8_t Widen(uint8x8_t v) {
+	return vreinterpretq_s16_u16(vmovl_u8(v));
+}
+
+static void BGR24ToNV12Row2NEON(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		uint8x8x3_t p0 = vld3_u8(src0 + x * 3);
+		uint8x8x3_t p1 = vld3_u8(src1 + x * 3);
+		int16x8_t B0 = Widen(p0.val[0]), G0 = Widen(p0.val[1]), R0 = Widen(p0.val[2]);
+		int16x8_t B1 = Widen(p1.val[0]), G1 = Widen(p1.val[1]), R1 = Widen(p1.val[2]);
+		vst1_u8(y0 + x, Luma8(B0, G0, R0, c));
+		vst1_u8(y1 + x, Luma8(B1, G1, R1, c));
+		vst1_u8(uv + x, Chroma4(B0, G0, R0, B1, G1, R1, c));
+	}
+	BGRToNV12Row2Tail(src0, src1, 3, y0, y1, uv, x, width, c);
+}
+
+static void BGRAToNV12Row2NEON(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		uint8x8x4_t p0 = vld4_u8(src0 + x * 4);
+		uint8x8x4_t p1 = vld4_u8(src1 + x * 4);
+		int16x8_t B0 = Widen(p0.val[0]), G0 = Widen(p0.val[1]), R0 = Widen(p0.val[2]);
+		int16x8_t B1 = Widen(p1.val[0]), G1 = Widen(p1.val[1]), R1 = Widen(p1.val[2]);
+		vst1_u8(y0 + x, Luma8(B0, G0, R0, c));
+		vst1_u8(y1 + x, Luma8(B1, G1, R1, c));
+		vst1_u8(uv + x, Chroma4(B0, G0, R0, B1, G1, R1, c));
+	}
+	BGRToNV12Row2Tail(src0, src1, 4, y0, y1, uv, x, width, c);
+}
+
+// luma terms of 4 pixels + their chroma terms -> 16 bit
+static inline int16x4_t RgbChannel4(int32x4_t y, int32x4_t c) {
+	return vqmovn_s32(vshrq_n_s32(vaddq_s32(y, c), 13));
+}
+
+// 8 chroma terms -> clamped channel of 16 pixels
+static inline uint8x16_t RgbChannel16(const int32x4_t * y, int32x4_t clo, int32x4_t chi) {
+	int32x4x2_t l = vzipq_s32(clo, clo);
+	int32x4x2_t h = vzipq_s32(chi, chi);
+	uint8x8_t a = vqmovun_s16(vcombine_s16(RgbChannel4(y[0], l.val[0]), RgbChannel4(y[1], l.val[1])));
+	uint8x8_t b = vqmovun_s16(vcombine_s16(RgbChannel4(y[2], h.val[0]), RgbChannel4(y[3], h.val[1])));
+	return vcombine_u8(a, b);
+}
+
+static inline void StoreTensor16(float * dst, uint8x16_t s, float scale, float bias) {
+	float32x4_t k = vdupq_n_f32(scale);
+	float32x4_t b = vdupq_n_f32(bias);
+	uint16x8_t lo = vmovl_u8(vget_low_u8(s));
+	uint16x8_t hi = vmovl_u8(vget_high_u8(s));
+	vst1q_f32(dst, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), k), b));
+	vst1q_f32(dst + 4, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), k), b));
+	vst1q_f32(dst + 8, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), k), b));
+	vst1q_f32(dst + 12, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), k), b));
+}
+
+static void NV12ToRgbRowNEON(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int width, int layout,
+		const YuvToRgbCoeffs * c, const RgbTensorRow * t) {
+	const int32x4_t round = vdupq_n_s32(1 << 12);
+	bool rgb = layout == RGB_LAYOUT_RGB || layout == RGB_LAYOUT_RGBA;
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t py = vld1q_u8(y + x);
+		int16x8_t Y0 = vsubq_s16(Widen(vget_low_u8(py)), vdupq_n_s16(c->y_offset));
+		int16x8_t Y1 = vsubq_s16(Widen(vget_high_u8(py)), vdupq_n_s16(c->y_offset));
+		int32x4_t yt[4];
+		yt[0] = vmull_n_s16(vget_low_s16(Y0), c->ky);
+		yt[1] = vmull_n_s16(vget_high_s16(Y0), c->ky);
+		yt[2] = vmull_n_s16(vget_low_s16(Y1), c->ky);
+		yt[3] = vmull_n_s16(vget_high_s16(Y1), c->ky);
+		uint8x8x2_t p = vld2_u8(uv + x);
+		int16x8_t U = vsubq_s16(Widen(p.val[0]), vdupq_n_s16(128));
+		int16x8_t V = vsubq_s16(Widen(p.val[1]), vdupq_n_s16(128));
+		uint8x16_t R = RgbChannel16(yt, vmlal_n_s16(round, vget_low_s16(V), c->rv),
+				vmlal_n_s16(round, vget_high_s16(V), c->rv));
+		uint8x16_t G = RgbChannel16(yt,
+				vmlal_n_s16(vmlal_n_s16(round, vget_low_s16(U), c->gu), vget_low_s16(V), c->gv),
+				vmlal_n_s16(vmlal_n_s16(round, vget_high_s16(U), c->gu), vget_high_s16(V), c->gv));
+		uint8x16_t B = RgbChannel16(yt, vmlal_n_s16(round, vget_low_s16(U), c->bu),
+				vmlal_n_s16(round, vget_high_s16(U), c->bu));
+		if (t) {
+			StoreTensor16(t->r + x, R, t->scale[0], t->bias[0]);
+			StoreTensor16(t->g + x, G, t->scale[1], t->bias[1]);
+			StoreTensor16(t->b + x, B, t->scale[2], t->bias[2]);
+		}
+		if (layout < RGB_LAYOUT_BGRA) {
+			uint8x16x3_t o;
+			o.val[0] = rgb ? R : B;
+			o.val[1] = G;
+			o.val[2] = rgb ? B : R;
+			vst3q_u8(dst + x * 3, o);
+		} else {
+			uint8x16x4_t o;
+			o.val[0] = rgb ? R : B;
+			o.val[1] = G;
+			o.val[2] = rgb ? B : R;
+			o.val[3] = vdupq_n_u8(255);
+			vst4q_u8(dst + x * 4, o);
+		}
+	}
+	NV12ToRgbTail(y, uv, dst, x, width, layout, c, t);
+}
+
+void InitVideoConvertKernelsNEON(VideoConvertKernels & k) {
+	k.split_uv8 = SplitUV8NEON;
+	k.merge_uv8 = MergeUV8NEON;
+	k.bgr24_to_nv12_row2 = BGR24ToNV12Row2NEON;
+	k.bgra_to_nv12_row2 = BGRAToNV12Row2NEON;
+	k.nv12_to_rgb_row = NV12ToRgbRowNEON;
+	k.shift_row16 = ShiftRow16NEON;
+	k.split_uv16 = SplitUV16NEON;
+	k.pack10_row16 = Pack10Row16NEON;
+	k.split_uv16_pack10 = SplitUV16Pack10NEON;
+	k.dither_row16 = DitherRow16NEON;
+	k.split_uv16_dither = SplitUV16DitherNEON;
+}
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * VideoConvertPool.cpp
+ *
+ *  Worker threads that run a frame conversion as parallel row bands.
+ */
+
+#include "VideoConvertPool.h"
+
+#include <system_error>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// source bytes per band, roughly half of a typical per-core L2
+static const int kBandBytes = 256 * 1024;
+
+bool SetThreadAffinity(std::thread & thread, int cpu) {
+	if (cpu < 0)
+		return false;
+#ifdef _WIN32
+	if (cpu >= (int)sizeof(DWORD_PTR) * 8)
+		return false;
+	return SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu) != 0;
+#else
+	if (cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#endif
+}
+
+VideoConvertPool::~VideoConvertPool() {
+	Stop();
+}
+
+bool VideoConvertPool::Start(int workers, const int * cpus, int cpu_count) {
+	Stop();
+	if (workers <= 0)
+		workers = std::thread::hardware_concurrency();
+	if (workers <= 0)
+		workers = 1;
+
+	m_exit = false;
+	m_worker_count = workers;
+	try {
+		for (int i = 0; i < workers; i++) {
+			m_workers.push_back(std::thread(&VideoConvertPool::WorkerLoop, this, i));
+			if (cpus && cpu_count > 0 && !SetThreadAffinity(m_workers.back(), cpus[i % cpu_count])) {
+				Stop();
+				return false;
+			}
+		}
+	} catch (const std::system_error &) {
+		Stop();
+		return false;
+	}
+	return true;
+}
+
+void VideoConvertPool::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+	m_start_cond.notify_all();
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		m_workers[i].join();
+	}
+	m_workers.clear();
+	m_worker_count = 0;
+}
+
+void VideoConvertPool::Run(int count, const std::function<void(int)> & fn) {
+	if (m_worker_count == 0) {
+		for (int i = 0; i < count; i++) {
+			fn(i);
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_task = &fn;
+	m_task_count = count;
+	m_pending = m_worker_count;
+	m_generation++;
+	m_start_cond.notify_all();
+	m_done_cond.wait(lock, [this] { return m_pending == 0; });
+	m_task = nullptr;
+}
+
+int VideoConvertPool::GetBandRows(int row_bytes, int height, int workers) {
+	int rows = row_bytes > 0 ? kBandBytes / row_bytes : height;
+	if (workers > 1) {
+		int per_worker = (height + workers - 1) / workers;
+		if (rows > per_worker)
+			rows = per_worker;
+	}
+	rows = (rows + 7) & ~7;
+	return rows < 8 ? 8 : rows;
+}
+
+void VideoConvertPool::WorkerLoop(int index) {
+	uint64_t generation = 0;
+	for (;;) {
+		const std::function<void(int)> * task;
+		int count;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start_cond.wait(lock, [&] { return m_exit || m_generation != generation; });
+			if (m_exit)
+				return;
+			generation = m_generation;
+			task = m_task;
+			count = m_task_count;
+		}
+		for (int i = index; i < count; i += m_worker_count) {
+			(*task)(i);
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_pending == 0)
+				m_done_cond.notify_one();
+		}
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * VideoConvertPool.h
+ *
+ *  Worker threads that run a frame conversion as parallel row bands.
+ */
+
+#ifndef SRC_VIDEOCONVERTPOOL_H_
+#define SRC_VIDEOCONVERTPOOL_H_
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+// Pins a thread to one cpu, false if the cpu cannot be used.
+bool SetThreadAffinity(std::thread & thread, int cpu);
+
+class VideoConvertPool {
+public:
+	VideoConvertPool() = default;
+	~VideoConvertPool();
+	VideoConvertPool(const VideoConvertPool &) = delete;
+	VideoConvertPool & operator=(const VideoConvertPool &) = delete;
+
+	// workers <= 0 uses one per hardware thread. When cpus is given worker i
+	// is pinned to cpus[i % cpu_count], fails if a cpu cannot be used.
+	bool Start(int workers, const int * cpus = nullptr, int cpu_count = 0);
+	void Stop();
+	int GetWorkerCount() const { return m_worker_count; }
+
+	// Runs fn(0) .. fn(count - 1) and returns once all of them are done.
+	// Band i always goes to worker i % GetWorkerCount(), so a band keeps its
+	// cpu from frame to frame. Without workers it runs on the calling thread.
+	// Not reentrant, one Run at a time.
+	void Run(int count, const std::function<void(int)> & fn);
+
+	// Band height for rows of row_bytes: about one L2 sized chunk, a multiple
+	// of 8 rows (keeps chroma rows and the 4x4 dither phase aligned) and small
+	// enough that every worker gets a band.
+	static int GetBandRows(int row_bytes, int height, int workers);
+
+private:
+	void WorkerLoop(int index);
+
+	std::vector<std::thread> m_workers;
+	int m_worker_count = 0;
+	std::mutex m_mutex;
+	std::condition_variable m_start_cond;
+	std::condition_variable m_done_cond;
+	const std::function<void(int)> * m_task = nullptr;
+	int m_task_count = 0;
+	int m_pending = 0;
+	uint64_t m_generation = 0;
+	bool m_exit = false;
+};
+
+#endif /* SRC_VIDEOCONVERTPOOL_H_ */
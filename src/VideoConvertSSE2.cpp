@@ -0,0 +1,312 @@
+/*
+ * VideoConvertSSE2.cpp
+ *
+ *  SSE2 row kernels, see VideoConvertKernels.h.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#include <emmintrin.h>
+
+#include "VideoConvertKernels.h"
+
+static void SplitUV8SSE2(const uint8_t * uv, uint8_t * u, uint8_t * v, int n) {
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(uv + x * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(uv + x * 2 + 16));
+		__m128i ou = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+		__m128i ov = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i *)(u + x), ou);
+		_mm_storeu_si128((__m128i *)(v + x), ov);
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2];
+		v[x] = uv[x * 2 + 1];
+	}
+}
+
+static void MergeUV8SSE2(const uint8_t * u, const uint8_t * v, uint8_t * uv, int n) {
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(u + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(v + x));
+		_mm_storeu_si128((__m128i *)(uv + x * 2), _mm_unpacklo_epi8(a, b));
+		_mm_storeu_si128((__m128i *)(uv + x * 2 + 16), _mm_unpackhi_epi8(a, b));
+	}
+	for (; x < n; x++) {
+		uv[x * 2] = u[x];
+		uv[x * 2 + 1] = v[x];
+	}
+}
+
+static void ShiftRow16SSE2(const uint16_t * src, uint16_t * dst, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_srl_epi16(a, shift));
+	}
+	for (; x < n; x++) {
+		dst[x] = src[x] >> rsh;
+	}
+}
+
+// [u0 v0 u1 v1 u2 v2 u3 v3] -> [u0 u1 u2 u3 v0 v1 v2 v3]
+static inline __m128i DeinterleaveEpi16(__m128i a) {
+	a = _mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 1, 2, 0));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void SplitUV16SSE2(const uint16_t * uv, uint16_t * u, uint16_t * v, int n, int rsh) {
+	const __m128i shift = _mm_cvtsi32_si128(rsh);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m128i a = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2)));
+		__m128i b = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2 + 8)));
+		_mm_storeu_si128((__m128i *)(u + x), _mm_srl_epi16(_mm_unpacklo_epi64(a, b), shift));
+		_mm_storeu_si128((__m128i *)(v + x), _mm_srl_epi16(_mm_unpackhi_epi64(a, b), shift));
+	}
+	for (; x < n; x++) {
+		u[x] = uv[x * 2] >> rsh;
+		v[x] = uv[x * 2 + 1] >> rsh;
+	}
+}
+
+// 8 samples -> two 40 bit groups in the low 5 bytes of each 64 bit lane
+static inline __m128i Pack10x8(__m128i s) {
+	const __m128i lo = _mm_set_epi32(0, -1, 0, -1);
+	__m128i p = _mm_madd_epi16(_mm_srli_epi16(s, 6), _mm_set1_epi32(0x04000001));
+	return _mm_or_si128(_mm_and_si128(p, lo), _mm_srli_epi64(_mm_andnot_si128(lo, p), 12));
+}
+
+// writes 13 bytes, the last 3 are zero and get overwritten by the next group
+static inline void Store10x8(uint8_t * dst, __m128i q) {
+	_mm_storel_epi64((__m128i *)dst, q);
+	_mm_storel_epi64((__m128i *)(dst + 5), _mm_unpackhi_epi64(q, q));
+}
+
+static void Pack10Row16SSE2(const uint16_t * src, uint8_t * dst, int n) {
+	int x = 0;
+	for (; x + 8 < n; x += 8) {
+		Store10x8(dst + x / 4 * 5, Pack10x8(_mm_loadu_si128((const __m128i *)(src + x))));
+	}
+	Pack10Row16Tail(src + x, dst + x / 4 * 5, n - x);
+}
+
+static void SplitUV16Pack10SSE2(const uint16_t * uv, uint8_t * u, uint8_t * v, int n) {
+	int x = 0;
+	for (; x + 8 < n; x += 8) {
+		__m128i a = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2)));
+		__m128i b = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2 + 8)));
+		Store10x8(u + x / 4 * 5, Pack10x8(_mm_unpacklo_epi64(a, b)));
+		Store10x8(v + x / 4 * 5, Pack10x8(_mm_unpackhi_epi64(a, b)));
+	}
+	SplitUV16Pack10Tail(uv + x * 2, u + x / 4 * 5, v + x / 4 * 5, n - x);
+}
+
+static inline __m128i LoadDither(const uint16_t * dither) {
+	__m128i d = _mm_loadl_epi64((const __m128i *)dither);
+	return _mm_unpacklo_epi64(d, d);
+}
+
+static inline __m128i Dither16x16(__m128i a, __m128i b, __m128i d) {
+	a = _mm_srli_epi16(_mm_adds_epu16(a, d), 8);
+	b = _mm_srli_epi16(_mm_adds_epu16(b, d), 8);
+	return _mm_packus_epi16(a, b);
+}
+
+static void DitherRow16SSE2(const uint16_t * src, uint8_t * dst, int n, const uint16_t * dither) {
+	const __m128i d = LoadDither(dither);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + x + 8));
+		_mm_storeu_si128((__m128i *)(dst + x), Dither16x16(a, b, d));
+	}
+	Dither16Tail(src + x, dst + x, n - x, dither);
+}
+
+static void SplitUV16DitherSSE2(const uint16_t * uv, uint8_t * u, uint8_t * v, int n, const uint16_t * dither) {
+	const __m128i d = LoadDither(dither);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i a = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2)));
+		__m128i b = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2 + 8)));
+		__m128i c = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2 + 16)));
+		__m128i e = DeinterleaveEpi16(_mm_loadu_si128((const __m128i *)(uv + x * 2 + 24)));
+		_mm_storeu_si128((__m128i *)(u + x), Dither16x16(_mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(c, e), d));
+		_mm_storeu_si128((__m128i *)(v + x), Dither16x16(_mm_unpackhi_epi64(a, b), _mm_unpackhi_epi64(c, e), d));
+	}
+	SplitUV16DitherTail(uv + x * 2, u + x, v + x, n - x, dither);
+}
+
+// 1.14 weights as 16 bit pairs for madd: [b, g] and [r, 1] (the 1 picks up the rounding term)
+struct RgbToYuvVec {
+	__m128i ybg, yr1, ubg, ur1, vbg, vr1, yoff;
+};
+
+static inline __m128i WeightPair(int lo, int hi) {
+	return _mm_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+static inline void LoadRgbToYuvVec(const RgbToYuvCoeffs * c, RgbToYuvVec & w) {
+	w.ybg = WeightPair(c->yb, c->yg);
+	w.yr1 = WeightPair(c->yr, 1 << 13);
+	w.ubg = WeightPair(c->ub, c->ug);
+	w.ur1 = WeightPair(c->ur, 1 << 13);
+	w.vbg = WeightPair(c->vb, c->vg);
+	w.vr1 = WeightPair(c->vr, 1 << 13);
+	w.yoff = _mm_set1_epi32(c->y_offset);
+}
+
+// dwords [B G R x] of 8 pixels -> 16 bit B, G and R
+static inline void BGRAToPlanar16(__m128i a, __m128i b, __m128i & B, __m128i & G, __m128i & R) {
+	const __m128i ff = _mm_set1_epi32(0xFF);
+	B = _mm_packs_epi32(_mm_and_si128(a, ff), _mm_and_si128(b, ff));
+	G = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), ff), _mm_and_si128(_mm_srli_epi32(b, 8), ff));
+	R = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), ff), _mm_and_si128(_mm_srli_epi32(b, 16), ff));
+}
+
+static inline __m128i Luma8(__m128i B, __m128i G, __m128i R, const RgbToYuvVec & w) {
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(B, G), w.ybg),
+			_mm_madd_epi16(_mm_unpacklo_epi16(R, one), w.yr1));
+	__m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(B, G), w.ybg),
+			_mm_madd_epi16(_mm_unpackhi_epi16(R, one), w.yr1));
+	lo = _mm_add_epi32(_mm_srai_epi32(lo, 14), w.yoff);
+	hi = _mm_add_epi32(_mm_srai_epi32(hi, 14), w.yoff);
+	return _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+}
+
+// sum of two rows -> 2x2 block average as 32 bit
+static inline __m128i Average2x2(__m128i s0, __m128i s1) {
+	__m128i s = _mm_madd_epi16(_mm_add_epi16(s0, s1), _mm_set1_epi16(1));
+	return _mm_srli_epi32(_mm_add_epi32(s, _mm_set1_epi32(2)), 2);
+}
+
+static inline __m128i ChromaPair(__m128i bg, __m128i r1, __m128i wbg, __m128i wr1) {
+	__m128i t = _mm_add_epi32(_mm_madd_epi16(bg, wbg), _mm_madd_epi16(r1, wr1));
+	return _mm_add_epi32(_mm_srai_epi32(t, 14), _mm_set1_epi32(128));
+}
+
+// 2x8 pixels -> 4 interleaved CbCr pairs in the low 8 bytes
+static inline __m128i Chroma4(__m128i B0, __m128i G0, __m128i R0, __m128i B1, __m128i G1, __m128i R1,
+		const RgbToYuvVec & w) {
+	__m128i b = Average2x2(B0, B1);
+	__m128i g = Average2x2(G0, G1);
+	__m128i r = Average2x2(R0, R1);
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi32(g, 16));
+	__m128i r1 = _mm_or_si128(r, _mm_set1_epi32(1 << 16));
+	__m128i u = ChromaPair(bg, r1, w.ubg, w.ur1);
+	__m128i v = ChromaPair(bg, r1, w.vbg, w.vr1);
+	__m128i uv = _mm_packs_epi32(_mm_unpacklo_epi32(u, v), _mm_unpackhi_epi32(u, v));
+	return _mm_packus_epi16(uv, _mm_setzero_si128());
+}
+
+static void BGRAToNV12Row2SSE2(const uint8_t * src0, const uint8_t * src1,
+		uint8_t * y0, uint8_t * y1, uint8_t * uv, int width, const RgbToYuvCoeffs * c) {
+	RgbToYuvVec w;
+	LoadRgbToYuvVec(c, w);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i B0, G0, R0, B1, G1, R1;
+		BGRAToPlanar16(_mm_loadu_si128((const __m128i *)(src0 + x * 4)),
+				_mm_loadu_si128((const __m128i *)(src0 + x * 4 + 16)), B0, G0, R0);
+		BGRAToPlanar16(_mm_loadu_si128((const __m128i *)(src1 + x * 4)),
+				_mm_loadu_si128((const __m128i *)(src1 + x * 4 + 16)), B1, G1, R1);
+		_mm_storel_epi64((__m128i *)(y0 + x), Luma8(B0, G0, R0, w));
+		_mm_storel_epi64((__m128i *)(y1 + x), Luma8(B1, G1, R1, w));
+		_mm_storel_epi64((__m128i *)(uv + x), Chroma4(B0, G0, R0, B1, G1, R1, w));
+	}
+	BGRToNV12Row2Tail(src0, src1, 4, y0, y1, uv, x, width, c);
+}
+
+// 2.13 weights: [ky, 0] for luma, [u, v] pairs for the chroma terms of r, g and b
+struct YuvToRgbVec {
+	__m128i ky, rc, gc, bc, yoff, round;
+};
+
+static inline void LoadYuvToRgbVec(const YuvToRgbCoeffs * c, YuvToRgbVec & w) {
+	w.ky = WeightPair(c->ky, 0);
+	w.rc = WeightPair(0, c->rv);
+	w.gc = WeightPair(c->gu, c->gv);
+	w.bc = WeightPair(c->bu, 0);
+	w.yoff = _mm_set1_epi16(c->y_offset);
+	w.round = _mm_set1_epi32(1 << 12);
+}
+
+// luma terms of 8 pixels + chroma terms of their 4 CbCr pairs -> clamped 16 bit
+static inline __m128i RgbChannel8(__m128i ylo, __m128i yhi, __m128i c) {
+	__m128i lo = _mm_srai_epi32(_mm_add_epi32(ylo, _mm_unpacklo_epi32(c, c)), 13);
+	__m128i hi = _mm_srai_epi32(_mm_add_epi32(yhi, _mm_unpackhi_epi32(c, c)), 13);
+	__m128i s = _mm_packs_epi32(lo, hi);
+	return _mm_min_epi16(_mm_max_epi16(s, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+static inline void StoreTensor8(float * dst, __m128i s, float scale, float bias) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128 k = _mm_set1_ps(scale);
+	__m128 b = _mm_set1_ps(bias);
+	_mm_storeu_ps(dst, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(s, zero)), k), b));
+	_mm_storeu_ps(dst + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(s, zero)), k), b));
+}
+
+static void NV12ToRgbRowSSE2(const uint8_t * y, const uint8_t * uv, uint8_t * dst, int width, int layout,
+		const YuvToRgbCoeffs * c, const RgbTensorRow * t) {
+	// packed 24 bit output needs a byte shuffle, it stays scalar below AVX2
+	if (layout < RGB_LAYOUT_BGRA) {
+		NV12ToRgbTail(y, uv, dst, 0, width, layout, c, t);
+		return;
+	}
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi8(-1);
+	bool rgb = layout == RGB_LAYOUT_RGB || layout == RGB_LAYOUT_RGBA;
+	YuvToRgbVec w;
+	LoadYuvToRgbVec(c, w);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i Y = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + x)), zero), w.yoff);
+		__m128i ylo = _mm_madd_epi16(_mm_unpacklo_epi16(Y, zero), w.ky);
+		__m128i yhi = _mm_madd_epi16(_mm_unpackhi_epi16(Y, zero), w.ky);
+		__m128i UV = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(uv + x)), zero),
+				_mm_set1_epi16(128));
+		__m128i R = RgbChannel8(ylo, yhi, _mm_add_epi32(_mm_madd_epi16(UV, w.rc), w.round));
+		__m128i G = RgbChannel8(ylo, yhi, _mm_add_epi32(_mm_madd_epi16(UV, w.gc), w.round));
+		__m128i B = RgbChannel8(ylo, yhi, _mm_add_epi32(_mm_madd_epi16(UV, w.bc), w.round));
+		if (t) {
+			StoreTensor8(t->r + x, R, t->scale[0], t->bias[0]);
+			StoreTensor8(t->g + x, G, t->scale[1], t->bias[1]);
+			StoreTensor8(t->b + x, B, t->scale[2], t->bias[2]);
+		}
+		__m128i c0 = _mm_packus_epi16(rgb ? R : B, zero);
+		__m128i c2 = _mm_packus_epi16(rgb ? B : R, zero);
+		__m128i lo = _mm_unpacklo_epi8(c0, _mm_packus_epi16(G, zero));
+		__m128i hi = _mm_unpacklo_epi8(c2, alpha);
+		_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_unpacklo_epi16(lo, hi));
+		_mm_storeu_si128((__m128i *)(dst + x * 4 + 16), _mm_unpackhi_epi16(lo, hi));
+	}
+	NV12ToRgbTail(y, uv, dst, x, width, layout, c, t);
+}
+
+void InitVideoConvertKernelsSSE2(VideoConvertKernels & k) {
+	k.split_uv8 = SplitUV8SSE2;
+	k.merge_uv8 = MergeUV8SSE2;
+	// packed 24 bit BGR needs a byte shuffle, it stays scalar below AVX2
+	k.bgra_to_nv12_row2 = BGRAToNV12Row2SSE2;
+	k.nv12_to_rgb_row = NV12ToRgbRowSSE2;
+	k.shift_row16 = ShiftRow16SSE2;
+	k.split_uv16 = SplitUV16SSE2;
+	k.pack10_row16 = Pack10Row16SSE2;
+	k.split_uv16_pack10 = SplitUV16Pack10SSE2;
+	k.dither_row16 = DitherRow16SSE2;
+	k.split_uv16_dither = SplitUV16DitherSSE2;
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * VideoTranscoder.cpp
+ *
+ *  Decodes into NVENC without copying: decoder surfaces stay mapped and are
+ *  encoded in place.
+ */
+
+#include "VideoTranscoder.h"
+
+// surfaces mapped at once, so frames between decoder and encoder
+static const int kTranscodeOutputSurfaces = 8;
+
+VideoTranscoder::~VideoTranscoder() {
+	m_encoder.Stop();
+}
+
+bool VideoTranscoder::Start(VideoDecodeParam & decode, VideoParam & encode, VideoBitstreamCB cb, void * user_data) {
+	decode.download_gpu_buffer = false;
+	decode.retain_device_frames = true;
+	if (decode.output_surfaces <= 0)
+		decode.output_surfaces = kTranscodeOutputSurfaces;
+	m_encode_param = encode;
+	m_encode_param.async_output = true;
+	m_cb = cb;
+	m_user_data = user_data;
+	m_encoder_started = false;
+	m_encoder_failed = false;
+	return m_decoder.Start(decode, OnFrame, this);
+}
+
+int VideoTranscoder::InputData(MediaDataBitStream & bs) {
+	return m_decoder.InputData(bs);
+}
+
+bool VideoTranscoder::Stop() {
+	bool ok = m_decoder.Stop();
+	m_encoder.Stop();
+	m_encoder_started = false;
+	m_encoder_failed = false;
+	return ok;
+}
+
+void VideoTranscoder::OnFrame(VideoRawData & data, void * user_data) {
+	VideoTranscoder * obj = (VideoTranscoder *)user_data;
+	if (!obj->m_encoder_started && !obj->m_encoder_failed) {
+		VideoParam & param = obj->m_encode_param;
+		if (param.width <= 0 || param.height <= 0) {
+			param.width = data.width;
+			param.height = data.height;
+		}
+		param.device_id = obj->m_decoder.GetDevice();
+		obj->m_encoder_started = obj->m_encoder.Start(param, obj->m_cb, obj->m_user_data);
+		obj->m_encoder_failed = !obj->m_encoder_started;
+	}
+	if (!obj->m_encoder_started || !obj->m_encoder.InputData(data)) {
+		if (data.release)
+			data.release(data.release_ctx);
+	}
+}
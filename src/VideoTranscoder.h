@@ -0,0 +1,53 @@
+/*
+ * VideoTranscoder.h
+ *
+ *  Decodes into NVENC without copying: decoder surfaces stay mapped and are
+ *  encoded in place.
+ */
+
+#ifndef SRC_VIDEOTRANSCODER_H_
+#define SRC_VIDEOTRANSCODER_H_
+
+#include "MediaDef.h"
+#include "NvVideoDecoder.h"
+#include "NvVideoEncoder.h"
+
+// The decoder retains its frames and the encoder, on the same GPU and so the
+// same pooled context, registers the surfaces and encodes from them; a
+// surface is released once its bitstream is retrieved. Bitstreams are
+// retrieved on the encoder's output thread, which also keeps the decoder
+// from waiting on a surface that only the next InputData would free.
+class VideoTranscoder {
+public:
+	VideoTranscoder() = default;
+	~VideoTranscoder();
+	VideoTranscoder(const VideoTranscoder &) = delete;
+	VideoTranscoder & operator=(const VideoTranscoder &) = delete;
+
+	// decode.download_gpu_buffer, decode.retain_device_frames,
+	// encode.device_id and encode.async_output are set here. An encode size
+	// of 0 takes the decoded size; the encoder starts with the first frame.
+	// If that fails, the remaining frames are dropped until the next Start.
+	// Frames of another size than the encoder's are copied.
+	bool Start(VideoDecodeParam & decode, VideoParam & encode, VideoBitstreamCB cb, void * user_data);
+	int InputData(MediaDataBitStream & bs);
+	// flushes the decoder into the encoder, then the encoder
+	bool Stop();
+
+	const VideoDecodeStats & GetDecodeStats() const { return m_decoder.GetStats(); }
+	VideoEncodeStats GetEncodeStats() { return m_encoder.GetStats(); }
+
+private:
+	static void OnFrame(VideoRawData & data, void * user_data);
+
+	// the encoder goes first on destruction, it releases decoder surfaces
+	NvVideoDecoder m_decoder;
+	NvVideoEncoder m_encoder;
+	VideoParam m_encode_param;
+	VideoBitstreamCB m_cb = nullptr;
+	void * m_user_data = nullptr;
+	bool m_encoder_started = false;
+	bool m_encoder_failed = false;
+};
+
+#endif /* SRC_VIDEOTRANSCODER_H_ */
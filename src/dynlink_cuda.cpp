@@ -16,7 +16,10 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <mutex>
 #include "dynlink_cuda.h"
+#include "MockDriver.h"
 #if INIT_CUDA_GL
 #include "../inc/dynlink_cudaGL.h"
 #endif
@@ -409,7 +412,7 @@ inline CUresult CUDAAPI cuInitD3D11(unsigned int Flags, int cudaVersion, CUDADRI
 #endif
 
 
-CUresult CUDAAPI cuInit(unsigned int Flags, int cudaVersion, void *pHandleDriver)
+static CUresult LoadCudaDriver(unsigned int Flags, int cudaVersion, void *pHandleDriver)
 {
     CUDADRIVER CudaDrvLib;
     int driverVer = 1000;
@@ -664,3 +667,32 @@ CUresult CUDAAPI cuInit(unsigned int Flags, int cudaVersion, void *pHandleDriver
     return CUDA_SUCCESS;
 }
 
+// The driver is loaded and its entry points resolved once per process, later
+// calls (from any thread) only return the result; Flags and cudaVersion of
+// the first successful call apply. A failed load is retried by the next call.
+// With MockDriver enabled no library is loaded and the entry points are the
+// mock's.
+CUresult CUDAAPI cuInit(unsigned int Flags, int cudaVersion, void *pHandleDriver)
+{
+    static std::atomic<bool> bLoaded(false);
+    static std::mutex loadMutex;
+    static CUDADRIVER CudaDrvLib;
+
+    if (!bLoaded.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        if (!bLoaded.load(std::memory_order_relaxed))
+        {
+            if (MockDriver::IsEnabled())
+                CHECKED_CALL(MockDriver::LoadCuda());
+            else
+                CHECKED_CALL(LoadCudaDriver(Flags, cudaVersion, &CudaDrvLib));
+            bLoaded.store(true, std::memory_order_release);
+        }
+    }
+    if (pHandleDriver != NULL)
+    {
+        memcpy(pHandleDriver, &CudaDrvLib, sizeof(CUDADRIVER));
+    }
+    return CUDA_SUCCESS;
+}
@@ -11,7 +11,10 @@
 
 
 #include <stdio.h>
+#include <atomic>
+#include <mutex>
 #include "dynlink_nvcuvid.h"
+#include "MockDriver.h"
 
 tcuvidCreateVideoSource               *cuvidCreateVideoSource;
 tcuvidCreateVideoSourceW              *cuvidCreateVideoSourceW;
@@ -155,7 +158,7 @@ static CUresult LOAD_LIBRARY(DLLDRIVER *pInstance)
 #define GET_PROC(name)          GET_PROC_REQUIRED(name)
 #define GET_PROC_V2(name)       GET_PROC_EX_V2(name,name,1)
 
-CUresult CUDAAPI cuvidInit()
+static CUresult LoadCuvidDriver()
 {
     DLLDRIVER DriverLib;
 
@@ -197,3 +200,24 @@ CUresult CUDAAPI cuvidInit()
 
     return CUDA_SUCCESS;
 }
+
+// Loaded once per process, see cuInit. A failed load is retried.
+CUresult CUDAAPI cuvidInit()
+{
+    static std::atomic<bool> bLoaded(false);
+    static std::mutex loadMutex;
+
+    if (!bLoaded.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        if (!bLoaded.load(std::memory_order_relaxed))
+        {
+            if (MockDriver::IsEnabled())
+                CHECKED_CALL(MockDriver::LoadCuvid());
+            else
+                CHECKED_CALL(LoadCuvidDriver());
+            bLoaded.store(true, std::memory_order_release);
+        }
+    }
+    return CUDA_SUCCESS;
+}